@@ -1,71 +1,103 @@
 #include "arp.h"
 
-#include <map>
 #include <mutex>
+#include <atomic>
 #include <cstring>
-#include <condition_variable>
+#include <deque>
+#include <unordered_map>
 #include "packetio.h"
 #include "device.h"
 #include "logger.h"
 #include "pnx_utils.h"
-
-struct InAddrHash {
-    std::size_t operator()(const in_addr& addr) const {
-        return std::hash<uint32_t>()(addr.s_addr);
-    }
+#include "timer_wheel.h"
+#include "pnx_ip.h"
+
+static const int kARPTimeout = 1000; // milliseconds, between two requests
+static const int kARPMaxTries = 3;
+// at most so many packets wait for one neighbour; the oldest is dropped beyond it.
+static const size_t kARPPendingMax = 32;
+// a reply proves the neighbour for so long.
+static const int kARPReachableMs = 30000;
+// an unused stale neighbour is forgotten after so long.
+static const int kARPGcMs = 60000;
+// how often the table is checked while a request is outstanding, and otherwise.
+static const int kARPSweepMs = 100;
+static const int kARPIdleSweepMs = 1000;
+
+enum NeighbourState {
+    NEIGH_INCOMPLETE, // no MAC address yet; packets wait in `packets`.
+    NEIGH_REACHABLE,  // confirmed by a reply within kARPReachableMs.
+    NEIGH_STALE,      // not confirmed lately. still used; a use makes it probed.
+    NEIGH_PROBE,      // in use, and being confirmed by unicast requests.
 };
 
-static std::mutex arp_mutex_; // a big lock for the whole ARP module
-static std::unordered_map<in_addr, ether_addr, InAddrHash> cache_;
+// the MAC address packed in the low 48 bits, so that it's read and written at once.
+static const uint64_t kMacValid = 1ull << 63;
 
-// A cv will be constructed when an ARP request is sent.
-// It's shared by every thread that wants to query the same 
-// IP when waiting for response.
-// The cv will notify all waiting threads when the ARP reply is received.
-// And it will be extracted from the map. After every shared_ptr to 
-// it is destructed, the cv will be destructed and freed.
-static std::unordered_map<in_addr, std::shared_ptr<std::condition_variable>, 
-    InAddrHash> outstanding_requests_;
+static uint64_t _pack_mac(const ether_addr &mac) {
+    uint64_t v = 0;
+    memcpy(&v, mac.ether_addr_octet, ETH_ALEN);
+    return v | kMacValid;
+}
 
-static const int kARPTimeout = 1000; // milliseconds
-// static const int kARPTimeout = 50000000; // milliseconds
+static ether_addr _unpack_mac(uint64_t v) {
+    ether_addr mac;
+    memcpy(mac.ether_addr_octet, &v, ETH_ALEN);
+    return mac;
+}
 
-int ARPQuery(int dev_id, const in_addr target_ip, ether_addr* target_mac) {
-    std::unique_lock<std::mutex> lock(arp_mutex_);
-    logTrace("ARPQuery called. dev_id=%d, for ip %s", 
-        dev_id, inet_ntoa_safe(target_ip).get());
+struct Neighbour {
+    const int dev_id;
+    const in_addr ip;
 
-    if (cache_.find(target_ip) != cache_.end()) {
+    // read without the lock by the senders.
+    std::atomic<uint64_t> mac{0};
+    std::atomic<long long> used_us{0};
 
-        logTrace("hit ARP cache. dev_id=%d, for ip %s", 
-            dev_id, inet_ntoa_safe(target_ip).get());
+    // protected by arp_mutex_.
+    NeighbourState state = NEIGH_INCOMPLETE;
+    long long updated_us = 0; // when the state was entered.
+    int tries = 0;
+    long long next_try_us = 0;
+    std::deque<PacketPtr> packets;
 
-        *target_mac = cache_[target_ip];
-        return 0;
-    }
+    Neighbour(int dev_id, in_addr ip) : dev_id(dev_id), ip(ip) {}
+};
 
-    if (outstanding_requests_.find(target_ip) != outstanding_requests_.end()) {
+typedef std::unordered_map<uint64_t, std::shared_ptr<Neighbour>> NeighbourMap;
 
-        logTrace("new wait for ARP reply. dev_id=%d, for ip %s", 
-            dev_id, inet_ntoa_safe(target_ip).get());
+static uint64_t _key(int dev_id, in_addr ip) {
+    return (uint64_t)(uint32_t)dev_id << 32 | ip.s_addr;
+}
 
-        auto cv = outstanding_requests_[target_ip];
-        bool succ = cv->wait_for(lock, std::chrono::milliseconds(kARPTimeout),
-            [&]() { return cache_.count(target_ip); });
-        
-        if (!succ) {
-            logError("ARP request timeout. dev_id=%d, for ip %s", dev_id, inet_ntoa_safe(target_ip).get());
-            return -1;
-        }
-        
-        *target_mac = cache_[target_ip];
-        return 0;
+static std::mutex arp_mutex_; // a big lock for the whole ARP module, but not for the lookups.
+static NeighbourMap table_;   // protected by arp_mutex_.
+
+// a copy of table_ for the lookups, replaced whenever a neighbour is added or removed.
+// the neighbours themselves are shared, so a changed MAC address shows up without a new copy.
+static std::shared_ptr<const NeighbourMap> published_ = std::make_shared<NeighbourMap>();
+
+static void _publish() {
+    std::atomic_store(&published_, std::shared_ptr<const NeighbourMap>(std::make_shared<NeighbourMap>(table_)));
+}
+
+static void _sweep();
+
+// the callback is set once here. the timer thread may be running it while it's rescheduled.
+static Timer sweep_timer_{_sweep};
+static bool sweep_scheduled_ = false; // protected by arp_mutex_
+
+static void _schedule_sweep() {
+    if (!sweep_scheduled_) {
+        sweep_scheduled_ = true;
+        timer_schedule(&sweep_timer_, kARPSweepMs * 1000);
     }
+}
 
-    // send ARP request
-    // construct it first
-    char frame[ETHER_MAX_LEN];
-    struct ether_arp *arp = (struct ether_arp*)frame;
+// `dest` is the broadcast address, or the known MAC when probing.
+static int _send_request(int dev_id, const in_addr target_ip, const ether_addr *dest) {
+    PacketPtr frame = packet_alloc();
+    struct ether_arp *arp = (struct ether_arp*)frame->append(sizeof(struct ether_arp));
     struct arphdr *arp_header = &arp->ea_hdr;
 
     // fill in the arp header
@@ -81,73 +113,249 @@ int ARPQuery(int dev_id, const in_addr target_ip, ether_addr* target_mac) {
     memset(arp->arp_tha, 0, ETH_ALEN);
     memcpy(arp->arp_tpa, &target_ip, sizeof(in_addr));
 
-
-    auto cv = std::make_shared<std::condition_variable>();
-    outstanding_requests_[target_ip] = cv;
-    
     logTrace("send a new ARP request. dev_id=%d, for ip %s", 
         dev_id, inet_ntoa_safe(target_ip).get());
 
-    int result = send_frame(frame, sizeof(struct ether_arp), ETHERTYPE_ARP, &kBroadcast, dev_id);
+    int result = send_frame(std::move(frame), ETHERTYPE_ARP, dest, dev_id);
     if (result != 0) {
         logError("fail to send ARP request. dev_id=%d", dev_id);
-        outstanding_requests_.extract(target_ip);
-        return result;
     }
+    return result;
+}
+
+static void _set_state(Neighbour *n, NeighbourState state, long long now) {
+    n->state = state;
+    n->updated_us = now;
+    n->tries = 0;
+}
 
+// move the neighbours along as time passes: ask again, probe, forget.
+static void _sweep() {
+    std::lock_guard<std::mutex> lock(arp_mutex_);
+    long long now = get_time_us();
+    bool removed = false, forgotten = false, busy = false;
+    for (auto it = table_.begin(); it != table_.end(); ) {
+        Neighbour *n = it->second.get();
+        long long used = n->used_us.load(std::memory_order_relaxed);
+
+        if (n->state == NEIGH_REACHABLE && now - n->updated_us >= kARPReachableMs * 1000LL) {
+            // refresh a neighbour in use before its address is doubted, so that senders never wait.
+            if (used > n->updated_us) {
+                _set_state(n, NEIGH_PROBE, now);
+            } else {
+                _set_state(n, NEIGH_STALE, now);
+            }
+        }
+        if (n->state == NEIGH_STALE) {
+            if (used > n->updated_us) {
+                _set_state(n, NEIGH_PROBE, now);
+            } else if (now - n->updated_us >= kARPGcMs * 1000LL) {
+                it = table_.erase(it);
+                removed = forgotten = true;
+                continue;
+            }
+        }
 
-    // give away the lock and wait the cv for kARPTimeout milliseconds
-    bool succ = cv->wait_for(lock, std::chrono::milliseconds(kARPTimeout), [&]() {
-        return cache_.count(target_ip);
-    });
+        if (n->state == NEIGH_INCOMPLETE || n->state == NEIGH_PROBE) {
+            busy = true;
+            if (now >= n->next_try_us) {
+                if (n->tries >= kARPMaxTries) {
+                    if (n->state == NEIGH_INCOMPLETE) {
+                        logError("ARP request timeout, drop %zu packets. dev_id=%d, for ip %s", 
+                            n->packets.size(), n->dev_id, inet_ntoa_safe(n->ip).get());
+                    } else {
+                        logWarning("neighbour %s stops answering ARP. dev_id=%d", 
+                            inet_ntoa_safe(n->ip).get(), n->dev_id);
+                        forgotten = true;
+                    }
+                    it = table_.erase(it);
+                    removed = true;
+                    continue;
+                }
+                if (n->state == NEIGH_PROBE) {
+                    ether_addr mac = _unpack_mac(n->mac.load(std::memory_order_relaxed));
+                    _send_request(n->dev_id, n->ip, &mac);
+                } else {
+                    _send_request(n->dev_id, n->ip, &kBroadcast);
+                }
+                n->tries++;
+                n->next_try_us = now + kARPTimeout * 1000LL;
+            }
+        }
+        ++it;
+    }
+    if (removed)
+        _publish();
+    // the routes cached on it must be looked up again.
+    if (forgotten)
+        ip_dst_invalidate();
+
+    sweep_scheduled_ = !table_.empty();
+    if (sweep_scheduled_)
+        timer_schedule(&sweep_timer_, (busy ? kARPSweepMs : kARPIdleSweepMs) * 1000);
+}
 
-    if (!succ) {
-        logError("ARP request timeout. dev_id=%d, for ip %s", dev_id, inet_ntoa_safe(target_ip).get());
-        outstanding_requests_.extract(target_ip);
-        return -1;
+// learn the MAC address of a neighbour. a confirmed one is reachable, otherwise just known (stale).
+// return the packets that waited for it, to be sent after the lock is released.
+static std::deque<PacketPtr> _learn(int dev_id, const in_addr ip, const ether_addr &mac, bool confirmed, bool create) {
+    long long now = get_time_us();
+    auto it = table_.find(_key(dev_id, ip));
+    if (it == table_.end()) {
+        if (!create)
+            return {};
+        auto n = std::make_shared<Neighbour>(dev_id, ip);
+        n->mac.store(_pack_mac(mac), std::memory_order_release);
+        _set_state(n.get(), confirmed ? NEIGH_REACHABLE : NEIGH_STALE, now);
+        table_.emplace(_key(dev_id, ip), std::move(n));
+        _publish();
+        _schedule_sweep();
+        return {};
     }
 
-    *target_mac = cache_[target_ip];
+    Neighbour *n = it->second.get();
+    uint64_t packed = _pack_mac(mac);
+    bool changed = n->mac.load(std::memory_order_relaxed) != packed;
+    if (changed && n->state != NEIGH_INCOMPLETE) {
+        char buf[32];
+        logInfo("neighbour %s moves to %s. dev_id=%d", 
+            inet_ntoa_safe(ip).get(), ether_ntoa_r(&mac, buf), dev_id);
+    }
+    n->mac.store(packed, std::memory_order_release);
+    if (confirmed) {
+        _set_state(n, NEIGH_REACHABLE, now);
+    } else if (changed || n->state == NEIGH_INCOMPLETE) {
+        _set_state(n, NEIGH_STALE, now);
+    }
+    return std::move(n->packets);
+}
+
+static void _flush(int dev_id, const in_addr ip, const ether_addr &mac, std::deque<PacketPtr> packets) {
+    for (auto &pkt : packets) {
+        if (send_frame(std::move(pkt), ETHERTYPE_IP, &mac, dev_id) != 0)
+            logWarning("fail to send a packet waiting for ARP. for ip %s", inet_ntoa_safe(ip).get());
+    }
+}
+
+// send to a resolved neighbour, without the lock.
+static int _neigh_output(Neighbour *n, uint64_t mac, PacketPtr pkt) {
+    // tell the sweep that the neighbour is in use. a coarse clock saves writes to a shared line.
+    long long now = get_time_us();
+    if (now - n->used_us.load(std::memory_order_relaxed) > 1000)
+        n->used_us.store(now, std::memory_order_relaxed);
+    ether_addr dest = _unpack_mac(mac);
+    return send_frame(std::move(pkt), ETHERTYPE_IP, &dest, n->dev_id);
+}
+
+std::shared_ptr<Neighbour> ARPNeighbour(int dev_id, const in_addr next_hop) {
+    auto table = std::atomic_load(&published_);
+    auto it = table->find(_key(dev_id, next_hop));
+    if (it == table->end() || (it->second->mac.load(std::memory_order_acquire) & kMacValid) == 0)
+        return nullptr;
+    return it->second;
+}
+
+int ARPNeighbourOutput(Neighbour *n, PacketPtr pkt) {
+    // a resolved neighbour never loses its address; it may only move.
+    return _neigh_output(n, n->mac.load(std::memory_order_acquire), std::move(pkt));
+}
+
+int ARPOutput(int dev_id, const in_addr next_hop, PacketPtr pkt) {
+    uint64_t key = _key(dev_id, next_hop);
+
+    // the hot path: a known neighbour, without the lock.
+    {
+        auto table = std::atomic_load(&published_);
+        auto it = table->find(key);
+        if (it != table->end()) {
+            uint64_t mac = it->second->mac.load(std::memory_order_acquire);
+            if (mac & kMacValid)
+                return _neigh_output(it->second.get(), mac, std::move(pkt));
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(arp_mutex_);
+    auto it = table_.find(key);
+    if (it == table_.end()) {
+        // a new neighbour. ask for it at once.
+        auto n = std::make_shared<Neighbour>(dev_id, next_hop);
+        n->tries = 1;
+        n->next_try_us = get_time_us() + kARPTimeout * 1000LL;
+        it = table_.emplace(key, std::move(n)).first;
+        _publish();
+        _send_request(dev_id, next_hop, &kBroadcast);
+        _schedule_sweep();
+    }
+
+    Neighbour *n = it->second.get();
+    uint64_t mac = n->mac.load(std::memory_order_relaxed);
+    if (mac & kMacValid) {
+        // resolved since the lookup above.
+        std::shared_ptr<Neighbour> hold = it->second;
+        lock.unlock();
+        return _neigh_output(hold.get(), mac, std::move(pkt));
+    }
+
+    if (n->packets.size() >= kARPPendingMax) {
+        logWarning("too many packets wait for ARP, drop the oldest. for ip %s", 
+            inet_ntoa_safe(next_hop).get());
+        n->packets.pop_front();
+    }
+    n->packets.push_back(std::move(pkt));
     return 0;
 }
 
 int ARPHandler(int dev_id, const char* ether_frame) {
-    std::unique_lock<std::mutex> guard(arp_mutex_);
     logTrace("ARPHandler called. dev_id=%d", dev_id);
 
     const struct ether_arp *arp = (struct ether_arp*)(ether_frame + ETH_HLEN);
-    if (arp->ea_hdr.ar_op == htons(ARPOP_REPLY)) {
-
-        in_addr target_ip;
-        ether_addr target_mac;
-
-        memcpy(&target_ip, arp->arp_spa, sizeof(in_addr));
-        memcpy(&target_mac, arp->arp_sha, ETH_ALEN);
-        cache_.emplace(target_ip, target_mac);
+    in_addr sender_ip, target_ip;
+    ether_addr sender_mac;
+    memcpy(&sender_ip, arp->arp_spa, sizeof(in_addr));
+    memcpy(&target_ip, arp->arp_tpa, sizeof(in_addr));
+    memcpy(&sender_mac, arp->arp_sha, ETH_ALEN);
+
+    if (memcmp(&sender_mac, dev_mac(dev_id), ETH_ALEN) == 0) {
+        return 0; // our own
+    }
+    bool for_me = target_ip.s_addr == dev_ip(dev_id)->s_addr;
+    // a neighbour announcing itself, e.g. after its address moved.
+    bool gratuitous = sender_ip.s_addr == target_ip.s_addr;
 
-        if (outstanding_requests_.find(target_ip) == outstanding_requests_.end()) {
+    if (arp->ea_hdr.ar_op == htons(ARPOP_REPLY)) {
+        std::unique_lock<std::mutex> guard(arp_mutex_);
+        if (!gratuitous && table_.count(_key(dev_id, sender_ip)) == 0) {
             logWarning("recv an ARP reply that is not requested. dev_id=%d, for ip %s", 
-                dev_id, inet_ntoa_safe(target_ip).get());
+                dev_id, inet_ntoa_safe(sender_ip).get());
             return -1;
         }
 
-
         logTrace("recv an ARP reply. dev_id=%d, for ip %s", 
-            dev_id, inet_ntoa_safe(target_ip).get());
+            dev_id, inet_ntoa_safe(sender_ip).get());
 
-        auto cv = outstanding_requests_.extract(target_ip).mapped();
-        cv->notify_all();
+        // flush the packets waiting for it, in order.
+        auto packets = _learn(dev_id, sender_ip, sender_mac, for_me, false);
+        guard.unlock();
+        _flush(dev_id, sender_ip, sender_mac, std::move(packets));
         return 0;
         
     } else if (arp->ea_hdr.ar_op == htons(ARPOP_REQUEST)) {
-        
-        // TODO: check if the request is for me
-        
+
+        // the sender is likely to talk to us soon, so learn it if the request is for us.
+        // otherwise only refresh what we know already.
+        {
+            std::unique_lock<std::mutex> guard(arp_mutex_);
+            auto packets = _learn(dev_id, sender_ip, sender_mac, false, for_me && !gratuitous);
+            guard.unlock();
+            _flush(dev_id, sender_ip, sender_mac, std::move(packets));
+        }
+        if (!for_me || gratuitous) {
+            return 0;
+        }
 
         // reply back the ARP request
         // construct it
-        char eth_payload[ETHER_MAX_LEN];
-        struct ether_arp *arp_reply = (struct ether_arp*)eth_payload;
+        PacketPtr eth_payload = packet_alloc();
+        struct ether_arp *arp_reply = (struct ether_arp*)eth_payload->append(sizeof(struct ether_arp));
         struct arphdr *arp_header = &arp_reply->ea_hdr;
 
         // fill in the arp header
@@ -166,7 +374,7 @@ int ARPHandler(int dev_id, const char* ether_frame) {
         logTrace("recv an ARP request for dev_id=%d, from ip %s, for ip %s", 
             dev_id, inet_ntoa_safe(*(in_addr*)arp->arp_spa).get(), inet_ntoa_safe(*(in_addr*)arp->arp_tpa).get());
 
-        int result = send_frame(eth_payload, sizeof(struct ether_arp), 
+        int result = send_frame(std::move(eth_payload), 
             ETHERTYPE_ARP, (ether_addr*)arp->arp_sha, dev_id);
         
         if (result != 0) {
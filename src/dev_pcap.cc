@@ -0,0 +1,89 @@
+#include "dev_backend.h"
+#include "logger.h"
+
+#include <cstring>
+
+class PcapBackend : public DevBackend {
+    pcap_t *handle_;
+
+    struct DispatchCtx {
+        FrameHandler handler;
+        void *user;
+    };
+
+    static void _pcap_handler(u_char *ctx, const struct pcap_pkthdr *h, const u_char *bytes) {
+        DispatchCtx *c = (DispatchCtx *)ctx;
+        c->handler(c->user, bytes, h->caplen, h->len);
+    }
+
+public:
+    explicit PcapBackend(pcap_t *handle) : handle_(handle) {}
+    ~PcapBackend() { pcap_close(handle_); }
+
+    const char *kind() const { return "pcap"; }
+
+    int dispatch(FrameHandler handler, void *user) {
+        DispatchCtx ctx{handler, user};
+        return pcap_dispatch(handle_, -1, _pcap_handler, (u_char *)&ctx);
+    }
+
+    int send(PacketBuf *const *frames, size_t n) {
+        int sent = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (pcap_inject(handle_, frames[i]->data(), frames[i]->len) != (int)frames[i]->len) {
+                logError("fail to send eth frame. errmsg=%s", pcap_geterr(handle_));
+                continue;
+            }
+            sent++;
+        }
+        return sent;
+    }
+
+    int selectable_fd() { return pcap_get_selectable_fd(handle_); }
+
+    pcap_t *pcap_handle() { return handle_; }
+};
+
+DevBackend *dev_pcap_open(const char *device) {
+    // use pcap_create and pcap_activate and pcap_set_immediate_mode
+    // to avoid the delay of pcap_open_live.
+
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *handle = pcap_open_live(device, (1 << 20), 1, 1, errbuf);
+    if (handle == NULL) {
+        logError("fail to create pcap handle. errmsg=%s", errbuf);
+        return nullptr;
+    }
+    if (pcap_setnonblock(handle, 1, errbuf) != 0) {
+        logError("fail to set pcap handle nonblock. errmsg=%s", errbuf);
+        pcap_close(handle);
+        return nullptr;
+    }
+    // if (pcap_set_immediate_mode(handle, 1) != 0) {
+    //     logError("fail to set pcap immediate mode. errmsg=%s", pcap_geterr(handle));
+    //     pcap_close(handle);
+    //     return nullptr;
+    // }
+    // if (pcap_activate(handle) != 0) {
+    //     logError("fail to activate pcap handle. errmsg=%s", pcap_geterr(handle));
+    //     pcap_close(handle);
+    //     return nullptr;
+    // }
+    return new PcapBackend(handle);
+}
+
+DevBackend *dev_backend_open(const char *device, const char *kind) {
+    if (strcmp(kind, "pcap") == 0)
+        return dev_pcap_open(device);
+    if (strcmp(kind, "tpacket") == 0)
+        return dev_tpacket_open(device);
+    if (strcmp(kind, "auto") == 0) {
+        DevBackend *backend = dev_tpacket_open(device);
+        if (backend != nullptr)
+            return backend;
+        logWarning("tpacket backend is not available for %s, fall back to pcap", device);
+        return dev_pcap_open(device);
+    }
+    logError("unknown device backend %s", kind);
+    return nullptr;
+}
@@ -0,0 +1,221 @@
+#include "dev_backend.h"
+#include "logger.h"
+
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+// the RX ring: 32 blocks of 256 KB. a block is handed to us when it's full, or after kRxBlockTimeout ms.
+static const unsigned kRxBlockSize = 1 << 18;
+static const unsigned kRxBlockNr = 32;
+static const unsigned kRxBlockTimeout = 1; // ms
+// the TX ring: 512 frames of 2 KB.
+static const unsigned kTxBlockSize = 1 << 16;
+static const unsigned kTxBlockNr = 16;
+static const unsigned kFrameSize = 2048;
+
+// where the frame starts in a TX slot, without PACKET_TX_HAS_OFF.
+static const size_t kTxDataOffset = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+
+class TpacketBackend : public DevBackend {
+    int fd_;
+    char *map_;
+    size_t map_len_;
+
+    struct tpacket_req3 rx_req_;
+    struct tpacket_req3 tx_req_; // zeroed if there is no TX ring.
+    char *rx_;
+    char *tx_;
+    unsigned rx_cur_ = 0; // the next block to read
+    unsigned tx_cur_ = 0; // the next frame to fill
+
+    struct tpacket_block_desc *_rx_block(unsigned i) {
+        return (struct tpacket_block_desc *)(rx_ + (size_t)i * rx_req_.tp_block_size);
+    }
+
+    struct tpacket3_hdr *_tx_frame(unsigned i) {
+        return (struct tpacket3_hdr *)(tx_ + (size_t)i * tx_req_.tp_frame_size);
+    }
+
+    bool _tx_frame_free(struct tpacket3_hdr *hdr) {
+        uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+        return (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) == 0;
+    }
+
+    // let the kernel send every frame requested, and wait till they are done.
+    int _tx_kick() {
+        while (::send(fd_, nullptr, 0, 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            logError("fail to kick the tx ring. errmsg=%s", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+public:
+    TpacketBackend(int fd, char *map, size_t map_len, const tpacket_req3 &rx_req, const tpacket_req3 &tx_req)
+        : fd_(fd), map_(map), map_len_(map_len), rx_req_(rx_req), tx_req_(tx_req) {
+        rx_ = map_;
+        tx_ = tx_req_.tp_frame_nr > 0 ? map_ + (size_t)rx_req_.tp_block_size * rx_req_.tp_block_nr : nullptr;
+    }
+
+    ~TpacketBackend() {
+        munmap(map_, map_len_);
+        close(fd_);
+    }
+
+    const char *kind() const { return "tpacket"; }
+
+    // readable once a block is handed to us.
+    int selectable_fd() { return fd_; }
+
+    int dispatch(FrameHandler handler, void *user) {
+        int cnt = 0;
+        while (true) {
+            struct tpacket_block_desc *block = _rx_block(rx_cur_);
+            if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+                break;
+
+            struct tpacket3_hdr *pkt = (struct tpacket3_hdr *)((char *)block + block->hdr.bh1.offset_to_first_pkt);
+            for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+                const struct sockaddr_ll *sll = (const struct sockaddr_ll *)((char *)pkt + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+                // the socket sees what we send, too.
+                if (sll->sll_pkttype != PACKET_OUTGOING) {
+                    handler(user, (const u_char *)pkt + pkt->tp_mac, pkt->tp_snaplen, pkt->tp_len);
+                    cnt++;
+                }
+                pkt = (struct tpacket3_hdr *)((char *)pkt + pkt->tp_next_offset);
+            }
+
+            // give the block back to the kernel.
+            __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            rx_cur_ = (rx_cur_ + 1) % rx_req_.tp_block_nr;
+        }
+        return cnt;
+    }
+
+    int send(PacketBuf *const *frames, size_t n) {
+        if (tx_ == nullptr) {
+            int sent = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (::send(fd_, frames[i]->data(), frames[i]->len, 0) != (ssize_t)frames[i]->len) {
+                    logError("fail to send eth frame. errmsg=%s", strerror(errno));
+                    continue;
+                }
+                sent++;
+            }
+            return sent;
+        }
+
+        int sent = 0, queued = 0; // queued: since the last kick
+        for (size_t i = 0; i < n; i++) {
+            if (frames[i]->len > kFrameSize - kTxDataOffset) {
+                logError("try to send a too large eth frame. frame_len=%zu", frames[i]->len);
+                continue;
+            }
+
+            struct tpacket3_hdr *hdr = _tx_frame(tx_cur_);
+            if (!_tx_frame_free(hdr)) {
+                // the ring is full of frames the kernel has not sent yet.
+                if (queued > 0 && _tx_kick() < 0)
+                    return -1;
+                queued = 0;
+                if (!_tx_frame_free(hdr)) {
+                    logWarning("tx ring is full, drop %zu frames", n - i);
+                    break;
+                }
+            }
+
+            memcpy((char *)hdr + kTxDataOffset, frames[i]->data(), frames[i]->len);
+            hdr->tp_len = frames[i]->len;
+            hdr->tp_next_offset = 0;
+            __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+            tx_cur_ = (tx_cur_ + 1) % tx_req_.tp_frame_nr;
+            queued++;
+            sent++;
+        }
+
+        // one syscall for the whole batch.
+        if (queued > 0 && _tx_kick() < 0)
+            return -1;
+        return sent;
+    }
+};
+
+DevBackend *dev_tpacket_open(const char *device) {
+    unsigned ifindex = if_nametoindex(device);
+    if (ifindex == 0) {
+        logWarning("tpacket: no such device %s", device);
+        return nullptr;
+    }
+
+    // no protocol yet: it would capture from every device until the bind() below.
+    int fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0) {
+        logWarning("tpacket: fail to create packet socket. errmsg=%s", strerror(errno));
+        return nullptr;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+        logWarning("tpacket: TPACKET_V3 is not supported. errmsg=%s", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    struct tpacket_req3 rx_req;
+    memset(&rx_req, 0, sizeof(rx_req));
+    rx_req.tp_block_size = kRxBlockSize;
+    rx_req.tp_block_nr = kRxBlockNr;
+    rx_req.tp_frame_size = kFrameSize;
+    rx_req.tp_frame_nr = kRxBlockSize / kFrameSize * kRxBlockNr;
+    rx_req.tp_retire_blk_tov = kRxBlockTimeout;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) != 0) {
+        logWarning("tpacket: fail to set up rx ring. errmsg=%s", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    // older kernels take no V3 TX ring. send() each frame then.
+    struct tpacket_req3 tx_req;
+    memset(&tx_req, 0, sizeof(tx_req));
+    tx_req.tp_block_size = kTxBlockSize;
+    tx_req.tp_block_nr = kTxBlockNr;
+    tx_req.tp_frame_size = kFrameSize;
+    tx_req.tp_frame_nr = kTxBlockSize / kFrameSize * kTxBlockNr;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) != 0) {
+        logWarning("tpacket: no tx ring, send frames one by one. errmsg=%s", strerror(errno));
+        memset(&tx_req, 0, sizeof(tx_req));
+    }
+
+    size_t map_len = (size_t)rx_req.tp_block_size * rx_req.tp_block_nr
+        + (size_t)tx_req.tp_block_size * tx_req.tp_block_nr;
+    void *map = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        logWarning("tpacket: fail to map the rings. errmsg=%s", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL); // start capturing, on this device only
+    addr.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        logWarning("tpacket: fail to bind to %s. errmsg=%s", device, strerror(errno));
+        munmap(map, map_len);
+        close(fd);
+        return nullptr;
+    }
+
+    logInfo("tpacket: %s opened, tx ring %s", device, tx_req.tp_frame_nr > 0 ? "on" : "off");
+    return new TpacketBackend(fd, (char *)map, map_len, rx_req, tx_req);
+}
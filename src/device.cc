@@ -8,8 +8,8 @@
 #include <errno.h>
 #include <netinet/ether.h>
 #include <mutex>
-
-#define MAX_DEVICE_NUM 256
+#include <string>
+#include <algorithm>
 
 // it may share with multiple threads.
 static std::atomic<int> device_count{0}; 
@@ -18,10 +18,42 @@ static std::atomic<int> device_count{0};
 static char *dev_name[MAX_DEVICE_NUM];
 static struct ether_addr dev_mac_addr[MAX_DEVICE_NUM];
 static struct in_addr dev_ip_addr[MAX_DEVICE_NUM];
+static size_t dev_mtu_size[MAX_DEVICE_NUM];
 static struct in_addr dev_mask_addr[MAX_DEVICE_NUM];
-static pcap_t *dev[MAX_DEVICE_NUM];
+static DevBackend *dev[MAX_DEVICE_NUM];
+
+// the backend for `device` given by PNX_DEV_BACKEND, e.g. "tpacket", or "veth1-2=pcap,auto".
+// a bare kind is the default for the devices not named. "auto" if not set.
+static std::string _dev_backend_from_env(const char *device) {
+    const char *env = getenv("PNX_DEV_BACKEND");
+    std::string kind = "auto";
+    if (env == nullptr)
+        return kind;
+
+    std::string spec = env;
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string item = spec.substr(pos, end - pos);
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            if (!item.empty())
+                kind = item;
+        } else if (item.compare(0, eq, device) == 0 && eq == strlen(device)) {
+            return item.substr(eq + 1);
+        }
+        pos = end + 1;
+    }
+    return kind;
+}
 
 int add_device(const char* device) {
+    return add_device_backend(device, _dev_backend_from_env(device).c_str());
+}
+
+int add_device_backend(const char* device, const char* kind) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
 
@@ -31,35 +63,17 @@ int add_device(const char* device) {
         fire_distance_upd_daemon();
     });
 
-    // ========== pcap open it ==========
-    // use pcap_create and pcap_activate and pcap_set_immediate_mode
-    // to avoid the delay of pcap_open_live.
-
-    char errbuf[PCAP_ERRBUF_SIZE];
-    pcap_t *handle = pcap_open_live(device, (1 << 20), 1, 1, errbuf);
-    if (handle == NULL) {
-        logError("fail to create pcap handle. errmsg=%s", errbuf);
+    // ========== open it ==========
+    DevBackend *backend = dev_backend_open(device, kind);
+    if (backend == nullptr) {
+        logError("fail to open device %s on backend %s", device, kind);
         return -1;
     }
-    if (pcap_setnonblock(handle, 1, errbuf) != 0) {
-        logError("fail to set pcap handle nonblock. errmsg=%s", errbuf);
-        pcap_close(handle);
-        return -1;
-    }
-    // if (pcap_set_immediate_mode(handle, 1) != 0) {
-    //     logError("fail to set pcap immediate mode. errmsg=%s", pcap_geterr(handle));
-    //     pcap_close(handle);
-    //     return -1;
-    // }
-    // if (pcap_activate(handle) != 0) {
-    //     logError("fail to activate pcap handle. errmsg=%s", pcap_geterr(handle));
-    //     pcap_close(handle);
-    //     return -1;
-    // }
 
-    int new_id = atomic_fetch_add(&device_count, 1);
+    // not visible until it can send, see below. adding devices is serialized by the lock.
+    int new_id = atomic_load(&device_count);
 
-    dev[new_id] = handle;
+    dev[new_id] = backend;
     dev_name[new_id] = strdup(device);
 
     // ========== query mac address  ==========
@@ -93,17 +107,31 @@ int add_device(const char* device) {
         return -1;
     }
     memcpy(&dev_mask_addr[new_id], &((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr, sizeof(in_addr));
+
+    // ========== query mtu ==========
+    // frames are built in packet buffers sized for Ethernet, so a larger MTU (e.g. of lo) is not used.
+    // the kernel counts the CRC trailer we append (see send_frame()) as payload, so it's left out.
+    if (ioctl(sockfd, SIOCGIFMTU, &ifr) < 0 || ifr.ifr_mtu <= ETHER_CRC_LEN) {
+        logWarning("can not get device mtu, use %d. errmsg=%s", ETHERMTU - ETHER_CRC_LEN, strerror(errno));
+        dev_mtu_size[new_id] = ETHERMTU - ETHER_CRC_LEN;
+    } else {
+        dev_mtu_size[new_id] = std::min<size_t>(ifr.ifr_mtu - ETHER_CRC_LEN, ETHERMTU);
+    }
     close(sockfd);
 
 
-    // ========== fire recv thread ==========
+    // ========== fire tx and recv threads ==========
+    // the sender first: an ARP reply from the receiver, or a DV update to every visible device,
+    // may be sent as soon as the device is up.
+    tx_thread_go(new_id, backend);
+    atomic_store(&device_count, new_id + 1);
     recv_thread_go(new_id);
 
     char buf[PNX_MAC_STR_LEN];
-    logInfo("added device %s, id=%d, MAC=%s, IP=%s, subnet_mask=%s", device, 
-        new_id, mac_to_str(dev_mac_addr[new_id].ether_addr_octet, buf), 
+    logInfo("added device %s, id=%d, backend=%s, MAC=%s, IP=%s, subnet_mask=%s, mtu=%zu", device, 
+        new_id, backend->kind(), mac_to_str(dev_mac_addr[new_id].ether_addr_octet, buf), 
         inet_ntoa_safe(dev_ip_addr[new_id]).get(),
-        inet_ntoa_safe(dev_mask_addr[new_id]).get());
+        inet_ntoa_safe(dev_mask_addr[new_id]).get(), dev_mtu_size[new_id]);
 
 
     // ========== add to routing table ==========
@@ -140,6 +168,14 @@ const in_addr *dev_ip(int id) {
     return &dev_ip_addr[id];
 }
 
+size_t dev_mtu(int id) {
+    if (!is_valid_id(id)) {
+        logError("try to get invalid device mtu. id=%d", id);
+        return 0;
+    }
+    return dev_mtu_size[id];
+}
+
 const in_addr *dev_mask(int id) {
     if (!is_valid_id(id)) {
         logError("try to get invalid device mask. id=%d", id);
@@ -157,6 +193,14 @@ pcap_t* get_pcap_handle(int id) {
         logError("try to get invalid device pcap handle. id=%d", id);
         return NULL;
     }
+    return dev[id]->pcap_handle();
+}
+
+DevBackend* get_dev_backend(int id) {
+    if (!is_valid_id(id)) {
+        logError("try to get invalid device backend. id=%d", id);
+        return nullptr;
+    }
     return dev[id];
 }
 
@@ -5,19 +5,55 @@
 #include <netinet/ip.h>
 #include <netinet/if_ether.h>
 #include <memory>
-#include <semaphore.h>
 
+#include "packet_buf.h"
 
-// a very simplified implementation of ARP.
-// the cache is never expired, for now. 
-// If needed, a TTL mechanism can be added.
 
+/*
+    Design doc of ARP.
 
-// query the MAC address.
+Functionality.
+    A neighbour table per device, in the spirit of RFC 1122 2.3.2.1 and Linux's.
+    A neighbour is
+        incomplete: asked for, no reply yet. packets to it wait in its queue, and are sent
+            when the reply comes. the request is sent again every second, and the neighbour
+            is dropped with its queue after 3 tries.
+        reachable: confirmed by a reply in the last 30 s.
+        stale: not confirmed lately, but its address is still used. forgotten after
+            60 s without use.
+        probe: used after it was reachable or stale. it's confirmed again by unicast
+            requests while its address stays in use, and dropped after 3 tries.
+    So a known neighbour is refreshed in the background, and senders never wait for it.
+
+    The sender of a request for us is learned as stale. Other requests and gratuitous ARP
+    only update the neighbours we know, e.g. when an address moves to another host.
+
+Users.
+    IP sends through ARPOutput(). packetio hands ARP frames to ARPHandler().
+
+Synchronizations.
+    A big lock for the table. Senders look up a copy of it without the lock: the copy is
+    replaced when neighbours are added or removed, and the MAC address of a neighbour is
+    read and written atomically.
+
+*/
+
+// send an IP packet (with its IP header) to the neighbour `next_hop` on the device.
+// if its MAC address is not known yet, the packet is queued and 0 is returned.
+// return 0 on success, -1 on error.
+int ARPOutput(int dev_id, const struct in_addr next_hop, PacketPtr pkt);
+
+struct Neighbour;
+
+// the neighbour `next_hop` on the device, if its MAC address is known. nullptr otherwise.
+// it can be kept to send to it again without a lookup, till it's forgotten, which
+// invalidates the routes cached by IP (see ip_dst_invalidate()).
+std::shared_ptr<Neighbour> ARPNeighbour(int dev_id, const struct in_addr next_hop);
+
+// send an IP packet to a neighbour from ARPNeighbour(). its current MAC address is used,
+// so a neighbour which moved is followed.
 // return 0 on success, -1 on error.
-// the acquired mac addr is placed at target_mac 
-// blocking, slow.
-int ARPQuery(int dev_id, const struct in_addr target_ip, struct ether_addr *target_mac);
+int ARPNeighbourOutput(Neighbour *n, PacketPtr pkt);
 
 // called by ether frame receiver.
 // ether_frame points to the very header of the ethernet frame.
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <sys/types.h>
+#include <pcap.h>
+
+#include "packet_buf.h"
+
+/*
+    Design doc of device backends.
+
+Functionality.
+    A backend puts frames on and takes them off one device. packetio drives it: the receive
+    thread of the device calls dispatch(), sleeping on selectable_fd() when the device is idle,
+    and its sender thread calls send() with a batch.
+
+    Two backends:
+        pcap: libpcap. Works everywhere libpcap does, and is the fallback.
+        tpacket: an AF_PACKET socket with TPACKET_V3 rings mapped into our memory. The kernel
+            fills the RX ring a block of frames at a time, and we hand the block back when done,
+            so receiving takes no syscall per frame. Frames to send are copied into the TX ring
+            and the whole batch is kicked off with one send(). If the kernel refuses a V3 TX ring,
+            frames are sent by one send() each instead.
+
+    The backend of a device is chosen when it is added: "pcap", "tpacket", or "auto", which
+    tries tpacket first. See add_device_backend() in device.h.
+
+Users.
+    device.cc opens it, packetio.cc drives it.
+
+Synchronizations.
+    None. dispatch() is only called by the receive thread of the device, and send() only by
+    its sender thread.
+
+*/
+
+// called for every frame received. `frame` is only valid during the call.
+typedef void (*FrameHandler)(void *user, const u_char *frame, size_t caplen, size_t len);
+
+class DevBackend {
+public:
+    virtual ~DevBackend() {}
+
+    virtual const char *kind() const = 0;
+
+    // hand the frames received so far to `handler`, without blocking.
+    // return the number of frames handled, or -1 on error.
+    virtual int dispatch(FrameHandler handler, void *user) = 0;
+
+    // send a batch of complete frames. the frames stay owned by the caller.
+    // return the number of frames sent, or -1 on error.
+    virtual int send(PacketBuf *const *frames, size_t n) = 0;
+
+    // an fd which polls readable when frames arrive, or -1 if there is none.
+    virtual int selectable_fd() = 0;
+
+    // the libpcap handle, if it's a pcap backend.
+    virtual pcap_t *pcap_handle() { return nullptr; }
+};
+
+// return nullptr on error.
+DevBackend *dev_pcap_open(const char *device);
+DevBackend *dev_tpacket_open(const char *device);
+
+// `kind` is "pcap", "tpacket" or "auto". return nullptr on error.
+DevBackend *dev_backend_open(const char *device, const char *kind);
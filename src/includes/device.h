@@ -6,6 +6,10 @@
 
 #include <pcap.h>
 
+#include "dev_backend.h"
+
+#define MAX_DEVICE_NUM 256
+
 /**
 * Add a device to the library for sending/receiving packets. 
 *
@@ -14,6 +18,16 @@
 */
 int add_device(const char* device);
 
+/**
+* Same as add_device, on the given backend.
+*
+* @param kind "pcap", "tpacket" (AF_PACKET with mapped TPACKET_V3 rings),
+* or "auto", which is tpacket when available and pcap otherwise.
+* add_device takes it from the environment variable PNX_DEV_BACKEND, either a kind
+* for all devices, or a list like "veth1-2=pcap,auto". It's "auto" if not set.
+*/
+int add_device_backend(const char* device, const char* kind);
+
 /**
 * Find a device added by ‘addDevice‘. 
 *
@@ -27,13 +41,18 @@ int find_device(const char* device);
 const struct ether_addr* dev_mac(int id);
 const struct in_addr* dev_ip(int id);
 const struct in_addr* dev_mask(int id);
+// the largest IP packet the device sends, at most ETHERMTU.
+size_t dev_mtu(int id);
 
 // return 1 for valid and 0 for invalid.
 int is_valid_id(int id);
 
-// return NULL for invalid.
+// return NULL for invalid, or if the device is not on the pcap backend.
 pcap_t* get_pcap_handle(int id);
 
+// return nullptr for invalid.
+DevBackend* get_dev_backend(int id);
+
 // list possible devices
 // n is the number of devices.
 // dont forget to free the list.
@@ -2,12 +2,17 @@
 
 #include <functional>
 
+// the connections are closed first, while the acks of their FINs can still come in.
+// otherwise each one retransmits its FIN with backoff till it gives up.
+#define EXIT_CLEAN_UP_PRIORITY_TCP_CLOSING -100
+
 #define EXIT_CLEAN_UP_PRIORITY_LINK_RECVING 0
 #define EXIT_CLEAN_UP_PRIORITY_IP_RECVING 100
-#define EXIT_CLEAN_UP_PRIORITY_TCP_RECVING 200
+#define EXIT_CLEAN_UP_PRIORITY_TIMER 250
 #define EXIT_CLEAN_UP_PRIORITY_SOCKET_RECVING 300
 
 #define EXIT_CLEAN_UP_PRIORITY_IP_SENDING 400
+#define EXIT_CLEAN_UP_PRIORITY_LINK_SENDING 500
 
 
 void add_exit_clean_up(std::function<void()> func, int priority);
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#include <memory>
+
+/*
+    Design doc of the packet buffer pool.
+
+Functionality.
+    Fixed-size buffers for outgoing packets, in the style of BSD mbufs. Each buffer keeps
+    kPacketHeadroom bytes free in front of its data, so that every layer builds its part in
+    place: TCP writes the segment, IP prepends its header, and packetio prepends the Ethernet
+    header, all into the same buffer. Nothing is copied or allocated on the way down.
+
+    Buffers are recycled, never freed. The pool grows by a batch whenever it runs dry, so its
+    size follows the number of packets in flight at the peak.
+
+Users.
+    Every sender: TCP segments, IP packets, ARP and Ethernet frames.
+    A buffer is owned by a PacketPtr and handed down the layers by moving it, and the layer
+    that consumes the packet (e.g. the one that puts it on the wire) frees it.
+
+Synchronizations.
+    Each thread keeps a cache of free buffers, so allocating and freeing take no lock.
+    A buffer may be freed by another thread than the one that allocated it; the caches then
+    even out through a shared depot, taking its lock once per kPacketCacheBatch buffers.
+    The cache of a thread is handed back to the depot when the thread exits.
+
+*/
+
+const size_t kPacketBufSize = 2048;
+// room for the Ethernet header and an IP header with options, plus some spare.
+const size_t kPacketHeadroom = 128;
+const size_t kPacketCacheBatch = 32;
+
+struct alignas(64) PacketBuf {
+    PacketBuf *next = nullptr; // in a free list
+    size_t off = 0; // where the data starts
+    size_t len = 0;
+
+    static const size_t kRoom = kPacketBufSize - 3 * sizeof(size_t);
+    char room[kRoom];
+
+    char *data() { return room + off; }
+    const char *data() const { return room + off; }
+    char *tail() { return room + off + len; }
+
+    size_t headroom() const { return off; }
+    size_t tailroom() const { return kRoom - off - len; }
+
+    // make the data empty, with the default headroom.
+    void reset() {
+        off = kPacketHeadroom;
+        len = 0;
+    }
+
+    // grow the data by n bytes in front. return the new start.
+    char *prepend(size_t n) {
+        assert(n <= headroom());
+        off -= n;
+        len += n;
+        return data();
+    }
+
+    // grow the data by n bytes at the end. return where they start.
+    char *append(size_t n) {
+        assert(n <= tailroom());
+        char *p = tail();
+        len += n;
+        return p;
+    }
+
+    // drop n bytes at the end.
+    void trim(size_t n) {
+        assert(n <= len);
+        len -= n;
+    }
+};
+static_assert(sizeof(PacketBuf) == kPacketBufSize, "a packet buffer should fill its slot");
+
+void packet_free(PacketBuf *pkt);
+
+struct PacketBufFree {
+    void operator()(PacketBuf *pkt) const { packet_free(pkt); }
+};
+using PacketPtr = std::unique_ptr<PacketBuf, PacketBufFree>;
+
+// an empty buffer with kPacketHeadroom bytes in front. never fails.
+PacketPtr packet_alloc();
+
+// the number of buffers ever created, in use or not.
+size_t packet_pool_size();
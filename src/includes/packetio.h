@@ -6,6 +6,9 @@
 #include <netinet/ether.h>
 #include <functional>
 
+#include "packet_buf.h"
+#include "dev_backend.h"
+
 /**
 * @brief Encapsulate some data into an Ethernet II frame and send it. 
 * @param buf Pointer to the payload.
@@ -18,6 +21,14 @@
 */
 int send_frame(const void* buf, int len, int ethtype, const ether_addr* destmac, int id);
 
+/**
+* @brief Same as above, but the payload is in a packet buffer, and the Ethernet header 
+* is prepended in its headroom instead of copying the payload.
+* @param pkt The payload. It's consumed, whether the frame is sent or not.
+* The frame is queued to the sender thread of the device, and 0 means it was queued.
+*/
+int send_frame(PacketPtr pkt, int ethtype, const ether_addr* destmac, int id);
+
 /**
 * @brief Process a frame upon receiving it. 
 * `buf` points to the workload, instead of frame header.
@@ -45,7 +56,42 @@ int set_frame_receive_callback(FrameReceiveCallback callback);
 
 // create a new thread for this device's packet receiving.
 // must success, or fatal termination. always return 0.
+// the thread polls the device while frames keep coming, and sleeps on it once idle, see set_rx_spin_us().
 int recv_thread_go(int device_id);
 
+// the knob between latency and CPU of the receiving threads: how long a thread keeps polling
+// an idle device before it sleeps until the device has a frame.
+// -1 never sleeps, i.e. burns a core per device for the lowest latency. 0 sleeps at once.
+// the environment variable PNX_RX_SPIN_US sets it at start.
+void set_rx_spin_us(long us);
+
+const long kRxSpinUsDefault = 50;
+// the longest a receiving thread sleeps, so that it notices the exit.
+const int kRxPollTimeoutMs = 100;
+// a backend without a selectable fd is checked at this interval when idle.
+const long kRxSleepUs = 200;
+
+// the number of threads the receiving threads hand IPv4 frames to, spreading the flows by a hash
+// of their addresses and ports, so that one device's frames are processed on several cores.
+// frames of the same flow always go to the same thread, in order.
+// 0 processes frames on the receiving threads. by default, half of the cores if there are 4 or more, else 0.
+// the environment variable PNX_RX_WORKERS overrides it. only takes effect before the first device is added.
+void set_rx_workers(int n);
+
+const size_t kRxWorkersMax = 8;
+// the frames a worker can hold for each device before they are dropped, and how many it takes at once.
+const size_t kRxRingSize = 1024;
+const size_t kRxBatch = 32;
+
+// create a new thread for this device's packet sending.
+// frames are handed to it by send_frame() through a lock-free ring, and sent in batches.
+// it's started before the device is visible, so it's given the backend rather than looking it up.
+// always return 0.
+int tx_thread_go(int device_id, DevBackend *dev);
+
+// the frames a device can hold before send_frame() starts dropping, and how many its sender takes at once.
+const size_t kTxRingSize = 1024;
+const size_t kTxBatch = 32;
+
 
 const struct ether_addr kBroadcast = {{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}};
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+
+
+/* 
+    Design Doc of the readiness API (epoll / poll / select).
+
+Functionality.
+    Let an event loop multiplex PNX sockets (fd >= kSocketMinFd), mixed with real fds.
+    An epoll instance gets a PNX fd as well. Level-triggered, edge-triggered (EPOLLET) 
+    and EPOLLONESHOT are supported as in Linux.
+
+    Readiness is pushed, not scanned. Every socket keeps a list of the epoll items watching it.
+    The TCP layer calls socket_tcp_event() whenever a TCB may have changed, which puts the 
+    items on the ready list of their instance and wakes up epoll_wait through an eventfd.
+    epoll_wait only looks at the ready list, so it costs O(ready), not O(watched).
+    A level-triggered item is put back after being reported, until it's found not ready.
+
+    Real fds given to an instance are kept in a real epoll fd. epoll_wait sleeps in the kernel 
+    on both it and the eventfd, so a wakeup costs one syscall either way.
+    poll() and select() build a temporary instance for their PNX fds, and sleep in the real 
+    poll() with its eventfd appended.
+
+Users.
+    Applications, through the wrapped epoll_create/epoll_create1/epoll_ctl/epoll_wait/poll/select.
+
+Synchronizations.
+    All functions are thread-safe.
+    Lock order: TCB, then socket, then epoll instance. Readiness is computed with no epoll lock held.
+
+Resource management.
+    close() detaches an instance from its sockets. It and its real fds are freed once the
+    epoll_wait() and epoll_ctl() calls still running on it return. Closing a socket removes it
+    from every instance watching it, as Linux does for the last reference of a file.
+
+*/
+
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <poll.h>
+
+#ifdef __cplusplus
+extern "C" {  
+#endif  
+
+int __wrap_epoll_create(int size);
+int __wrap_epoll_create1(int flags);
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+/**
+* @see [POSIX.1-2017:poll](http://pubs.opengroup.org/onlinepubs/
+* 9699919799/functions/poll.html)
+*/
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/**
+* @see [POSIX.1-2017:select](http://pubs.opengroup.org/onlinepubs/
+* 9699919799/functions/select.html)
+* PNX fds beyond FD_SETSIZE can not be represented, use poll or epoll for them.
+*/
+int __wrap_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
+
+
+// declare __real part
+
+int __real_epoll_create(int size);
+int __real_epoll_create1(int flags);
+int __real_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
+
+#ifdef __cplusplus  
+} // extern "C"  
+#endif
+
+// my custom interface
+struct SocketBlock;
+
+// the readiness of `sb` may have changed. wake up the instances watching it.
+// called without the socket lock held.
+void epoll_notify(SocketBlock *sb);
+
+// remove `sb` from every instance watching it. called by close().
+void epoll_forget(SocketBlock *sb);
+
+// close the epoll instance of `fd`. return -1 if `fd` is not one.
+int epoll_close(int fd);
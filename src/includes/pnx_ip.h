@@ -10,18 +10,52 @@
 #include <atomic>
 #include <memory>
 
+#include "packet_buf.h"
+
 
 /**
 * @brief Send an IP packet to specified host.
 * @param src Source IP address.
 * @param dest Destination IP address.
 * @param proto Value of ‘protocol‘ field in IP header.
-* @param buf pointer to IP payload
-* @param len Length of IP payload
-* @return 0 on success, -1 on error.
+* @param pkt IP payload, with room for the IP and Ethernet headers in front.
+* @return 0 on success, -1 on error. Never blocks: if the MAC address of the next hop
+* is not known yet, the packet waits for the ARP reply, and 0 is returned.
 */
 int ip_send_packet(const struct in_addr src, const struct in_addr dest,
-     int proto, std::shared_ptr<char[]> buf, int len);
+     int proto, PacketPtr pkt);
+
+
+struct Neighbour;
+
+// the route to one destination, cached so that a connection sends without looking up
+// the routing table and the neighbour again. it's stale once the routing table changes
+// or the neighbour is forgotten, see ip_dst_valid().
+struct DstEntry {
+    in_addr dest;
+    int dev_id;
+    in_addr next_hop;
+    size_t mtu; // of the device it goes out of
+    std::shared_ptr<Neighbour> neigh;
+    uint64_t generation;
+};
+
+// the route to `dest`, from the cache or looked up now.
+// nullptr if there is no route, or the next hop is not resolved yet; use ip_send_packet() then.
+std::shared_ptr<const DstEntry> ip_dst_lookup(const struct in_addr dest);
+
+// whether `dst` is still current. a single atomic load. false for nullptr.
+bool ip_dst_valid(const DstEntry *dst);
+
+// make every cached route stale. called when the routing table or a neighbour changes.
+void ip_dst_invalidate();
+
+// the MTU of the device the route to `dest` goes out of, even if the next hop is not resolved
+// yet. 0 if there is no route. there is no path MTU discovery, as there is no ICMP.
+size_t ip_route_mtu(const struct in_addr dest);
+
+// like ip_send_packet(), through a route from ip_dst_lookup().
+int ip_send_packet_dst(const struct in_addr src, const DstEntry *dst, int proto, PacketPtr pkt);
 
 
 int ip_packet_handler(const void* buf, int len);
@@ -15,6 +15,8 @@ Users.
 
 Synchronizations.
     The module provides internal synchronizations, i.e. all functions are thread-safe.
+    Blocking calls sleep instead of polling: read/write/connect wait on the TCB (tcp_wait),
+    and accept waits on the listening socket, which TCP fills once a handshake completes.
 
 Resource management.
     For simplicify, we suppose the system have enough resource and do not need to recycle.
@@ -89,6 +91,36 @@ int __wrap_getaddrinfo(const char *node, const char *service, const struct addri
 
 int __wrap_setsockopt(int socket, int level, int option_name, const void *option_value, socklen_t option_len);
 
+/**
+* @see [POSIX.1-2017:getsockopt](http://pubs.opengroup.org/onlinepubs/
+* 9699919799/functions/getsockopt.html)
+*/
+int __wrap_getsockopt(int socket, int level, int option_name, void *option_value, socklen_t *option_len);
+
+/**
+* accept(), with SOCK_NONBLOCK / SOCK_CLOEXEC for the new socket.
+*/
+int __wrap_accept4(int socket, struct sockaddr *address, socklen_t *address_len, int flags);
+
+/**
+* @see [POSIX.1-2017:recv](http://pubs.opengroup.org/onlinepubs/
+* 9699919799/functions/recv.html)
+*/
+ssize_t __wrap_recv(int socket, void *buffer, size_t length, int flags);
+
+/**
+* @see [POSIX.1-2017:send](http://pubs.opengroup.org/onlinepubs/
+* 9699919799/functions/send.html)
+*/
+ssize_t __wrap_send(int socket, const void *buffer, size_t length, int flags);
+
+/**
+* @see [POSIX.1-2017:fcntl](http://pubs.opengroup.org/onlinepubs/
+* 9699919799/functions/fcntl.html)
+* only F_GETFL / F_SETFL (O_NONBLOCK) mean something for a PNX socket.
+*/
+int __wrap_fcntl(int fildes, int cmd, ...);
+
 
 
 // declare __real part
@@ -105,6 +137,11 @@ ssize_t __real_write(int fildes, const void *buf, size_t nbyte);
 int __real_close(int fildes);
 int __real_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
 int __real_setsockopt(int socket, int level, int option_name, const void *option_value, socklen_t option_len);
+int __real_getsockopt(int socket, int level, int option_name, void *option_value, socklen_t *option_len);
+int __real_accept4(int socket, struct sockaddr *address, socklen_t *address_len, int flags);
+ssize_t __real_recv(int socket, void *buffer, size_t length, int flags);
+ssize_t __real_send(int socket, const void *buffer, size_t length, int flags);
+int __real_fcntl(int fildes, int cmd, ...);
 
 
 #ifdef __cplusplus  
@@ -115,8 +152,21 @@ int __real_setsockopt(int socket, int level, int option_name, const void *option
 struct SocketBlock;
 struct TCB;
 
+struct TcpSockOpts;
+
+// fds below it belong to the kernel.
+const int kSocketMinFd = 1000;
+
+int socket_new_fd();
+SocketBlock* socket_lookup(int fd);
+// readiness as poll(2) events.
+int socket_poll(SocketBlock *sb);
+
 int socket_recv_new_tcp_conn(SocketBlock *sb, TCB* tcb);
+// the TCB owned by `sb` may have changed.
+void socket_tcp_event(SocketBlock *sb);
 struct sockaddr_in socket_get_localaddress(SocketBlock *sb);
+TcpSockOpts socket_get_tcp_opts(SocketBlock *sb);
 
 
 
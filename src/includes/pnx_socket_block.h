@@ -0,0 +1,55 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "pnx_tcp.h"
+
+/* 
+
+# Life cycle of SocketBlocks:
+- created by socket() or accept(), and registered in the fd table.
+- close() turns it CLOSED. It's never freed, so the TCP layer and epoll instances can keep a pointer.
+
+*/
+
+struct EpollItem;
+
+struct SocketBlock {
+    int fd;
+    sockaddr_in addr;
+    enum State {
+        DEFAULT = 1,
+        ACTIVE,
+        PASSIVE_BINDED,
+        PASSIVE_LISTENING,
+        CLOSED
+    } state;
+
+    // only for active socket
+    TCB* tcb;
+
+    // set by setsockopt. passed to the TCB, and inherited by the accepted sockets.
+    TcpSockOpts opts;
+
+    // O_NONBLOCK. calls that would block fail with EAGAIN (EINPROGRESS for connect) instead.
+    std::atomic<bool> nonblock;
+
+    // guards `accepting` and `watchers`. taken after the TCB lock, before any epoll lock.
+    std::mutex lock;
+
+    // only for PASSIVE_LISTENING socket.
+    // established connections to be accepted. `cond` is notified on push.
+    std::condition_variable cond;
+    std::deque<TCB*> accepting;
+    // max backlog to-accept TCB
+    int backlog;
+
+    // the epoll instances interested in this socket, see pnx_epoll.h.
+    std::vector<std::shared_ptr<EpollItem>> watchers;
+};
@@ -10,6 +10,15 @@
 Functionalities.
     Support reliable transmission.
     Including TCP connections manegement, state machine, timer, internal buffer, etc.
+    The sender is limited by a congestion window and paced by a pluggable algorithm, see tcp_cong.h.
+    A loss is found by the retransmission timeout (RFC 6298), or earlier by three duplicate acks,
+    which resend the lost segment at once and recover the rest of the window (RFC 5681, RFC 6582).
+    When both ends offer SACK on their SYNs (RFC 2018), the receiver reports its out-of-order
+    queue in SACK blocks, and the sender keeps them in a scoreboard (tcp_sack.h): it resends only
+    the holes, and counts what has left the network by them (RFC 6675). The only other options
+    understood are SACK-permitted and MSS. There is no D-SACK and no timestamp.
+    A segment carries at most the MSS: the smaller of what the remote's SYN offers and what the
+    device toward it carries (ip_route_mtu()). There is no path MTU discovery.
 
 Users.
     Three threads will access this module: 
@@ -19,20 +28,49 @@ Users.
 
 Synchronizations.
     The module provides internal synchronizations, i.e. all functions are thread-safe.
+    There is no global lock. The connection table is split into shards by the hash of the 4-tuple,
+    each with its own lock, and each TCB has its own mutex, so connections do not contend.
+    Lock order: listening sockets, then a shard, then a TCB. A TCB found in a shard is locked
+    before the shard is released, so the recycler waits out its last users after unlinking it.
+    Nothing spins. A user blocks in tcp_wait() on the condition variable of its TCB, which is
+    notified after every segment or timer event that touches the TCB. A passive TCB is handed to
+    its listening socket only once established, so accept() sleeps on the socket itself.
 
 Resource management.
-    For simplicity, we suppose the system have enough resource and do not need to recycle.
+    TCBs are recycled after they are closed, see pnx_tcp_tcb.h.
+    The send and receive buffers of a TCB are allocated on first use and grown on demand,
+    up to the per-socket limits (SO_SNDBUF / SO_RCVBUF). All of them together are capped by
+    a global memory budget; when it runs out, incoming data is dropped and left for retransmission.
+    A received segment is not copied on arrival. It is checked and parsed in the buffer of the
+    lower layer, and its payload is copied once, into the receive buffer (or the out-of-order queue).
 
 */
 
 #include <netinet/tcp.h>
+#include <memory>
+#include <string>
+#include <poll.h>
+
+#include "pnx_tcp_const.h"
 
 struct TCB;
 struct Segment;
 struct SocketBlock;
 
+// per-socket options the TCP layer cares about.
+struct TcpSockOpts {
+    size_t sndbuf = kTcpSendBufferSize;
+    size_t rcvbuf = kTcpRecvBufferSize;
+    // the congestion control algorithm, see tcp_cong.h. empty for the default one.
+    std::string congestion;
+};
+
 // interface for socket layer.
-TCB* tcp_open(const struct sockaddr_in *local, const struct sockaddr_in *remote, std::shared_ptr<Segment> syn);
+TCB* tcp_open(const struct sockaddr_in *local, const struct sockaddr_in *remote, const Segment *syn, 
+    const TcpSockOpts &opts);
+void tcp_setopts(TCB* tcb, const TcpSockOpts &opts);
+// `sb` gets socket_tcp_event() calls from now on.
+void tcp_set_owner(TCB* tcb, SocketBlock *sb);
 int tcp_register_listening_socket(SocketBlock *sb, uint16_t port /* network order */);
 int tcp_unregister_listening_socket(SocketBlock *sb, uint16_t port /* network order */);
 int tcp_close(TCB* tcb);
@@ -42,6 +80,17 @@ struct sockaddr_in tcp_getpeeraddress(TCB* tcb);
 int tcp_getstate(TCB* tcb);
 int tcp_no_data_incoming_state(int state);
 int tcp_can_send(int state);
+// readiness as poll(2) events: POLLIN (data or EOF), POLLOUT (room to send), 
+// POLLRDHUP (the remote has closed), POLLHUP (closed), POLLERR (see tcp_get_error).
+int tcp_poll(TCB* tcb);
+// the pending error (an errno value) or 0. cleared once read.
+int tcp_get_error(TCB* tcb);
+// block until one of `events` or POLLHUP is ready. return the ready events.
+int tcp_wait(TCB* tcb, int events);
+// the state of the connection as getsockopt(TCP_INFO) reports it. times are in us.
+void tcp_get_info(TCB* tcb, struct tcp_info *info);
+// the name of its congestion control algorithm.
+const char *tcp_get_congestion(TCB* tcb);
 
 // interface for ip layer.
 int tcp_segment_handler(const void* buf, int len, const struct in_addr& src, const struct in_addr& dst);
@@ -2,9 +2,30 @@
 
 #include <memory>
 
+// default buffer limits of a connection. the buffers are allocated and grown on demand.
+// SO_SNDBUF / SO_RCVBUF set them within [kTcpMinBufferSize, kTcpMaxBufferSize].
 const size_t kTcpSendBufferSize = (1 << 20);
 const size_t kTcpRecvBufferSize = (1 << 20);
-const size_t kTcpMaxSegmentSize = 1024;
-const size_t kTcpTimeout = 1e5; // us
+const size_t kTcpMinBufferSize = (1 << 12);
+const size_t kTcpMaxBufferSize = (1 << 24);
+// all TCP buffers together. overridden by env PNX_TCP_MEM_LIMIT (in bytes).
+const size_t kTcpMemLimit = (1ULL << 30);
+// the MSS, i.e. the payload of a full segment, is what the remote's MSS option allows, and
+// what the route to it carries in one IP packet. see RFC 9293 3.7.1.
+// assumed when the remote sends no MSS option, or when there is no route yet.
+const uint32_t kTcpDefaultMss = 536;
+// the smallest taken from the remote, so that a bogus option does not chop the data into bytes.
+const uint32_t kTcpMinMss = 88;
+// the retransmission timeout, see RFC 6298. it starts at kTcpInitRTO, follows the measured RTT
+// within [kTcpMinRTO, kTcpMaxRTO], and doubles on every timeout in a row.
+const size_t kTcpInitRTO = 1000000; // us
+const size_t kTcpMinRTO = 20000; // us
+const size_t kTcpMaxRTO = 60000000; // us
+// the clock granularity, i.e. the tick of the timer wheel.
+const size_t kTcpClockGranularity = 1000; // us
 const size_t kTcpMSL = 1000000; // us
-const int kTcpMaxRetrans = 100; // last for one second
\ No newline at end of file
+// timeouts in a row before the connection is given up. a SYN gets fewer, i.e. about a minute.
+const int kTcpMaxRetrans = 12;
+const int kTcpSynRetries = 6;
+// duplicate acks in a row that take the segment they ask for as lost, see RFC 5681 3.2.
+const int kTcpDupAckThreshold = 3;
\ No newline at end of file
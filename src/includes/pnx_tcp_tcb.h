@@ -1,10 +1,17 @@
 #include <netinet/tcp.h>
-#include <thread>
 #include <netinet/in.h>
 #include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
 
 #include "pnx_tcp_const.h"
 #include "ringbuffer.h"
+#include "tcp_seq.h"
+#include "tcp_reass.h"
+#include "timer_wheel.h"
+#include "pnx_ip.h"
+#include "tcp_cong.h"
 
 
 /* 
@@ -15,62 +22,144 @@
 - passive open: recv SYN, create a TCB and give it to the listening socket.
 
 ## ending:
-- Once the user calls tcp_close(), the TCB becomes an orphan. Remove it from the TCB map.
-- We periodically will check all orphan TCBs and delete those have been CLOSED.
+- Once the user calls tcp_close(), the TCB becomes an orphan. Move it to the orphaned map of its shard.
+- A passive TCB nobody accepts (handshake timeout, listener gone) becomes an orphan by itself.
+- An orphan is handed to the recycler when it reaches CLOSED, which deletes it.
 
 */
 
+struct SocketBlock;
+
 struct TCB {
+    // protects everything below. see pnx_tcp.h for the lock order.
+    std::mutex lock;
+    // notified whenever the TCB may have changed, see tcp_wait().
+    std::condition_variable cond;
+
     int state;
     bool passive;
+    // for a passive TCB, the listening socket to join once established.
+    SocketBlock *listener;
+    // the socket using it, told about every change for epoll. cleared on tcp_close().
+    SocketBlock *owner;
+    // why it was closed abnormally, e.g. ETIMEDOUT. reported once by SO_ERROR.
+    int error;
+    // nobody owns it any more. recycled once CLOSE.
+    bool orphan;
+    // handed to the recycler.
+    bool recycled;
 
     sockaddr_in local; // in network byte order
     sockaddr_in remote; // in network byte order
+    // the route to the remote, refreshed when it goes stale. see ip_dst_lookup().
+    std::shared_ptr<const DstEntry> dst;
+    // both ends have offered SACK (RFC 2018) on their SYNs.
+    bool sack_ok;
 
     struct Sender {
         uint32_t init_seq;
         uint32_t remote_recv_window;
+        // the segment (seq, ack) that last updated remote_recv_window. see RFC 793 SND.WL1/WL2.
+        uint32_t wl1, wl2;
+        // the payload of a full segment: the MSS option of the remote, capped by what the route
+        // carries. it follows the route when it changes.
+        uint32_t mss;
+        uint32_t remote_mss;
         uint32_t next;  // next seq to send
         uint32_t unack; // the oldest one that is not ack by the remote. i.e. updated by the ack_seq.
+        uint32_t max_sent; // the highest seq ever sent + 1. `next` goes back to `unack` on timeout.
         
-        struct Sequence {
-            bool syn, fin;
-            // only make sense when both syn and fin is 0
-            char byte;
-
-            bool isCtrl() {
-                return syn != 0 || fin != 0;
-            }
-        };
-        // TODO: this design hinders direct memory copy. move control bits out of sender buffer.
-        RingBuffer<Sequence, kTcpSendBufferSize> buf;
-
-        Segment last_seg;
-
-        // when the user calls close(), we send a FIN packet.
-        // if the send buffer is empty, we can send a FIN packet immediately.
-        // Otherwise, we flush the send buffer first, and piggyback a FIN in the last packet.
-        // bool FIN_waiting;
-
-        // when a new seg is sent, this value is set to 0.
-        int retrans_count;
+        // the data stream only. its front is the first data byte not acked, i.e. `unack`, or `unack + 1`
+        // while our SYN is not acked. entries are only popped when acked, so retransmission reads from here.
+        // allocated on the first write, up to SO_SNDBUF.
+        DynamicRingBuffer<char> buf;
 
-        // the timer will check this value to see if we need to retransmit.
-        // only counts for data packets.
+        // control flags are sequence-number markers around the data, and stay set until acked.
+        // the SYN occupies the seq before buf, and the FIN the seq right after buf.
+        // when the user calls close(), the FIN is queued behind the data, and piggybacked on its last segment.
+        bool syn, fin;
+
+        // timeouts in a row, i.e. how many times the RTO is doubled. reset when the remote acks something.
+        int retrans_count;
+        // every retransmission timeout in the life of the connection.
+        uint32_t total_retrans;
+        // zero window probes in a row. the persist timer backs off by them as the RTO does
+        // (RFC 1122 4.2.2.17). reset when the window opens.
+        int probe_count;
+
+        // RFC 6298, in us. srtt is 0 until the first sample.
+        uint32_t srtt, rttvar;
+        // the RTO before backoff.
+        uint32_t rto;
+        // one segment is timed at a time. its ack, i.e. the first to cover rtt_seq, gives an RTT sample,
+        // unless something was retransmitted meanwhile (Karn's algorithm).
+        bool rtt_timing;
+        uint32_t rtt_seq;
+        size_t rtt_start;
+
+        // how much may be in flight, and how fast it goes. see tcp_cong.h.
+        std::unique_ptr<TcpCongestion> cc;
+        // when the pacing rate lets the next segment go.
+        size_t pace_next;
+
+        // duplicate acks in a row. the third one retransmits `unack` at once, without waiting for the RTO.
+        int dupacks;
+        // fast recovery (RFC 6582) lasts until `recover`, the highest seq sent when the loss was found,
+        // is acked. every ack short of it finds the next loss. after a timeout, `recover` keeps the
+        // duplicate acks of what was sent before it from starting another recovery.
+        bool in_recovery;
+        uint32_t recover;
+        // added to cwnd in fast recovery, for the segments that have left the network meanwhile.
+        uint32_t recovery_inflation;
+        // what the remote has reported by SACK blocks beyond unack. with SACK, fast recovery
+        // takes the holes below the highest sacked seq as lost, and resends them one by one from
+        // `retrans_next`, instead of one per partial ack. see _tcp_output().
+        TcpSackScoreboard sacked;
+        uint32_t retrans_next;
+        // bytes sacked of what was resent after the segment at unack, since that one was resent.
+        // as many as make a loss tell that the resent segment is lost as well.
+        uint32_t retrans_sacked;
+
+        // when the retransmission timer was (re)started, i.e. the oldest unacked segment was sent, 
+        // or the last time the remote acked new data.
         size_t last_sent_time;
 
         inline bool waiting_for_ack() {
-            return unack < next;
+            return seq_lt(unack, max_sent);
+        }
+
+        inline uint32_t in_flight() {
+            return next - unack;
+        }
+
+        // the sequence space from unack to the end of what the user has queued.
+        inline uint32_t seq_size() {
+            return syn + buf.size() + fin;
+        }
+
+        // not sent yet, or to be sent again after a timeout.
+        inline bool have_unsent() {
+            return in_flight() < seq_size();
         }
     } send;
 
     struct Receiver {
         uint32_t init_seq;
         uint32_t next; // next seq to receive from the remote
-        uint32_t window; // receive window
-        RingBuffer<char, kTcpRecvBufferSize> buf;
+        uint32_t window; // the receive window last advertised
+        uint32_t mss; // advertised on our SYN, from the MTU of the route to the remote
+        // allocated when the first data arrives, up to SO_RCVBUF.
+        DynamicRingBuffer<char> buf;
+
+        // segments beyond `next`, waiting for the gap before them.
+        TcpReassQueue ooo;
+        // the seq of the latest segment put in `ooo`. its block goes first in the SACK option.
+        uint32_t sack_recent;
     } recv;
 
-    std::atomic<bool> timer_stop = false;
-    std::thread timer;
+    // retransmission and TIME_WAIT expiry, driven by the shared timer wheel.
+    // armed on demand, so an idle connection costs nothing.
+    Timer timer;
+    // sends what the pacing rate has held back.
+    Timer pace_timer;
 };
\ No newline at end of file
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <cstring>
+#include <cstdint>
+#include <algorithm>
 #include <optional>
 #include <cassert>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 
 // the array size is Capacity + 1, so that we can distinguish the empty case and full case.
@@ -24,7 +27,7 @@ public:
 
     bool push(T a) {
         if (full()) return 0;
-        buf[next_push++] = a;
+        buf[next_push++] = std::move(a);
         next_push %= kArraySize;
         return 1;
     }
@@ -41,13 +44,33 @@ public:
         auto rem = next_pop;
         ++next_pop;
         next_pop %= kArraySize;
-        return buf[rem];
+        return std::move(buf[rem]);
     }
 
     size_t rest_capacity() {
         return Capacity - size();
     }
 
+    // copy out at most len elements, starting `offset` elements after the front, without popping them.
+    // return the number copied.
+    size_t peek(size_t offset, T *a, size_t len) {
+        if (offset >= size()) return 0;
+        len = std::min(len, size() - offset);
+
+        size_t start = (next_pop + offset) % kArraySize;
+        size_t first = std::min(len, kArraySize - start);
+        memcpy(a, buf + start, first * sizeof(T));
+        memcpy(a + first, buf, (len - first) * sizeof(T));
+        return len;
+    }
+
+    // discard the first n elements without copying them out.
+    size_t drop(size_t n) {
+        n = std::min(n, size());
+        next_pop = (next_pop + n) % kArraySize;
+        return n;
+    }
+
 private:
     size_t one_push_capacity() {
         // capacity until reaching the following cases:
@@ -82,7 +105,7 @@ private:
     }
     
 public:
-    size_t try_push(T *a, size_t len) {
+    size_t try_push(const T *a, size_t len) {
         size_t rem = std::min(len, this->one_push_capacity());
         memcpy(buf + next_push, a, rem * sizeof(T));
         next_push += rem;
@@ -93,7 +116,7 @@ public:
         return rem;
     }
 
-    bool push_all(T *a, size_t len) {
+    bool push_all(const T *a, size_t len) {
         if (rest_capacity() < len) return 0;
 
         size_t rest = len;
@@ -141,13 +164,180 @@ public:
 };
 
 
+// a memory budget shared by many buffers. charging fails instead of going over the limit.
+struct MemBudget {
+    std::atomic<size_t> used{0};
+    std::atomic<size_t> limit;
+
+    explicit MemBudget(size_t limit) : limit(limit) {}
+
+    bool charge(size_t bytes) {
+        size_t cur = used.load(std::memory_order_relaxed);
+        do {
+            if (cur + bytes > limit.load(std::memory_order_relaxed))
+                return false;
+        } while (!used.compare_exchange_weak(cur, cur + bytes, std::memory_order_relaxed));
+        return true;
+    }
+
+    void uncharge(size_t bytes) {
+        used.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+};
+
+// a ring buffer holding at most `limit` elements, whose storage is allocated on the first push
+// and doubled on demand. an idle user costs nothing but the object itself.
+// the storage is charged to `budget` if one is given, and a push that cannot get memory stops short.
+// the first kMinAlloc elements are always granted, so that every buffer can make progress.
+template<typename T = char>
+class DynamicRingBuffer {
+    static constexpr size_t kMinAlloc = 4096 / sizeof(T) > 0 ? 4096 / sizeof(T) : 1;
+
+    T *buf_ = nullptr;
+    size_t capacity_ = 0; // allocated
+    size_t head_ = 0, size_ = 0;
+    size_t limit_;
+    MemBudget *budget_;
+
+    // make room for `need` elements in total, or as many as the memory allows.
+    // return true if all of them fit.
+    bool grow(size_t need) {
+        need = std::min(need, limit_);
+        if (need <= capacity_) return true;
+
+        size_t cap = std::max(capacity_, kMinAlloc);
+        while (cap < need) cap *= 2;
+        cap = std::min(cap, limit_);
+
+        if (budget_ != nullptr) {
+            size_t used = budget_->used.load(std::memory_order_relaxed);
+            size_t limit = budget_->limit.load(std::memory_order_relaxed);
+            size_t affordable = capacity_ + (limit > used ? (limit - used) / sizeof(T) : 0);
+            affordable = std::max(affordable, std::min(kMinAlloc, limit_));
+            if (cap > affordable)
+                cap = std::min(need, affordable);
+            if (cap <= capacity_)
+                return false;
+
+            size_t bytes = (cap - capacity_) * sizeof(T);
+            if (cap <= kMinAlloc) {
+                budget_->used.fetch_add(bytes, std::memory_order_relaxed);
+            } else if (!budget_->charge(bytes)) {
+                return false; // raced with others
+            }
+        }
+
+        // only the difference was charged.
+        T *nbuf = new T[cap];
+        peek(0, nbuf, size_);
+        delete[] buf_;
+        buf_ = nbuf;
+        capacity_ = cap;
+        head_ = 0;
+        return capacity_ >= need;
+    }
+
+public:
+    explicit DynamicRingBuffer(size_t limit = 0, MemBudget *budget = nullptr) : limit_(limit), budget_(budget) {}
+    ~DynamicRingBuffer() { release(); }
+
+    DynamicRingBuffer(const DynamicRingBuffer&) = delete;
+    DynamicRingBuffer& operator=(const DynamicRingBuffer&) = delete;
+
+    // only before the first push.
+    void set_budget(MemBudget *budget) {
+        assert(buf_ == nullptr);
+        budget_ = budget;
+    }
+
+    // a smaller limit than the current size does not discard anything, it just stops pushes.
+    void set_limit(size_t limit) { limit_ = limit; }
+
+    // free the storage and discard the content.
+    void release() {
+        delete[] buf_;
+        if (budget_ != nullptr)
+            budget_->uncharge(capacity_ * sizeof(T));
+        buf_ = nullptr;
+        capacity_ = head_ = size_ = 0;
+    }
+
+    bool empty() { return size_ == 0; }
+    size_t size() { return size_; }
+    size_t limit() { return limit_; }
+    size_t capacity() { return capacity_; }
+    size_t rest_capacity() { return limit_ > size_ ? limit_ - size_ : 0; }
+
+    // how many can be pushed right now, taking the memory budget into account.
+    size_t room() {
+        size_t rest = rest_capacity();
+        if (budget_ == nullptr) return rest;
+        size_t used = budget_->used.load(std::memory_order_relaxed);
+        size_t limit = budget_->limit.load(std::memory_order_relaxed);
+        size_t granted = std::max(capacity_, kMinAlloc);
+        size_t avail = (granted - size_) + (limit > used ? (limit - used) / sizeof(T) : 0);
+        return std::min(rest, avail);
+    }
+
+    // push as much as the limit and the memory allow. return the number pushed.
+    size_t push(const T *a, size_t len) {
+        len = std::min(len, rest_capacity());
+        grow(size_ + len);
+        // take what fits into the storage we could get.
+        len = std::min(len, capacity_ - size_);
+        if (len == 0) return 0;
+
+        size_t tail = (head_ + size_) % capacity_;
+        size_t first = std::min(len, capacity_ - tail);
+        memcpy(buf_ + tail, a, first * sizeof(T));
+        memcpy(buf_, a + first, (len - first) * sizeof(T));
+        size_ += len;
+        return len;
+    }
+
+    bool push_all(const T *a, size_t len) {
+        if (rest_capacity() < len || !grow(size_ + len)) return 0;
+        return push(a, len) == len;
+    }
+
+    // copy out at most len elements, starting `offset` elements after the front, without popping them.
+    // return the number copied.
+    size_t peek(size_t offset, T *a, size_t len) {
+        if (offset >= size_) return 0;
+        len = std::min(len, size_ - offset);
+
+        size_t start = (head_ + offset) % capacity_;
+        size_t first = std::min(len, capacity_ - start);
+        memcpy(a, buf_ + start, first * sizeof(T));
+        memcpy(a + first, buf_, (len - first) * sizeof(T));
+        return len;
+    }
+
+    // discard the first n elements without copying them out.
+    size_t drop(size_t n) {
+        n = std::min(n, size_);
+        size_ -= n;
+        head_ = size_ == 0 ? 0 : (head_ + n) % capacity_;
+        return n;
+    }
+
+    bool pop(T *a, size_t len) {
+        if (size_ < len) return 0;
+        peek(0, a, len);
+        drop(len);
+        return 1;
+    }
+};
+
+
 template<typename T = char, int Capacity = 65535> 
 class BlockingRingBuffer : private RingBuffer<T, Capacity> {
     std::mutex mutex;
     std::condition_variable cv_for_pop, cv_for_push;
 
 public:
-    bool push(T a) {
+    // `a` is left untouched if it can not be pushed.
+    bool push(T &&a) {
         std::unique_lock<std::mutex> lock(mutex);
         
         int cnt = 0;
@@ -157,7 +347,7 @@ public:
                 return false;
             }
         }
-        RingBuffer<T, Capacity>::push(a);
+        RingBuffer<T, Capacity>::push(std::move(a));
         cv_for_pop.notify_one();
         return true;
     }
@@ -180,4 +370,113 @@ public:
         std::unique_lock<std::mutex> lock(mutex);
         return RingBuffer<T, Capacity>::size();
     }
-};
\ No newline at end of file
+};
+
+// a bounded lock-free queue for many producers and one consumer (Vyukov's bounded queue).
+// each cell carries a sequence number which tells whether it's free for the push of the current lap,
+// or holds the element of it. producers claim a cell by a CAS on the tail, the consumer owns the head.
+// Capacity must be a power of two.
+template<typename T, size_t Capacity = 1024>
+class MpscRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+    Cell cells_[Capacity];
+
+    alignas(64) std::atomic<size_t> tail_{0}; // next push
+    alignas(64) size_t head_ = 0; // next pop
+
+public:
+    MpscRing() {
+        for (size_t i = 0; i < Capacity; i++)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    // any thread. return false if full, and `a` is left untouched then.
+    bool push(T &&a) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells_[pos & (Capacity - 1)];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(a);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // the consumer has not freed it in the last lap.
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // the consumer only. move out at most n elements, in the order they were pushed.
+    // an element whose push is still in progress ends the batch.
+    size_t pop(T *a, size_t n) {
+        size_t cnt = 0;
+        while (cnt < n) {
+            Cell &cell = cells_[head_ & (Capacity - 1)];
+            if (cell.seq.load(std::memory_order_acquire) != head_ + 1)
+                break;
+            a[cnt++] = std::move(cell.value);
+            cell.seq.store(head_ + Capacity, std::memory_order_release);
+            head_++;
+        }
+        return cnt;
+    }
+
+    // the consumer only.
+    bool empty() const {
+        return cells_[head_ & (Capacity - 1)].seq.load(std::memory_order_acquire) != head_ + 1;
+    }
+};
+
+
+// a bounded lock-free queue for one producer and one consumer.
+// each side owns its index and only reads the other one. Capacity must be a power of two.
+template<typename T, size_t Capacity = 1024>
+class SpscRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    T buf_[Capacity];
+    alignas(64) std::atomic<size_t> head_{0}; // next pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail_{0}; // next push, written by the producer
+
+public:
+    SpscRing() = default;
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // the producer only. return false if full, and `a` is left untouched then.
+    bool push(T &&a) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity)
+            return false;
+        buf_[tail & (Capacity - 1)] = std::move(a);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // the consumer only. move out at most n elements, in the order they were pushed.
+    size_t pop(T *a, size_t n) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        n = std::min(n, tail_.load(std::memory_order_acquire) - head);
+        for (size_t i = 0; i < n; i++)
+            a[i] = std::move(buf_[(head + i) & (Capacity - 1)]);
+        head_.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+};
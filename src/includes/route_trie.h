@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <netinet/in.h>
+
+/*
+    Design doc of the route trie.
+
+Functionality.
+    Longest prefix match over the IPv4 routes, in at most three memory reads.
+    A multibit trie with strides 16-8-8 (DIR-16-8-8): the root has a slot for each /16, and
+    a slot points either to a route or to a node of 256 slots for the next 8 bits, created
+    only under the /16 and /24 that hold longer routes. Shorter routes are expanded over
+    the slots they cover, and pushed down into the nodes created below them, so a lookup
+    stops at the first slot which is not a node.
+
+    The root takes 256 KB, and each node 1 KB. It's immutable once built: a change in the
+    routes builds a new one.
+
+Users.
+    routing.cc builds one from the routing tables and publishes it for get_next_hop().
+
+Synchronizations.
+    None. It's never modified after construction, so any thread may look it up.
+
+*/
+
+struct RouteNextHop {
+    int device_id;
+    in_addr next_hop;
+    bool direct; // the destination is on the link; next_hop is not used.
+};
+
+class RouteTrie {
+public:
+    struct Route {
+        in_addr dest;
+        in_addr mask; // contiguous.
+        RouteNextHop hop;
+    };
+
+    // among the routes of the same prefix, the last one wins.
+    explicit RouteTrie(const std::vector<Route> &routes);
+
+    RouteTrie(const RouteTrie&) = delete;
+    RouteTrie& operator=(const RouteTrie&) = delete;
+
+    // return nullptr if no route matches.
+    const RouteNextHop *lookup(in_addr dest) const {
+        uint32_t a = ntohl(dest.s_addr);
+        uint32_t e = root_[a >> 16];
+        if (e & kNode) {
+            e = nodes_[e & ~kNode].slots[(a >> 8) & 0xff];
+            if (e & kNode)
+                e = nodes_[e & ~kNode].slots[a & 0xff];
+        }
+        return e == 0 ? nullptr : &hops_[e];
+    }
+
+    size_t routes() const { return hops_.size() - 1; }
+    size_t nodes() const { return nodes_.size(); }
+
+private:
+    // a slot: 0 for no route, an index into hops_, or kNode | an index into nodes_.
+    static const uint32_t kNode = 1u << 31;
+
+    struct Node {
+        uint32_t slots[256];
+    };
+
+    std::vector<uint32_t> root_;
+    std::vector<Node> nodes_;
+    std::vector<RouteNextHop> hops_; // hops_[0] is unused.
+
+    void insert(uint32_t prefix, int len, uint32_t value);
+};
@@ -38,13 +38,19 @@ int add_static_routing_entry(const struct in_addr dest, const struct in_addr mas
 PNX dynamic routing protocol.
 
 * Ethernet based, using a special EtherType.
-* broadcast to every neighbour every X seconds.
+* a distance vector protocol in the style of RIP (RFC 2453).
 * every node should have a daemon to handle the broadcast.
+* the whole vector is broadcast to every neighbour every 5 seconds, and when a device is added.
+* changes are broadcast soon after they happen (triggered updates), carrying only the changed entries.
+* split horizon with poison reverse: a route goes back to the device it was learned on as unreachable.
+* 16 hops is unreachable. a route not heard of for 15 seconds is unreachable, i.e. its neighbour is dead.
+  it is advertised as such for 10 seconds, then forgotten.
 
 frame format:
 * <src IP> 4 bytes
 * <number of DV entries> 4 bytes
 * <entry 1><entry 2><entry 3>...
+* an entry: <subnet> 4 bytes, <mask> 4 bytes, <hops> 4 bytes
 
 */
 
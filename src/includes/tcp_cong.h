@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+    Design doc of TCP congestion control.
+
+Functionality.
+    Decides how much a connection may have in flight (the congestion window, cwnd), and how
+    fast it sends it (the pacing rate), from what the sender observes: acks, their RTT
+    samples, and losses. Each algorithm is a TcpCongestion, created by name:
+        "reno"  NewReno, RFC 5681: slow start, then one segment more per RTT, halved on a loss.
+        "cubic" CUBIC, RFC 9438: the window grows as a cubic function of the time since the
+                last loss, centered on the window where that loss happened.
+        "bbr"   a simplified BBR: a model of the path, i.e. the max delivery rate over the last
+                rounds and the min RTT over the last 10 s. It paces at that rate times a gain,
+                which cycles to probe for more bandwidth, and keeps about twice the BDP in flight.
+                A loss does not shrink the window. There is no delivery rate sample per segment:
+                a round is one min RTT, and its rate is what was acked during it.
+    Reno and CUBIC do not pace.
+
+    All sizes are in bytes, times in us and rates in bytes per second.
+
+Users.
+    Every TCB owns one, chosen by setsockopt(TCP_CONGESTION), or the default one
+    (env PNX_TCP_CONGESTION, or kTcpDefaultCongestion). The sender sends at most
+    min(cwnd, the remote window), and reports every ack and loss.
+
+Synchronizations.
+    None. Protected by the lock of its TCB.
+
+*/
+
+// the longest name of an algorithm, with the trailing 0. the same as Linux.
+const size_t kTcpCongNameMax = 16;
+const char kTcpDefaultCongestion[] = "cubic";
+
+// what the sender learns from an ack of new data.
+struct TcpAckSample {
+    uint32_t acked;           // bytes newly acked
+    uint32_t prior_in_flight; // bytes in flight before the ack
+    uint32_t in_flight;       // and after it
+    uint32_t rtt;             // 0 if the ack gives no RTT sample
+    uint64_t now;
+    // in fast recovery, or the ack ends it. the window is not grown then.
+    bool in_recovery;
+};
+
+class TcpCongestion {
+public:
+    virtual ~TcpCongestion() {}
+
+    virtual const char *name() const = 0;
+
+    virtual void on_ack(const TcpAckSample &s) = 0;
+    // a loss found before the retransmission timeout, i.e. by duplicate acks. the sender is in
+    // fast recovery until everything in flight is acked.
+    virtual void on_loss(uint32_t in_flight, uint64_t now) = 0;
+    // everything in flight is taken as lost.
+    virtual void on_rto(uint32_t in_flight, uint64_t now) = 0;
+
+    // the segment size changed, e.g. by a new route. the window keeps its number of segments.
+    void set_mss(uint32_t mss);
+
+    uint32_t cwnd() const { return cwnd_; }
+    uint32_t ssthresh() const { return ssthresh_; }
+    // 0 if not paced.
+    uint64_t pacing_rate() const { return pacing_rate_; }
+
+protected:
+    explicit TcpCongestion(uint32_t mss);
+
+    // most algorithms grow the window only when it's what limits the sender,
+    // so that it does not inflate while the application or the remote window holds it back.
+    bool cwnd_limited(const TcpAckSample &s) const;
+    // slow start, up to ssthresh. return the bytes acked beyond it.
+    uint32_t slow_start(uint32_t acked);
+
+    uint32_t mss_;
+    uint32_t cwnd_;
+    uint32_t ssthresh_;
+    uint64_t pacing_rate_ = 0;
+};
+
+// return nullptr if there is no such algorithm.
+TcpCongestion *tcp_cong_create(const char *name, uint32_t mss);
+bool tcp_cong_available(const char *name);
+// the one a connection gets unless it asks for another.
+const char *tcp_cong_default();
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <vector>
+#include <functional>
+
+#include "tcp_seq.h"
+#include "tcp_sack.h"
+
+/*
+    Design doc of the reassembly queue.
+
+Functionality.
+    Keeps the segments that arrive ahead of recv.next, until the gap before them is filled.
+    Data is stored as disjoint intervals [seq, seq + len) ordered by seq. Overlapping parts
+    of a new segment are cut off on insertion, so every byte is stored at most once.
+
+    A FIN that arrives early is remembered by its seq, and reported once the data before it
+    has been delivered.
+
+    What it holds is also what the receiver reports in SACK blocks, see sack_blocks().
+
+Users.
+    One queue per TCB receiver. The caller bounds what it inserts by the receive window,
+    so the queue never holds more than the receive buffer can take later.
+
+Synchronizations.
+    None. Protected by the lock of its TCB.
+
+*/
+
+class TcpReassQueue {
+    struct SeqLess {
+        // all the keys live in one receive window, so the wrap-around order is consistent.
+        bool operator()(uint32_t a, uint32_t b) const { return seq_lt(a, b); }
+    };
+
+    std::map<uint32_t, std::vector<char>, SeqLess> segs_;
+    size_t bytes_ = 0;
+
+    bool has_fin_ = false;
+    uint32_t fin_seq_ = 0;
+
+public:
+    // store the data of [seq, seq + len). return the number of new bytes stored.
+    size_t insert(uint32_t seq, const char *data, size_t len);
+
+    // remember a FIN which occupies `seq`.
+    void set_fin(uint32_t seq);
+
+    // hand the data contiguous from `next` to `sink`, which returns how much it has taken.
+    // stop at the first gap, or when `sink` takes less than offered.
+    // `fin` is set if the delivered data reaches the FIN.
+    // return the number of bytes delivered.
+    size_t deliver(uint32_t next, const std::function<size_t(const char*, size_t)>& sink, bool *fin);
+
+    void clear();
+
+    // the data held beyond `next` as SACK blocks, RFC 2018 4: the block holding `recent`, the
+    // seq of the latest segment queued, comes first, then the others in order. intervals which
+    // touch make one block. return the number of blocks written, at most `max`.
+    size_t sack_blocks(uint32_t next, uint32_t recent, TcpSackBlock *blocks, size_t max) const;
+
+    bool empty() const { return segs_.empty() && !has_fin_; }
+    size_t bytes() const { return bytes_; }
+    size_t intervals() const { return segs_.size(); }
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+
+#include "tcp_seq.h"
+
+/*
+    Design doc of the SACK scoreboard.
+
+Functionality.
+    What the remote has reported by SACK blocks (RFC 2018) to hold beyond the cumulative ack.
+    Kept as ranges [start, end) of sequence numbers, ordered by start, and merged as soon as
+    they overlap or touch, so a range never borders another.
+
+    The sender skips the sacked ranges when it resends, and in fast recovery takes the holes
+    below the highest one as lost (as FACK does), see _tcp_output().
+
+Users.
+    One per TCB sender, once both ends have agreed on SACK.
+
+Synchronizations.
+    None. Protected by the lock of its TCB.
+
+*/
+
+// a SACK block, in host byte order.
+struct TcpSackBlock {
+    uint32_t start;
+    uint32_t end; // exclusive
+};
+
+class TcpSackScoreboard {
+    struct SeqLess {
+        // all the ranges live in one send window, so the wrap-around order is consistent.
+        bool operator()(uint32_t a, uint32_t b) const { return seq_lt(a, b); }
+    };
+
+    std::map<uint32_t, uint32_t, SeqLess> ranges_; // start -> end
+    size_t bytes_ = 0;
+
+public:
+    // mark [start, end) as sacked. return the number of bytes newly sacked.
+    size_t insert(uint32_t start, uint32_t end);
+
+    // forget what is below `una`, which is acked cumulatively now.
+    void advance(uint32_t una);
+
+    void clear();
+
+    bool empty() const { return ranges_.empty(); }
+    size_t bytes() const { return bytes_; }
+    size_t ranges() const { return ranges_.size(); }
+
+    // the bytes sacked below `seq`.
+    size_t bytes_below(uint32_t seq) const;
+
+    // the end of the highest range. only meaningful if not empty.
+    uint32_t highest() const { return ranges_.rbegin()->second; }
+
+    // the first seq at or after `seq` which is not sacked.
+    uint32_t next_unsacked(uint32_t seq) const;
+
+    // the start of the first range beyond `seq`, or `limit` if there is none before it.
+    uint32_t next_sacked(uint32_t seq, uint32_t limit) const;
+};
@@ -4,34 +4,30 @@
 #include <netinet/tcp.h>
 #include <cstring>
 #include "pnx_utils.h"
+#include "packet_buf.h"
 #include "logger.h"
+#include "tcp_sack.h"
 
 
-static uint16_t _tcp_checksum(const void* buf, int len, const struct in_addr& src, const struct in_addr& dst) {
-    // calc the checksum of the ip header using the RFC specified algorithm.
-    // https://tools.ietf.org/html/rfc1071
-
-    // first set the checksum field to 0
-    auto old_check = ((struct tcphdr*)buf)->check;
-
-    ((struct tcphdr*)buf)->check = 0;
-
+// the one's complement sum of a segment and its pseudo header, folded to 16 bits.
+// https://tools.ietf.org/html/rfc1071
+static uint16_t _tcp_sum(const void* buf, int len, const struct in_addr& src, const struct in_addr& dst) {
     /* Compute Internet Checksum for "count" bytes
     *         beginning at location "addr".
     */
     uint32_t sum = 0;
 
     int count = len;
-    uint16_t * addr = (uint16_t *) buf;
+    const uint16_t * addr = (const uint16_t *) buf;
     while( count > 1 )  {
         /*  This is the inner loop */
-        sum += * (uint16_t*) addr++;
+        sum += * addr++;
         count -= 2;
     }
 
     /*  Add left-over byte, if any */
     if ( count > 0 )
-        sum += * (unsigned char *) addr;
+        sum += * (const unsigned char *) addr;
 
     // add pseudo header
     sum += src.s_addr >> 16;
@@ -45,49 +41,149 @@ static uint16_t _tcp_checksum(const void* buf, int len, const struct in_addr& sr
     while (sum>>16)
         sum = (sum & 0xffff) + (sum >> 16);
 
+    return (uint16_t)sum;
+}
+
+static uint16_t _tcp_checksum(const void* buf, int len, const struct in_addr& src, const struct in_addr& dst) {
+    // calc the checksum with the checksum field set to 0.
+    auto old_check = ((struct tcphdr*)buf)->check;
+    ((struct tcphdr*)buf)->check = 0;
+    uint16_t sum = _tcp_sum(buf, len, src, dst);
     ((struct tcphdr*)buf)->check = old_check;
-    return ~(uint16_t)sum;
+    return ~sum;
+}
+
+// verify a received segment without touching it. summing the checksum field in gives all ones.
+static bool _tcp_checksum_ok(const void* buf, int len, const struct in_addr& src, const struct in_addr& dst) {
+    return _tcp_sum(buf, len, src, dst) == 0xffff;
 }
 
+// TCP options, see RFC 793 3.1, RFC 2018 and RFC 9293 3.7.1.
+const uint8_t kTcpOptEnd = 0;
+const uint8_t kTcpOptNop = 1;
+const uint8_t kTcpOptMss = 2;
+const uint8_t kTcpOptSackPermitted = 4;
+const uint8_t kTcpOptSack = 5;
+// the options take 40 bytes at most, i.e. 4 SACK blocks.
+const size_t kTcpMaxOptionLen = 40;
+const size_t kTcpMaxSackBlocks = 4;
+
+// the options of a received segment we understand. the others are skipped.
+struct TcpOptions {
+    uint16_t mss = 0; // 0 if not given
+    bool sack_permitted = false;
+    size_t sack_blocks = 0;
+    TcpSackBlock sack[kTcpMaxSackBlocks];
+};
+
 struct Segment {
-    std::shared_ptr<char[]> buf;
+    // an outgoing segment is built in a packet buffer, with room for the lower headers in front.
+    PacketPtr pkt;
     size_t len;
     struct tcphdr * hdr;
     struct in_addr src;
     struct in_addr dst;
 
-    // construct empty frame from a length.
-    Segment(size_t len = 0) {
-        this->buf = std::shared_ptr<char[]>(new char[len]);
-        memset(this->buf.get(), 0, len);
+    // header length in bytes, options included.
+    size_t hlen;
+    // the payload, either in `pkt` or in the buffer the segment is borrowed from.
+    const char *payload;
+
+    // construct an outgoing segment of `len` zeroed bytes.
+    Segment(size_t len = sizeof(struct tcphdr)) {
+        this->pkt = packet_alloc();
+        memset(this->pkt->append(len), 0, len);
         this->len = len;
-        this->hdr = (struct tcphdr*)this->buf.get();
+        this->hdr = (struct tcphdr*)this->pkt->data();
         this->src = this->dst = {};
+        this->hlen = sizeof(struct tcphdr);
+        this->payload = this->pkt->data() + sizeof(struct tcphdr);
     }
 
-    // construct from a buffer
-    Segment(const void *buf, size_t len, const struct in_addr& src, const struct in_addr &dst) : src(src), dst(dst) {
-        // copy from buf to this->buf
-        this->buf = std::shared_ptr<char[]>(new char[len]);
-        memcpy(this->buf.get(), buf, len);
-        this->len = len;
-        this->hdr = (struct tcphdr*)this->buf.get();
+    // where more payload of an outgoing segment goes, and how much fits there.
+    char *tail() { return this->pkt->tail(); }
+    size_t tailroom() const { return this->pkt->tailroom(); }
+
+    // put the options of an outgoing segment after its header. `len` is a multiple of 4, and
+    // the payload is not added yet. the header must still be in network byte order, i.e. doff.
+    void add_options(const uint8_t *opts, size_t len) {
+        assert(len % 4 == 0 && this->hlen + len <= sizeof(struct tcphdr) + kTcpMaxOptionLen);
+        assert(!have_payload());
+        memcpy(this->pkt->append(len), opts, len);
+        this->len += len;
+        this->hlen += len;
+        this->payload += len;
+        this->hdr->doff = this->hlen / 4;
     }
 
+    // parse the options of a received segment. return false if they are malformed.
+    bool parse_options(TcpOptions *opts) const {
+        const uint8_t *p = (const uint8_t *)this->payload - (this->hlen - sizeof(struct tcphdr));
+        const uint8_t *end = (const uint8_t *)this->payload;
+        while (p < end) {
+            uint8_t kind = p[0];
+            if (kind == kTcpOptEnd)
+                break;
+            if (kind == kTcpOptNop) {
+                p++;
+                continue;
+            }
+            if (end - p < 2 || p[1] < 2 || p[1] > end - p)
+                return false;
+            uint8_t optlen = p[1];
+            if (kind == kTcpOptMss && optlen == 4) {
+                uint16_t mss;
+                memcpy(&mss, p + 2, sizeof(mss));
+                opts->mss = ntohs(mss);
+            } else if (kind == kTcpOptSackPermitted) {
+                opts->sack_permitted = true;
+            } else if (kind == kTcpOptSack && (optlen - 2) % 8 == 0) {
+                for (const uint8_t *b = p + 2; b < p + optlen && opts->sack_blocks < kTcpMaxSackBlocks; b += 8) {
+                    uint32_t edges[2];
+                    memcpy(edges, b, sizeof(edges));
+                    opts->sack[opts->sack_blocks++] = {ntohl(edges[0]), ntohl(edges[1])};
+                }
+            }
+            p += optlen;
+        }
+        return true;
+    }
+
+    // take n more bytes written at tail().
+    void append(size_t n) {
+        this->pkt->append(n);
+        this->len += n;
+    }
+
+    // borrow a received segment, whose header has been checked to fit in `len`.
+    // only the fixed header is copied, to be converted to host byte order. the options and
+    // the payload stay in `buf`, which must outlive the segment, i.e. the receive handler.
+    Segment(const struct tcphdr *buf, size_t len, const struct in_addr& src, const struct in_addr &dst) 
+        : len(len), hdr(&head_), src(src), dst(dst) {
+        memcpy(&head_, buf, sizeof(struct tcphdr));
+        this->hlen = buf->doff * 4;
+        this->payload = (const char *)buf + this->hlen;
+    }
+
+    // `hdr` may point into the segment itself.
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
 
     void fill_in_tcp_checksum() {
         assert(this->len >= (int)sizeof(struct tcphdr));
+        assert(this->pkt != nullptr);
         assert(this->src.s_addr != 0 && this->dst.s_addr != 0);
         logTrace("fill in tcp checksum. segment_len=%llu, src=%s, dst=%s", this->len, inet_ntoa_safe(this->src).get(), inet_ntoa_safe(this->dst).get());
-        this->hdr->check = _tcp_checksum(this->buf.get(), this->len, this->src, this->dst);
+        this->hdr->check = _tcp_checksum(this->pkt->data(), this->len, this->src, this->dst);
     }
 
-    bool have_payload() {
-        return this->len > (int)sizeof(struct tcphdr);
+    bool have_payload() const {
+        return this->len > this->hlen;
     }
 
-    size_t payload_len() {
-        return this->len - sizeof(struct tcphdr);
+    size_t payload_len() const {
+        return this->len - this->hlen;
     }
 
     inline void ntoh() {
@@ -96,7 +192,19 @@ struct Segment {
         this->hdr->window = ntohs(this->hdr->window);
     }
 
-    inline bool need_to_ack() {
+    // discard the first n bytes of the payload, e.g. the part already received.
+    // the header stays (in host byte order), and the checksum is no longer valid.
+    void trim_front(size_t n) {
+        assert(n <= payload_len());
+        this->payload += n;
+        this->len -= n;
+        this->hdr->seq += n;
+    }
+
+    inline bool need_to_ack() const {
         return have_payload() || this->hdr->fin || this->hdr->syn;
     }
-};
\ No newline at end of file
+
+private:
+    struct tcphdr head_;
+};
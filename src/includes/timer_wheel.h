@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+/*
+    Design doc of the timer wheel.
+
+Functionality.
+    A hierarchical timing wheel (Varghese & Lauck) shared by the whole stack.
+    Insertion and cancellation are O(1); each tick touches one slot of the lowest
+    level, and higher levels are cascaded down only when the lower level wraps.
+
+    kTimerLevels levels of kTimerSlots slots each. With a 1 ms tick, level 0
+    covers 64 ms, level 1 about 4 s, level 2 about 4.5 min and level 3 about 4.6 h.
+    Longer delays are clamped to the wheel range.
+
+Users.
+    TCP retransmission / TIME_WAIT (and future delayed-ACK / keepalive) timers,
+    or anything else that needs a cheap one-shot callback.
+
+Synchronizations.
+    TimerWheel itself is NOT thread-safe. The global service below (timer_schedule and friends)
+    wraps one wheel with a mutex and drives it from a single thread.
+    Callbacks run on the timer thread without any wheel lock held, so they may re-schedule themselves.
+
+*/
+
+struct TimerListNode {
+    TimerListNode *prev = nullptr;
+    TimerListNode *next = nullptr;
+};
+
+// a timer is owned and embedded by its user (e.g. a TCB). The wheel only links it.
+// do not destroy a pending timer; cancel it first (see timer_cancel_sync).
+struct Timer : public TimerListNode {
+    std::function<void()> callback;
+
+    // in ticks. only meaningful when pending.
+    uint64_t expires = 0;
+
+    Timer() = default;
+    explicit Timer(std::function<void()> cb) : callback(std::move(cb)) {}
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    bool pending() const { return next != nullptr; }
+};
+
+const int kTimerLevels = 4;
+const int kTimerSlotBits = 6;
+const int kTimerSlots = 1 << kTimerSlotBits;
+const uint64_t kTimerTickUs = 1000; // us
+
+class TimerWheel {
+    TimerListNode slots_[kTimerLevels][kTimerSlots];
+
+    // the next tick to be processed.
+    uint64_t current_;
+    size_t pending_count_;
+
+    void link(Timer *t);
+    static void unlink(TimerListNode *node);
+    // move the timers of one slot of `level` down. return the slot index.
+    int cascade(int level);
+
+public:
+    explicit TimerWheel(uint64_t now_tick = 0);
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // (re)arm `t` to expire at absolute tick `expires`. ticks already passed fire on the next advance.
+    void schedule(Timer *t, uint64_t expires);
+
+    // return true if `t` was pending.
+    bool cancel(Timer *t);
+
+    // process every tick up to and including `now_tick`.
+    // expired timers are moved to the circular list `expired` and stay pending
+    // until the caller takes them off with cancel() and runs the callbacks,
+    // so that it can drop its lock first.
+    size_t advance(uint64_t now_tick, TimerListNode *expired);
+
+    // the first tick that may have work, bounded by the next level-0 wrap.
+    uint64_t next_busy_tick() const;
+
+    // restart the clock of an empty wheel.
+    void reset(uint64_t now_tick);
+
+    uint64_t current_tick() const { return current_; }
+    size_t pending_count() const { return pending_count_; }
+};
+
+
+// ====== the global timer service ======
+
+// (re)arm `timer` to fire `delay_us` microseconds from now.
+// the service thread is started lazily on first use.
+void timer_schedule(Timer *timer, uint64_t delay_us);
+
+// disarm `timer`. return true if it was pending.
+// the callback may still be running on the timer thread when this returns.
+bool timer_cancel(Timer *timer);
+
+// disarm `timer` and wait until its callback is not running.
+// must not be called from a timer callback, nor while holding a lock the callback takes.
+void timer_cancel_sync(Timer *timer);
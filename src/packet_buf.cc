@@ -0,0 +1,82 @@
+#include "packet_buf.h"
+
+#include <mutex>
+#include <atomic>
+
+struct PacketFreeList {
+    PacketBuf *head = nullptr;
+    size_t count = 0;
+
+    void push(PacketBuf *pkt) {
+        pkt->next = head;
+        head = pkt;
+        count++;
+    }
+
+    PacketBuf *pop() {
+        PacketBuf *pkt = head;
+        head = pkt->next;
+        pkt->next = nullptr;
+        count--;
+        return pkt;
+    }
+
+    // move n buffers (or all of them, if fewer) to `to`.
+    void move_to(PacketFreeList &to, size_t n) {
+        while (n-- > 0 && head != nullptr)
+            to.push(pop());
+    }
+};
+
+// shared by all the threads. never destroyed, as threads may give their caches back at any time.
+static std::mutex &depot_lock = *new std::mutex;
+static PacketFreeList &depot = *new PacketFreeList;
+static std::atomic<size_t> pool_size{0};
+
+struct PacketCache {
+    PacketFreeList list;
+
+    ~PacketCache() {
+        std::lock_guard<std::mutex> lock(depot_lock);
+        list.move_to(depot, list.count);
+    }
+};
+static thread_local PacketCache cache;
+
+// take a batch from the depot, or create one if it is empty.
+static void _packet_refill() {
+    {
+        std::lock_guard<std::mutex> lock(depot_lock);
+        depot.move_to(cache.list, kPacketCacheBatch);
+    }
+    if (cache.list.count > 0)
+        return;
+
+    PacketBuf *slab = new PacketBuf[kPacketCacheBatch];
+    for (size_t i = 0; i < kPacketCacheBatch; i++)
+        cache.list.push(&slab[i]);
+    pool_size.fetch_add(kPacketCacheBatch, std::memory_order_relaxed);
+}
+
+PacketPtr packet_alloc() {
+    if (cache.list.count == 0)
+        _packet_refill();
+    PacketBuf *pkt = cache.list.pop();
+    pkt->reset();
+    return PacketPtr(pkt);
+}
+
+void packet_free(PacketBuf *pkt) {
+    if (pkt == nullptr)
+        return;
+    cache.list.push(pkt);
+    // a thread that frees more than it allocates, e.g. a sender, gives the surplus back.
+    if (cache.list.count >= 2 * kPacketCacheBatch) {
+        std::lock_guard<std::mutex> lock(depot_lock);
+        cache.list.move_to(depot, kPacketCacheBatch);
+    }
+}
+
+size_t packet_pool_size() {
+    return pool_size.load(std::memory_order_relaxed);
+}
@@ -5,26 +5,127 @@
 #include "arp.h"
 #include "routing.h"
 #include "gracefully_shutdown.h"
+#include "ringbuffer.h"
+#include "pnx_epoll.h"
+#include "pnx_utils.h"
 
 #include <mutex>
 #include <pcap.h>
 #include <atomic>
 #include <thread>
+#include <condition_variable>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <netinet/ip.h>
 
 static std::atomic<FrameReceiveCallback> recv_callback{nullptr};
 
-int send_frame(const void* buf, int len, int ethtype, const ether_addr* destmac, int id) {
+// lets the consumer of lock-free rings sleep when they are empty.
+// producers touch the lock and the condition variable only when the consumer sleeps.
+struct IdleWaiter {
+    // set by the consumer before it sleeps, so that the producers know to wake it up.
+    std::atomic<bool> sleeping{false};
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    // by a producer, after a push.
+    void wake() {
+        // pairs with the fence in sleep(): either the consumer sees the new element, or we see it sleeping.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_one();
+        }
+    }
+
+    // by the consumer, till `ready` holds.
+    template<typename Pred>
+    void sleep(Pred ready) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond.wait(lock, ready);
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    // after a stop flag is set.
+    void wake_for_stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cond.notify_all();
+    }
+};
+
+// frames waiting to be sent on one device, and the thread sending them.
+// any thread pushes without a lock; the sender pops them in batches.
+struct TxQueue {
+    MpscRing<PacketBuf*, kTxRingSize> ring;
+    IdleWaiter waiter;
+    std::thread thread;
+};
+
+static std::atomic<TxQueue*> tx_queues[MAX_DEVICE_NUM];
+static std::atomic<bool> tx_stop{false};
+
+static void _tx_loop(int device_id, DevBackend *dev, TxQueue *q) {
+    PacketBuf *batch[kTxBatch];
+
+    while (true) {
+        size_t n = q->ring.pop(batch, kTxBatch);
+        if (n > 0) {
+            int sent = dev->send(batch, n);
+            if (sent != (int)n) {
+                logError("fail to send %d of %zu eth frames. dev_id=%d", sent < 0 ? (int)n : (int)n - sent, n, device_id);
+            }
+            for (size_t i = 0; i < n; i++)
+                packet_free(batch[i]);
+        }
+        if (n > 0)
+            continue;
+        // everything queued before the stop is flushed.
+        if (tx_stop.load())
+            return;
+
+        q->waiter.sleep([q]() { return !q->ring.empty() || tx_stop.load(); });
+    }
+}
+
+int tx_thread_go(int device_id, DevBackend *dev) {
     static std::mutex mutex;
+    static bool init = false;
     std::lock_guard<std::mutex> lock(mutex);
 
-    char frame[ETHER_MAX_LEN];
+    if (init == false) {
+        init = true;
+        add_exit_clean_up([]() {
+            tx_stop.store(true);
+            for (auto &slot : tx_queues) {
+                TxQueue *q = slot.load();
+                if (q == nullptr)
+                    continue;
+                q->waiter.wake_for_stop();
+                q->thread.join();
+            }
+        }, EXIT_CLEAN_UP_PRIORITY_LINK_SENDING);
+    }
+
+    // never freed, as a sender may still look it up during the exit.
+    TxQueue *q = new TxQueue;
+    q->thread = std::thread(_tx_loop, device_id, dev, q);
+    tx_queues[device_id].store(q, std::memory_order_release);
+    return 0;
+}
 
+int send_frame(PacketPtr pkt, int ethtype, const ether_addr* destmac, int id) {
     struct ether_header *eth_header;
     assert(ETH_HLEN == sizeof(struct ether_header));
 
+    size_t len = pkt->len;
     size_t frame_length = ETH_HLEN + len + ETHER_CRC_LEN;
-    if (frame_length > ETHER_MAX_LEN) {
-        logError("try to send a too large eth frame. frame_len=%u", frame_length);
+    if (frame_length > ETHER_MAX_LEN || pkt->headroom() < ETH_HLEN || pkt->tailroom() < ETHER_CRC_LEN) {
+        logError("try to send a too large eth frame. frame_len=%zu", frame_length);
         return -1;
     }
 
@@ -33,51 +134,64 @@ int send_frame(const void* buf, int len, int ethtype, const ether_addr* destmac,
         return -1;
     }
 
-    eth_header = (struct ether_header*) frame;
+    eth_header = (struct ether_header*) pkt->prepend(ETH_HLEN);
 
     memcpy(eth_header->ether_shost, dev_mac(id), ETH_ALEN);
     memcpy(eth_header->ether_dhost, destmac->ether_addr_octet, ETH_ALEN);
     eth_header->ether_type = htons(ethtype);
 
-    memcpy(frame + ETH_HLEN, buf, len);
     size_t padding = 0;
     // if (frame_length < ETHER_MIN_LEN) {
     //     logTrace("try to send a too small eth frame (len %d). apply padding.", frame_length);
     //     padding = ETHER_MIN_LEN - frame_length;
-    //     memset(frame + ETH_HLEN + len, 0, padding);
+    //     memset(pkt->append(padding), 0, padding);
     // }
     
-    memset(frame + ETH_HLEN + len, 0, ETHER_CRC_LEN); // we dont calc CRC yet.
+    memset(pkt->append(ETHER_CRC_LEN), 0, ETHER_CRC_LEN); // we dont calc CRC yet.
 
-    if (pcap_sendpacket(get_pcap_handle(id), (u_char*) frame, frame_length + padding) != 0) {
-        logError("fail to send eth frame. dev_id=%d", id);
+    TxQueue *q = tx_queues[id].load(std::memory_order_acquire);
+    if (q == nullptr) {
+        logError("no sender for device %d", id);
         return -1;
     }
+    PacketBuf *frame = pkt.get();
+    if (!q->ring.push(std::move(frame))) {
+        // like a full NIC queue, the frame is dropped and left to the upper layer to resend.
+        logWarning("tx ring is full, drop a frame. dev_id=%d", id);
+        return -1;
+    }
+    pkt.release();
+    q->waiter.wake();
 
-    logDebug("a packet was sent to device %s, frame_len=%u, workload_len=%u", 
+    logDebug("a packet was queued to device %s, frame_len=%zu, workload_len=%zu", 
         get_device_name(id), frame_length + padding, len + padding);
     return 0; // 0 for success
 }
 
-static void frame_handler(
-    u_char *_dev_id, // user-specific data, used as dev_id 
-    const struct pcap_pkthdr *h, 
-    const u_char * bytes) {
+int send_frame(const void* buf, int len, int ethtype, const ether_addr* destmac, int id) {
+    PacketPtr pkt = packet_alloc();
+    if (len < 0 || (size_t)len > pkt->tailroom()) {
+        logError("try to send a too large eth frame. workload_len=%d", len);
+        return -1;
+    }
+    memcpy(pkt->append(len), buf, len);
+    return send_frame(std::move(pkt), ethtype, destmac, id);
+}
 
-    if (h->caplen != h->len) {
-        logWarning("recv strange frame. caplen=%u, len=%u", h->caplen, h->len);
+// hand a frame to the upper layers.
+static void _frame_demux(int dev_id, const u_char *bytes, size_t caplen, size_t len) {
+    if (caplen != len) {
+        logWarning("recv strange frame. caplen=%zu, len=%zu", caplen, len);
     }
 
     struct ether_header *eth_header = (struct ether_header*) bytes;
 
-
-    int dev_id = *(int*) _dev_id;
     logDebug("recv a eth frame, dev=%s, protocol=%d", 
         get_device_name(dev_id), ntohs(eth_header->ether_type));
 
     // PNX DV upd
     if (ntohs(eth_header->ether_type) == kRoutingProtocolCode) {
-        if (distance_upd_handler(dev_id, (const char *)(bytes + ETH_HLEN), h->caplen - ETH_HLEN) != 0) {
+        if (distance_upd_handler(dev_id, (const char *)(bytes + ETH_HLEN), caplen - ETH_HLEN) != 0) {
             logError("upper layer fails to handle PNX DV update packet");
         }
     }
@@ -91,7 +205,7 @@ static void frame_handler(
 
     // IP
     if (ntohs(eth_header->ether_type) == ETHERTYPE_IP) {
-        if (ip_packet_handler(bytes + ETH_HLEN, h->caplen - ETH_HLEN - ETHER_CRC_LEN) != 0) {
+        if (ip_packet_handler(bytes + ETH_HLEN, caplen - ETH_HLEN - ETHER_CRC_LEN) != 0) {
             logError("upper layer fails to handle IP packet");
         }
     }
@@ -102,21 +216,175 @@ static void frame_handler(
 
     auto callback = recv_callback.load();
     if (callback)
-        callback(bytes, h->caplen, dev_id);
+        callback(bytes, caplen, dev_id);
+}
+
+// frames steered to one worker. each device has its own ring, as its receiving thread is the only producer.
+struct RxWorker {
+    std::atomic<SpscRing<PacketBuf*, kRxRingSize>*> rings[MAX_DEVICE_NUM];
+    IdleWaiter waiter;
+    std::thread thread;
+
+    bool empty() {
+        for (int i = 0; i < MAX_DEVICE_NUM; i++) {
+            auto ring = rings[i].load(std::memory_order_acquire);
+            if (ring == nullptr)
+                break;
+            if (!ring->empty())
+                return false;
+        }
+        return true;
+    }
+};
+
+// set when the receiving threads start, and fixed afterwards.
+static RxWorker *rx_workers = nullptr;
+static size_t rx_worker_cnt = 0;
+static std::atomic<bool> rx_worker_stop{false};
+static std::atomic<long> rx_spin_us{kRxSpinUsDefault};
+
+// the flow of an IPv4 frame: the addresses, and the ports for TCP and UDP.
+// return false if it's not IPv4.
+static bool _flow_hash(const u_char *bytes, size_t caplen, uint32_t *hash) {
+    if (caplen < ETH_HLEN + sizeof(struct ip))
+        return false;
+    if (ntohs(((const struct ether_header *)bytes)->ether_type) != ETHERTYPE_IP)
+        return false;
+
+    const struct ip *ip = (const struct ip *)(bytes + ETH_HLEN);
+    uint32_t h = ip->ip_src.s_addr * 0x9e3779b1u ^ ip->ip_dst.s_addr;
+    size_t hlen = ip->ip_hl * 4;
+    bool fragment = (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) != 0;
+    if ((ip->ip_p == IPPROTO_TCP || ip->ip_p == IPPROTO_UDP) && !fragment
+        && caplen >= ETH_HLEN + hlen + 4) {
+        uint32_t ports;
+        memcpy(&ports, bytes + ETH_HLEN + hlen, 4);
+        h = h * 0x9e3779b1u ^ ports;
+    }
+    *hash = h * 0x9e3779b1u;
+    return true;
+}
+
+static void frame_handler(
+    void *_dev_id, // user-specific data, used as dev_id 
+    const u_char * bytes,
+    size_t caplen,
+    size_t len) {
+
+    int dev_id = *(int*) _dev_id;
+    uint32_t hash;
+    if (rx_worker_cnt == 0 || caplen > PacketBuf::kRoom - kPacketHeadroom || !_flow_hash(bytes, caplen, &hash)) {
+        // ARP and DV are rare, and stay on this thread. so does a frame too large for a fresh buffer.
+        _frame_demux(dev_id, bytes, caplen, len);
+        return;
+    }
+
+    // the same flow always goes to the same worker, so its segments keep their order.
+    // `bytes` is only valid during this call, so the frame is copied once here.
+    RxWorker *w = &rx_workers[(hash >> 16) % rx_worker_cnt];
+    PacketPtr pkt = packet_alloc();
+    memcpy(pkt->append(caplen), bytes, caplen);
+    if (caplen != len)
+        logWarning("recv strange frame. caplen=%zu, len=%zu", caplen, len);
+
+    PacketBuf *frame = pkt.get();
+    if (!w->rings[dev_id].load(std::memory_order_relaxed)->push(std::move(frame))) {
+        logWarning("rx ring is full, drop a frame. dev_id=%d", dev_id);
+        return;
+    }
+    pkt.release();
+    w->waiter.wake();
+}
+
+static void _rx_worker_loop(RxWorker *w) {
+    PacketBuf *batch[kRxBatch];
+    long long idle_since = 0; // when the last frame was seen, or 0 while busy.
+
+    while (!rx_worker_stop.load(std::memory_order_relaxed)) {
+        size_t total = 0;
+        for (int dev_id = 0; dev_id < MAX_DEVICE_NUM; dev_id++) {
+            auto ring = w->rings[dev_id].load(std::memory_order_acquire);
+            if (ring == nullptr)
+                break;
+            size_t n = ring->pop(batch, kRxBatch);
+            for (size_t i = 0; i < n; i++) {
+                _frame_demux(dev_id, (const u_char *)batch[i]->data(), batch[i]->len, batch[i]->len);
+                packet_free(batch[i]);
+            }
+            total += n;
+        }
+        if (total > 0) {
+            idle_since = 0;
+            continue;
+        }
+
+        // like the receiving threads, poll for a while before sleeping.
+        long long now = get_time_us();
+        if (idle_since == 0)
+            idle_since = now;
+        long spin = rx_spin_us.load(std::memory_order_relaxed);
+        if (spin < 0 || now - idle_since < spin)
+            continue;
+        w->waiter.sleep([w]() { return !w->empty() || rx_worker_stop.load(); });
+        idle_since = 0;
+    }
+}
+
+static long rx_workers_wanted = -1; // -1: decide by the number of cores.
+
+void set_rx_workers(int n) {
+    rx_workers_wanted = n;
+}
+
+static size_t _rx_worker_default() {
+    // with few cores, the hand-off costs more than it gains.
+    unsigned cores = std::thread::hardware_concurrency();
+    if (cores < 4)
+        return 0;
+    return std::min<size_t>(cores / 2, kRxWorkersMax);
+}
+
+static void _rx_workers_start() {
+    char *env = getenv("PNX_RX_WORKERS");
+    if (env != nullptr)
+        rx_workers_wanted = strtol(env, nullptr, 10);
+    rx_worker_cnt = rx_workers_wanted < 0 ? _rx_worker_default()
+        : std::min<size_t>(rx_workers_wanted, kRxWorkersMax);
+    if (rx_worker_cnt == 0)
+        return;
+
+    rx_workers = new RxWorker[rx_worker_cnt];
+    for (size_t i = 0; i < rx_worker_cnt; i++) {
+        for (auto &ring : rx_workers[i].rings)
+            ring.store(nullptr);
+        rx_workers[i].thread = std::thread(_rx_worker_loop, &rx_workers[i]);
+    }
+    logInfo("rx workers: %zu", rx_worker_cnt);
+}
+
+static void _rx_workers_stop() {
+    rx_worker_stop.store(true);
+    for (size_t i = 0; i < rx_worker_cnt; i++) {
+        rx_workers[i].waiter.wake_for_stop();
+        rx_workers[i].thread.join();
+    }
 }
 
-static pcap_handler callback_wrapper = &frame_handler;
 
 int set_frame_receive_callback(FrameReceiveCallback callback) {
     recv_callback.store(callback);
     return 0;
 }
 
-#include <mutex>
+void set_rx_spin_us(long us) {
+    rx_spin_us.store(us);
+}
 
 int recv_thread_go(int device_id) {
     static std::atomic<bool> stop{false};
-    static std::vector<std::thread> threads;
+    // never freed. it may be built after the exit clean-up is registered, and would be
+    // destroyed before the clean-up joins the threads then.
+    static std::vector<std::thread> *threads = new std::vector<std::thread>;
     static std::mutex mutex;
     static bool init = false;
     std::lock_guard<std::mutex> lock(mutex);
@@ -125,22 +393,62 @@ int recv_thread_go(int device_id) {
         init = true;
         add_exit_clean_up([&]() {
             stop.store(true);
-            for (auto& t : threads) {
+            for (auto& t : *threads) {
                 t.join();
             }
+            // no frame comes from the receiving threads now.
+            _rx_workers_stop();
         }, EXIT_CLEAN_UP_PRIORITY_LINK_RECVING);
+
+        char *env_spin = getenv("PNX_RX_SPIN_US");
+        if (env_spin != nullptr) {
+            rx_spin_us.store(strtol(env_spin, nullptr, 10));
+            logInfo("rx spin: %ld us", rx_spin_us.load());
+        }
+        _rx_workers_start();
     }
 
+    // devices are added one at a time, so the workers see the rings of a device before its frames.
+    for (size_t i = 0; i < rx_worker_cnt; i++)
+        rx_workers[i].rings[device_id].store(new SpscRing<PacketBuf*, kRxRingSize>(), std::memory_order_release);
+
     std::thread recv = std::thread([device_id]() {
-        pcap_t *dev = get_pcap_handle(device_id);
+        DevBackend *dev = get_dev_backend(device_id);
+        int fd = dev->selectable_fd();
+        long long idle_since = 0; // when the last frame was seen, or 0 while busy.
+
         while (stop.load() == false) {
-            if (pcap_dispatch(dev, -1, callback_wrapper, (u_char*) &device_id) == -1) {
-                logError("pcap_dispatch error");
+            int n = dev->dispatch(frame_handler, (void*) &device_id);
+            if (n == -1) {
+                logError("%s dispatch error", dev->kind());
                 return -1;
             }
+            if (n > 0) {
+                idle_since = 0;
+                continue;
+            }
+
+            // nothing received. keep polling for a while, as the next frame often comes soon.
+            long long now = get_time_us();
+            if (idle_since == 0)
+                idle_since = now;
+            long spin = rx_spin_us.load(std::memory_order_relaxed);
+            if (spin < 0 || now - idle_since < spin)
+                continue;
+
+            // then sleep till the device has something. wake up now and then to check the stop flag.
+            if (fd >= 0) {
+                struct pollfd pfd = {fd, POLLIN, 0};
+                if (__real_poll(&pfd, 1, kRxPollTimeoutMs) < 0 && errno != EINTR) {
+                    logError("fail to poll device %d. errmsg=%s", device_id, strerror(errno));
+                    return -1;
+                }
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(kRxSleepUs));
+            }
         }
         return 0;
     });
-    threads.push_back(std::move(recv));
+    threads->push_back(std::move(recv));
     return 0;
 }
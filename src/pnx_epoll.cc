@@ -0,0 +1,589 @@
+#include "pnx_epoll.h"
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#include "pnx_socket.h"
+#include "pnx_socket_block.h"
+#include "logger.h"
+#include "rustex.h"
+
+// the TCP layer reports poll(2) bits. they are the same as the epoll ones.
+static_assert(POLLIN == EPOLLIN && POLLOUT == EPOLLOUT && POLLERR == EPOLLERR
+    && POLLHUP == EPOLLHUP && POLLRDHUP == EPOLLRDHUP, "poll and epoll bits differ");
+
+// the flags that are not events. an item with nothing else is disabled, e.g. a fired EPOLLONESHOT.
+static const uint32_t kEpollPrivateBits = EPOLLET | EPOLLONESHOT | EPOLLWAKEUP | EPOLLEXCLUSIVE;
+
+struct PnxEpoll;
+
+// a PNX socket watched by an instance. shared by the instance and the socket.
+struct EpollItem {
+    PnxEpoll *ep;
+    SocketBlock *sb;
+    int fd;
+
+    // guarded by the lock of `ep`.
+    uint32_t events;
+    epoll_data_t data;
+    bool ready;   // on the ready list.
+    bool removed; // taken off the instance. the socket may still hold it for a while.
+};
+
+// shared by the fd table and the calls in progress on it, so that a close() in the middle of
+// an epoll_wait() only detaches it. the fds are closed when the last user is gone.
+struct PnxEpoll {
+    int fd;
+    // readable once the ready list gets something. epoll_wait sleeps on it.
+    int event_fd;
+    // the real fds added to this instance. -1 for the temporary one of poll().
+    int real_epfd;
+    int real_count;
+
+    std::mutex lock;
+    std::unordered_map<int, std::shared_ptr<EpollItem>> items;
+    std::deque<std::shared_ptr<EpollItem>> ready;
+    // event_fd is written and not drained yet.
+    bool signaled;
+    // closed by the user. no more items are taken.
+    bool closed;
+
+    ~PnxEpoll() {
+        __real_close(event_fd);
+        if (real_epfd >= 0)
+            __real_close(real_epfd);
+    }
+};
+
+static rustex::mutex<std::unordered_map<int, std::shared_ptr<PnxEpoll>>> epolls;
+
+static std::shared_ptr<PnxEpoll> _epoll_new(bool with_real) {
+    int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        logWarning("epoll: fail to create an eventfd");
+        return nullptr;
+    }
+
+    int real_epfd = -1;
+    if (with_real) {
+        real_epfd = __real_epoll_create1(EPOLL_CLOEXEC);
+        if (real_epfd < 0) {
+            logWarning("epoll: fail to create a real epoll");
+            __real_close(event_fd);
+            return nullptr;
+        }
+    }
+
+    auto ep = std::make_shared<PnxEpoll>();
+    ep->fd = -1;
+    ep->event_fd = event_fd;
+    ep->real_epfd = real_epfd;
+    ep->real_count = 0;
+    ep->signaled = false;
+    ep->closed = false;
+    return ep;
+}
+
+static std::shared_ptr<PnxEpoll> _epoll_get(int fd) {
+    auto eps = epolls.lock();
+    auto it = eps->find(fd);
+    if (it == eps->end())
+        return nullptr;
+    return it->second;
+}
+
+// the followings are called with the lock of `ep` held.
+
+static void _epoll_signal(PnxEpoll *ep) {
+    if (ep->signaled)
+        return;
+    ep->signaled = true;
+    uint64_t one = 1;
+    if (__real_write(ep->event_fd, &one, sizeof(one)) != sizeof(one))
+        logWarning("epoll: fail to signal the eventfd");
+}
+
+static void _epoll_drain(PnxEpoll *ep) {
+    if (!ep->signaled)
+        return;
+    ep->signaled = false;
+    uint64_t count;
+    if (__real_read(ep->event_fd, &count, sizeof(count)) != sizeof(count))
+        logWarning("epoll: fail to drain the eventfd");
+}
+
+static void _epoll_queue(PnxEpoll *ep, const std::shared_ptr<EpollItem> &item, bool signal) {
+    if (item->ready || item->removed || !(item->events & ~kEpollPrivateBits))
+        return;
+    item->ready = true;
+    ep->ready.push_back(item);
+    if (signal)
+        _epoll_signal(ep);
+}
+
+// end of the lock-held ones.
+
+static void _epoll_unwatch(const std::shared_ptr<EpollItem> &item) {
+    std::lock_guard<std::mutex> lock(item->sb->lock);
+    auto &watchers = item->sb->watchers;
+    watchers.erase(std::remove(watchers.begin(), watchers.end(), item), watchers.end());
+}
+
+static int _epoll_watch(PnxEpoll *ep, SocketBlock *sb, int fd, uint32_t events, epoll_data_t data) {
+    auto item = std::make_shared<EpollItem>();
+    item->ep = ep;
+    item->sb = sb;
+    item->fd = fd;
+    item->events = events;
+    item->data = data;
+    item->ready = false;
+    item->removed = false;
+
+    {
+        std::lock_guard<std::mutex> lock(ep->lock);
+        if (ep->closed) {
+            errno = EBADF;
+            return -1;
+        }
+        if (ep->items.find(fd) != ep->items.end()) {
+            errno = EEXIST;
+            return -1;
+        }
+        ep->items[fd] = item;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sb->lock);
+        sb->watchers.push_back(item);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ep->lock);
+        // it may be ready already, and no event will come. let the next wait check it.
+        _epoll_queue(ep, item, true);
+        if (!item->removed)
+            return 0;
+    }
+    // taken off by a close() or EPOLL_CTL_DEL before it got on the socket, so their unwatch
+    // may have missed it. the socket must not keep it, it would outlive the instance.
+    _epoll_unwatch(item);
+    return 0;
+}
+
+// take it off every socket. the fds stay open for the calls still holding it.
+static void _epoll_detach(PnxEpoll *ep) {
+    std::unordered_map<int, std::shared_ptr<EpollItem>> items;
+    {
+        std::lock_guard<std::mutex> lock(ep->lock);
+        ep->closed = true;
+        items.swap(ep->items);
+        for (auto &pair : items)
+            pair.second->removed = true;
+        ep->ready.clear();
+    }
+
+    // once off every socket, only the holders of the shared_ptr can reach `ep`.
+    for (auto &pair : items)
+        _epoll_unwatch(pair.second);
+}
+
+// report the ready items into `events`. the level-triggered ones are queued again,
+// the edge-triggered ones wait for the next notification.
+static int _epoll_collect(PnxEpoll *ep, struct epoll_event *events, int maxevents) {
+    std::deque<std::shared_ptr<EpollItem>> ready;
+    {
+        std::lock_guard<std::mutex> lock(ep->lock);
+        _epoll_drain(ep);
+        ready.swap(ep->ready);
+        for (auto &item : ready)
+            item->ready = false;
+    }
+
+    int n = 0;
+    std::vector<std::shared_ptr<EpollItem>> again;
+    for (auto &item : ready) {
+        if (n == maxevents) {
+            // no room. not checked yet.
+            again.push_back(item);
+            continue;
+        }
+
+        uint32_t want;
+        epoll_data_t data;
+        {
+            std::lock_guard<std::mutex> lock(ep->lock);
+            if (item->removed)
+                continue;
+            want = item->events;
+            data = item->data;
+        }
+
+        // no epoll lock held here, the TCB lock is taken before it.
+        uint32_t revents = socket_poll(item->sb) & (want | EPOLLERR | EPOLLHUP);
+        if (revents == 0)
+            continue;
+
+        events[n].events = revents;
+        events[n].data = data;
+        n++;
+
+        if (want & EPOLLONESHOT) {
+            std::lock_guard<std::mutex> lock(ep->lock);
+            item->events &= kEpollPrivateBits;
+        } else if (!(want & EPOLLET)) {
+            again.push_back(item);
+        }
+    }
+
+    if (!again.empty()) {
+        // no signal. every wait collects before it sleeps.
+        std::lock_guard<std::mutex> lock(ep->lock);
+        for (auto &item : again)
+            _epoll_queue(ep, item, false);
+    }
+    return n;
+}
+
+// milliseconds left before `deadline`, or -1 for no timeout.
+static int _epoll_remaining(int timeout, std::chrono::steady_clock::time_point deadline) {
+    if (timeout < 0)
+        return -1;
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    return std::max<int>(0, left.count());
+}
+
+void epoll_notify(SocketBlock *sb) {
+    std::lock_guard<std::mutex> lock(sb->lock);
+    for (auto &item : sb->watchers) {
+        std::lock_guard<std::mutex> ep_lock(item->ep->lock);
+        _epoll_queue(item->ep, item, true);
+    }
+}
+
+void epoll_forget(SocketBlock *sb) {
+    std::lock_guard<std::mutex> lock(sb->lock);
+    for (auto &item : sb->watchers) {
+        PnxEpoll *ep = item->ep;
+        std::lock_guard<std::mutex> ep_lock(ep->lock);
+        item->removed = true;
+        auto it = ep->items.find(item->fd);
+        if (it != ep->items.end() && it->second == item)
+            ep->items.erase(it);
+    }
+    sb->watchers.clear();
+}
+
+int epoll_close(int fd) {
+    std::shared_ptr<PnxEpoll> ep;
+    {
+        auto eps = epolls.lock_mut();
+        auto it = eps->find(fd);
+        if (it == eps->end())
+            return -1;
+        ep = std::move(it->second);
+        eps->erase(it);
+    }
+    _epoll_detach(ep.get());
+    return 0;
+}
+
+int __wrap_epoll_create(int size) {
+    if (size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return __wrap_epoll_create1(0);
+}
+
+int __wrap_epoll_create1(int flags) {
+    if (flags & ~EPOLL_CLOEXEC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // always a PNX instance. it takes real fds as well.
+    auto ep = _epoll_new(true);
+    if (ep == nullptr) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ep->fd = socket_new_fd();
+    epolls.lock_mut()->insert({ep->fd, ep});
+    return ep->fd;
+}
+
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    if (epfd < kSocketMinFd) {
+        if (fd >= kSocketMinFd) {
+            logWarning("epoll_ctl: a PNX fd can not be added to a real epoll");
+            errno = EPERM;
+            return -1;
+        }
+        return __real_epoll_ctl(epfd, op, fd, event);
+    }
+
+    auto ep = _epoll_get(epfd);
+    if (ep == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    if (fd == epfd) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (op != EPOLL_CTL_DEL && event == nullptr) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (fd < kSocketMinFd) {
+        // a real one.
+        int ret = __real_epoll_ctl(ep->real_epfd, op, fd, event);
+        if (ret == 0 && op == EPOLL_CTL_ADD) {
+            std::lock_guard<std::mutex> lock(ep->lock);
+            ep->real_count++;
+        } else if (ret == 0 && op == EPOLL_CTL_DEL) {
+            std::lock_guard<std::mutex> lock(ep->lock);
+            ep->real_count--;
+        }
+        return ret;
+    }
+
+    SocketBlock *sb = socket_lookup(fd);
+    if (sb == nullptr) {
+        // nested epoll instances are not supported.
+        errno = _epoll_get(fd) != nullptr ? EINVAL : EBADF;
+        return -1;
+    }
+
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            return _epoll_watch(ep.get(), sb, fd, event->events, event->data);
+
+        case EPOLL_CTL_MOD: {
+            std::lock_guard<std::mutex> lock(ep->lock);
+            auto it = ep->items.find(fd);
+            if (it == ep->items.end()) {
+                errno = ENOENT;
+                return -1;
+            }
+            it->second->events = event->events;
+            it->second->data = event->data;
+            // report the current readiness under the new mask, as Linux does.
+            _epoll_queue(ep.get(), it->second, true);
+            return 0;
+        }
+
+        case EPOLL_CTL_DEL: {
+            std::shared_ptr<EpollItem> item;
+            {
+                std::lock_guard<std::mutex> lock(ep->lock);
+                auto it = ep->items.find(fd);
+                if (it == ep->items.end()) {
+                    errno = ENOENT;
+                    return -1;
+                }
+                item = it->second;
+                item->removed = true;
+                ep->items.erase(it);
+            }
+            _epoll_unwatch(item);
+            return 0;
+        }
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    if (epfd < kSocketMinFd) {
+        return __real_epoll_wait(epfd, events, maxevents, timeout);
+    }
+
+    auto ep = _epoll_get(epfd);
+    if (ep == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+    if (maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeout, 0));
+    while (true) {
+        // drain first, so that an event after the collection wakes up the sleep below.
+        int n = _epoll_collect(ep.get(), events, maxevents);
+
+        int real_count;
+        {
+            std::lock_guard<std::mutex> lock(ep->lock);
+            real_count = ep->real_count;
+        }
+        if (n < maxevents && real_count > 0) {
+            int m = __real_epoll_wait(ep->real_epfd, events + n, maxevents - n, 0);
+            if (m > 0)
+                n += m;
+        }
+        if (n > 0)
+            return n;
+
+        int wait_ms = _epoll_remaining(timeout, deadline);
+        if (wait_ms == 0)
+            return 0;
+
+        struct pollfd pfds[2] = {
+            {ep->event_fd, POLLIN, 0},
+            {ep->real_epfd, POLLIN, 0},
+        };
+        if (__real_poll(pfds, real_count > 0 ? 2 : 1, wait_ms) < 0)
+            return -1; // EINTR
+    }
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    bool any_pnx = false;
+    for (nfds_t i = 0; i < nfds; i++)
+        any_pnx |= fds[i].fd >= kSocketMinFd;
+    if (!any_pnx) {
+        return __real_poll(fds, nfds, timeout);
+    }
+
+    // the PNX fds are watched by a temporary instance, only to be woken up.
+    // their readiness is checked directly, since poll reports all of them anyway.
+    auto ep = _epoll_new(false);
+    if (ep == nullptr) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    std::vector<struct pollfd> real;
+    std::vector<nfds_t> real_index;
+    std::vector<std::pair<nfds_t, SocketBlock*>> pnx;
+    int invalid = 0;
+    for (nfds_t i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0)
+            continue;
+
+        if (fds[i].fd < kSocketMinFd) {
+            real.push_back(fds[i]);
+            real_index.push_back(i);
+            continue;
+        }
+
+        SocketBlock *sb = socket_lookup(fds[i].fd);
+        if (sb == nullptr) {
+            fds[i].revents = POLLNVAL;
+            invalid++;
+            continue;
+        }
+        pnx.push_back({i, sb});
+        // the same fd may come twice. one watch is enough, so EEXIST is fine.
+        epoll_data_t data;
+        data.u64 = i;
+        _epoll_watch(ep.get(), sb, fds[i].fd, fds[i].events, data);
+    }
+    real.push_back({ep->event_fd, POLLIN, 0});
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeout, 0));
+    int ret;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(ep->lock);
+            _epoll_drain(ep.get());
+        }
+
+        int n = invalid;
+        for (auto &p : pnx) {
+            struct pollfd &pfd = fds[p.first];
+            pfd.revents = socket_poll(p.second) & (pfd.events | POLLERR | POLLHUP | POLLNVAL);
+            if (pfd.revents)
+                n++;
+        }
+
+        int r = __real_poll(real.data(), real.size(), n > 0 ? 0 : _epoll_remaining(timeout, deadline));
+        if (r < 0) {
+            ret = -1;
+            break;
+        }
+        for (size_t i = 0; i < real_index.size(); i++) {
+            fds[real_index[i]].revents = real[i].revents;
+            if (real[i].revents)
+                n++;
+        }
+
+        if (n > 0 || (r == 0 && timeout >= 0 && _epoll_remaining(timeout, deadline) == 0)) {
+            ret = n;
+            break;
+        }
+        // woken up by a PNX socket. check them again.
+    }
+
+    _epoll_detach(ep.get());
+    return ret;
+}
+
+int __wrap_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout) {
+    if (nfds <= kSocketMinFd) {
+        return __real_select(nfds, readfds, writefds, errorfds, timeout);
+    }
+    nfds = std::min(nfds, FD_SETSIZE);
+
+    // translate into poll.
+    std::vector<struct pollfd> pfds;
+    for (int fd = 0; fd < nfds; fd++) {
+        short events = 0;
+        if (readfds != nullptr && FD_ISSET(fd, readfds))
+            events |= POLLIN;
+        if (writefds != nullptr && FD_ISSET(fd, writefds))
+            events |= POLLOUT;
+        if (errorfds != nullptr && FD_ISSET(fd, errorfds))
+            events |= POLLPRI;
+        if (events)
+            pfds.push_back({fd, events, 0});
+    }
+
+    int timeout_ms = -1;
+    if (timeout != nullptr)
+        timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+    if (__wrap_poll(pfds.data(), pfds.size(), timeout_ms) < 0)
+        return -1;
+
+    int count = 0;
+    for (auto &pfd : pfds) {
+        if (pfd.revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+    if (readfds != nullptr) FD_ZERO(readfds);
+    if (writefds != nullptr) FD_ZERO(writefds);
+    if (errorfds != nullptr) FD_ZERO(errorfds);
+    for (auto &pfd : pfds) {
+        if ((pfd.events & POLLIN) && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            FD_SET(pfd.fd, readfds);
+            count++;
+        }
+        if ((pfd.events & POLLOUT) && (pfd.revents & (POLLOUT | POLLERR))) {
+            FD_SET(pfd.fd, writefds);
+            count++;
+        }
+        if ((pfd.events & POLLPRI) && (pfd.revents & POLLPRI)) {
+            FD_SET(pfd.fd, errorfds);
+            count++;
+        }
+    }
+    return count;
+}
@@ -7,13 +7,13 @@
 #include "packetio.h"
 #include "device.h"
 #include "pnx_tcp.h"
-#include "ringbuffer.h"
-#include "gracefully_shutdown.h"
 
 #include <arpa/inet.h>
-#include <thread>
-#include <mutex>
+#include <cstring>
 #include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <net/ethernet.h>
 
 
 static std::atomic<ip_packet_callback> ip_callback{nullptr};
@@ -63,39 +63,16 @@ static bool verify_iphd_checksum(struct iphdr *ip_header) {
     return ip_header->check == calc_iphd_checksum(ip_header);
 }
 
-static int _ip_send_packet(const in_addr src, const in_addr dest, int proto,
-                 std::shared_ptr<char[]> buf, int len) {
-
-
-    // steps.
-    // 1. query routing table, get the target ip.
-    // 2. ARP query, get the target mac.
-    // 3. send the packet.
-
-    auto routing = get_next_hop(dest);
-    int dev_id = routing.first;
-    in_addr next_hop_ip = routing.second;
-    if (dev_id == -1) {
-        logWarning("cannot find next hop for %s", inet_ntoa_safe(dest).get());
-        return -1;
-    }
-
-    // ARP query
-    struct ether_addr dest_mac;
-    if (ARPQuery(dev_id, next_hop_ip, &dest_mac) != 0) {
-        logWarning("cannot find ARP entry for %s", inet_ntoa_safe(next_hop_ip).get());
-        return -1;
-    }
-
-    // construct the ethernet payload. i.e. the IP packet.
-    char packet[ETHER_MAX_LEN];
-
-    if ((size_t)len > ETHER_MAX_LEN - sizeof(struct iphdr)) {
+// prepend the IP header. return 0 on success, -1 on error.
+static int _ip_build_header(const in_addr src, const in_addr dest, int proto, PacketBuf *pkt) {
+    // construct the ethernet payload. i.e. the IP packet, in front of the IP payload.
+    size_t len = pkt->len;
+    if (len > ETHER_MAX_LEN - sizeof(struct iphdr)) {
         logError("IP Packet too large, fragmentation not supported yet.");
         return -1;
     }
     
-    struct iphdr *ip_header = (struct iphdr*)packet;
+    struct iphdr *ip_header = (struct iphdr*)pkt->prepend(sizeof(struct iphdr));
     ip_header->ihl = 5;
     ip_header->version = 4;
     ip_header->tos = 0;
@@ -112,51 +89,85 @@ static int _ip_send_packet(const in_addr src, const in_addr dest, int proto,
     // https://tools.ietf.org/html/rfc1071
 
     ip_header->check = calc_iphd_checksum(ip_header);
+    return 0;
+}
+
+int ip_send_packet(const in_addr src, const in_addr dest, int proto, PacketPtr pkt) {
+    // steps.
+    // 1. query routing table, get the target ip.
+    // 2. ARP, get the target mac. never blocks: a miss queues the packet.
+    // 3. send the packet.
+
+    auto routing = get_next_hop(dest);
+    if (routing.first == -1) {
+        logWarning("cannot find next hop for %s", inet_ntoa_safe(dest).get());
+        return -1;
+    }
+    if (_ip_build_header(src, dest, proto, pkt.get()) != 0) {
+        return -1;
+    }
+    // send the packet, or let it wait for the ARP reply.
+    return ARPOutput(routing.first, routing.second, std::move(pkt));
+}
+
 
-    memcpy(packet + sizeof(struct iphdr), buf.get(), len);
+// bumped whenever a cached route may have changed.
+static std::atomic<uint64_t> dst_generation_{1};
 
-    // send the packet
-    return send_frame(packet, ntohs(ip_header->tot_len), ETHERTYPE_IP, &dest_mac, dev_id);
+// the routes cached per destination, shared by the connections to it.
+static std::mutex dst_mutex_;
+static std::unordered_map<uint32_t, std::shared_ptr<const DstEntry>> dst_cache_;
+// the cache is simply emptied beyond this, as stale entries are not swept.
+static const size_t kDstCacheMax = 4096;
+
+void ip_dst_invalidate() {
+    dst_generation_.fetch_add(1, std::memory_order_release);
 }
 
-static BlockingRingBuffer<std::tuple<in_addr, in_addr, int, std::shared_ptr<char[]>, int>, 100> ip_sending_buffer;
-int ip_send_packet(const in_addr src, const in_addr dest, int proto,
-                 std::shared_ptr<char[]> buf, int len) {
-    // all sending task is forward to a new thread to prevent ARP deadlock.
+bool ip_dst_valid(const DstEntry *dst) {
+    return dst != nullptr && dst->generation == dst_generation_.load(std::memory_order_acquire);
+}
 
-    static std::mutex mutex;
-    static bool init_done = false;
-    std::lock_guard<std::mutex> lock(mutex);
-    
-    if (init_done == false) {
-        init_done = true;
-        static std::atomic<bool> stop{false};
-
-        std::thread t = std::thread([]() {
-            while (stop.load() == false) {
-                std::optional<std::tuple<in_addr, in_addr, int, std::shared_ptr<char[]>, int>> task;
-                task = ip_sending_buffer.pop();
-                if (!task.has_value()) {
-                    continue;
-                }
-                auto result = _ip_send_packet(std::get<0>(task.value()), 
-                    std::get<1>(task.value()), std::get<2>(task.value()), 
-                    std::get<3>(task.value()), std::get<4>(task.value()));
-                
-                if (result != 0) {
-                    logWarning("fail to send IP packet");
-                }
-            }
-        });
-        t.detach();
-
-        add_exit_clean_up([&]() {
-            stop.store(true);
-        }, EXIT_CLEAN_UP_PRIORITY_IP_SENDING);
+std::shared_ptr<const DstEntry> ip_dst_lookup(const in_addr dest) {
+    std::lock_guard<std::mutex> lock(dst_mutex_);
+    auto it = dst_cache_.find(dest.s_addr);
+    if (it != dst_cache_.end() && ip_dst_valid(it->second.get())) {
+        return it->second;
     }
 
-    while (ip_sending_buffer.push(std::make_tuple(src, dest, proto, buf, len)) != true);
-    return 0;
+    // taken before the lookups, so that a change during them leaves the entry stale.
+    uint64_t generation = dst_generation_.load(std::memory_order_acquire);
+    auto routing = get_next_hop(dest);
+    if (routing.first == -1) {
+        return nullptr;
+    }
+    auto neigh = ARPNeighbour(routing.first, routing.second);
+    if (neigh == nullptr) {
+        return nullptr;
+    }
+
+    auto dst = std::make_shared<const DstEntry>(DstEntry{
+        dest, routing.first, routing.second, dev_mtu(routing.first), std::move(neigh), generation});
+    if (dst_cache_.size() >= kDstCacheMax) {
+        dst_cache_.clear();
+    }
+    dst_cache_[dest.s_addr] = dst;
+    return dst;
+}
+
+size_t ip_route_mtu(const in_addr dest) {
+    auto routing = get_next_hop(dest);
+    if (routing.first == -1) {
+        return 0;
+    }
+    return dev_mtu(routing.first);
+}
+
+int ip_send_packet_dst(const in_addr src, const DstEntry *dst, int proto, PacketPtr pkt) {
+    if (_ip_build_header(src, dst->dest, proto, pkt.get()) != 0) {
+        return -1;
+    }
+    return ARPNeighbourOutput(dst->neigh.get(), std::move(pkt));
 }
 
 
@@ -252,16 +263,15 @@ int ip_packet_handler(const void *buf, int len) {
     ip_header->check = calc_iphd_checksum(ip_header);
 
 
-    // get next hop mac address
-    struct ether_addr dest_mac;
-    if (ARPQuery(dev_id, next_hop_ip, &dest_mac) != 0) {
-        logWarning("cannot find ARP entry for %s", inet_ntoa_safe(next_hop_ip).get());
+    // forward the packet. `buf` is only valid during this call, and the packet may wait for ARP.
+    PacketPtr pkt = packet_alloc();
+    if (len < 0 || (size_t)len > pkt->tailroom()) {
+        logWarning("IP forward: packet too large. len=%d", len);
         return -1;
     }
-
-    // forward the packet
+    memcpy(pkt->append(len), buf, len);
     logTrace("forwarding IP packet to %s", inet_ntoa_safe(next_hop_ip).get());
-    int result = send_frame(buf, len, ETHERTYPE_IP, &dest_mac, dev_id);
+    int result = ARPOutput(dev_id, next_hop_ip, std::move(pkt));
 
     if (result != 0) {
         logWarning("fail to forward IP packet");
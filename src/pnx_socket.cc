@@ -7,43 +7,32 @@
 #include <vector>
 #include <netinet/tcp.h>
 #include <unordered_map>
-#include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <climits>
+#include <cstdarg>
+#include <fcntl.h>
 
 #include "ringbuffer.h"
 #include "pnx_utils.h"
 #include "logger.h"
 #include "rustex.h"
 #include "pnx_tcp.h"
+#include "tcp_cong.h"
 #include "device.h"
+#include "pnx_socket_block.h"
+#include "pnx_epoll.h"
 
-struct SocketBlock {
-    int fd;
-    sockaddr_in addr;
-    enum State {
-        DEFAULT = 1,
-        ACTIVE,
-        PASSIVE_BINDED,
-        PASSIVE_LISTENING,
-        CLOSED
-    } state;
-
-    // only for active socket
-    TCB* tcb;
-
-    // only for PASSIVE_LISTENING socket.
-    BlockingRingBuffer<TCB*, 1024> accepting;
-    // max backlog to-accept TCB
-    int backlog;
-};
-
-const int kSocketMinFd = 1000;
 std::atomic<int> next_fd{kSocketMinFd};
 
 
 rustex::mutex<std::unordered_map<int, SocketBlock*>> sockets;
 
 int __wrap_socket(int domain, int type, int protocol) {
-    if (domain != AF_INET || type != SOCK_STREAM || protocol != 0) {
+    int flags = type & (SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (domain != AF_INET || (type & ~flags) != SOCK_STREAM || (protocol != 0 && protocol != IPPROTO_TCP)) {
         // use real socket to handle it.
         return __real_socket(domain, type, protocol);
     }
@@ -63,10 +52,11 @@ int __wrap_socket(int domain, int type, int protocol) {
     }
 
     auto block = new SocketBlock();
-    block->fd = next_fd.fetch_add(1);
+    block->fd = socket_new_fd();
     memset(&block->addr, 0, sizeof(block->addr));
     block->state = SocketBlock::DEFAULT;
     block->tcb = nullptr;
+    block->nonblock = (flags & SOCK_NONBLOCK) != 0;
 
     sockets.lock_mut()->insert({block->fd, block});
     return block->fd;
@@ -82,6 +72,14 @@ static SocketBlock* getSocketBlock(int socket) {
     return it->second;
 }
 
+int socket_new_fd() {
+    return next_fd.fetch_add(1);
+}
+
+SocketBlock* socket_lookup(int fd) {
+    return getSocketBlock(fd);
+}
+
 int __wrap_bind(int socket, const struct sockaddr *address, socklen_t address_len) {
 
     if (socket < kSocketMinFd) {
@@ -175,6 +173,20 @@ int __wrap_connect(int socket, const struct sockaddr *address, socklen_t address
         return -1;
     }
 
+    if (sb->state == SocketBlock::ACTIVE && sb->tcb != nullptr) {
+        // called again after a non-blocking one.
+        int state = tcp_getstate(sb->tcb);
+        if (state == TCP_SYN_SENT) {
+            errno = EALREADY;
+        } else if (tcp_can_send(state)) {
+            errno = EISCONN;
+        } else {
+            int err = tcp_get_error(sb->tcb);
+            errno = err != 0 ? err : EISCONN;
+        }
+        return -1;
+    }
+
     if (sb->state != SocketBlock::DEFAULT) {
         logWarning("only a default socket can connect to other socket.");
         errno = EINVAL;
@@ -199,16 +211,27 @@ int __wrap_connect(int socket, const struct sockaddr *address, socklen_t address
     sb->addr.sin_port = rand() % 10000 + 10000; // ignore conflit for simplicity.
 
     sb->state = SocketBlock::ACTIVE;
-    sb->tcb = tcp_open(&sb->addr, (const sockaddr_in*)address, nullptr);
+    sb->tcb = tcp_open(&sb->addr, (const sockaddr_in*)address, nullptr, sb->opts);
     if (sb->tcb == nullptr) {
         logWarning("fail to open a TCP connection.");
         errno = EINVAL;
         return -1;
     }
+    tcp_set_owner(sb->tcb, sb);
 
-    // wait until the connection is established.
-    while (tcp_getstate(sb->tcb) != TCP_ESTABLISHED) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (sb->nonblock) {
+        // the user waits for POLLOUT, and reads the result by SO_ERROR.
+        errno = EINPROGRESS;
+        return -1;
+    }
+
+    // wait until the connection is established, or given up.
+    tcp_wait(sb->tcb, POLLOUT);
+    if (!tcp_can_send(tcp_getstate(sb->tcb))) {
+        logWarning("fail to establish a TCP connection.");
+        int err = tcp_get_error(sb->tcb);
+        errno = err != 0 ? err : ETIMEDOUT;
+        return -1;
     }
     return 0;
 }
@@ -220,6 +243,21 @@ int __wrap_accept(int socket, struct sockaddr *remote_addr, socklen_t *address_l
         return __real_accept(socket, remote_addr, address_len);
     }
 
+    return __wrap_accept4(socket, remote_addr, address_len, 0);
+}
+
+int __wrap_accept4(int socket, struct sockaddr *remote_addr, socklen_t *address_len, int flags) {
+
+    if (socket < kSocketMinFd) {
+        // use real accept4 to handle it.
+        return __real_accept4(socket, remote_addr, address_len, flags);
+    }
+
+    if (flags & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) {
+        errno = EINVAL;
+        return -1;
+    }
+
     auto *sb = getSocketBlock(socket);
     if (sb == nullptr) {
         errno = EBADF;
@@ -232,74 +270,140 @@ int __wrap_accept(int socket, struct sockaddr *remote_addr, socklen_t *address_l
         return -1;
     }
 
+    // only established connections are queued. sleep until one comes.
     TCB* tcb = nullptr;
-    while (tcb == nullptr) {
-        {
-            auto ac = sb->accepting.pop();
-            if (!ac.has_value()) {
-                continue;
-            }
-            auto candidate = ac.value();
-
-            if (tcp_getstate(candidate) == TCP_ESTABLISHED) {
-                tcb = candidate;
-                break;
-            }
-            assert(1 == sb->accepting.push(candidate));
+    {
+        std::unique_lock<std::mutex> lock(sb->lock);
+        if (sb->nonblock && sb->accepting.empty()) {
+            errno = EAGAIN;
+            return -1;
         }
-        if (tcb == nullptr)
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        sb->cond.wait(lock, [sb]() { 
+            return !sb->accepting.empty() || sb->state != SocketBlock::PASSIVE_LISTENING; 
+        });
+        if (sb->accepting.empty()) {
+            // closed by another thread.
+            errno = EINVAL;
+            return -1;
+        }
+        tcb = sb->accepting.front();
+        sb->accepting.pop_front();
     }
 
     SocketBlock *conn_sb = new SocketBlock();
-    conn_sb->fd = next_fd.fetch_add(1);
+    conn_sb->fd = socket_new_fd();
     conn_sb->addr = sb->addr;
     conn_sb->state = SocketBlock::ACTIVE;
     conn_sb->tcb = tcb;
+    conn_sb->opts = sb->opts;
+    // not inherited from the listening socket, as Linux does.
+    conn_sb->nonblock = (flags & SOCK_NONBLOCK) != 0;
+    tcp_set_owner(tcb, conn_sb);
 
     sockets.lock_mut()->insert({conn_sb->fd, conn_sb});
 
-    *address_len = sizeof(sockaddr_in);
-    auto tmp = tcp_getpeeraddress(tcb);
-    memcpy(remote_addr, &tmp, sizeof(sockaddr_in));
+    if (remote_addr != nullptr && address_len != nullptr) {
+        auto tmp = tcp_getpeeraddress(tcb);
+        memcpy(remote_addr, &tmp, std::min<size_t>(*address_len, sizeof(sockaddr_in)));
+        *address_len = sizeof(sockaddr_in);
+    }
 
     return conn_sb->fd;
 }
 
-ssize_t __wrap_read(int fildes, void *buf, size_t nbyte) {
-
-    if (fildes < kSocketMinFd) {
-        // use real read to handle it.
-        return __real_read(fildes, buf, nbyte);
+// the data path of read() and recv(). `flags` takes MSG_DONTWAIT and MSG_WAITALL.
+static ssize_t _socket_recv(SocketBlock *sb, void *buf, size_t nbyte, int flags) {
+    if (sb->state != SocketBlock::ACTIVE) {
+        logWarning("only an active socket can read");
+        errno = EINVAL;
+        return -1;
     }
 
-    auto *sb = getSocketBlock(fildes);
-    if (sb == nullptr) {
-        errno = EBADF;
-        return -1;
+    bool block = !(flags & MSG_DONTWAIT) && !sb->nonblock;
+    nbyte = std::min<size_t>(nbyte, INT_MAX);
+    size_t done = 0;
+    while (true) {
+        // take the state first. if no more data was coming before we looked at the buffer,
+        // an empty buffer means EOF. the other order races with a data+FIN segment.
+        int state = tcp_getstate(sb->tcb);
+        int ret = tcp_receive(sb->tcb, (char*)buf + done, nbyte - done);
+        if (ret < 0) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        done += ret;
+
+        if (done == nbyte || (done > 0 && !(flags & MSG_WAITALL))) {
+            return done;
+        }
+        if (tcp_no_data_incoming_state(state)) {
+            // EOF.
+            return done;
+        }
+        if (!block) {
+            if (done > 0)
+                return done;
+            errno = EAGAIN;
+            return -1;
+        }
+        // blocking. sleep until data or EOF comes.
+        tcp_wait(sb->tcb, POLLIN);
     }
+}
 
+// the data path of write() and send(). `flags` takes MSG_DONTWAIT.
+static ssize_t _socket_send(SocketBlock *sb, const void *buf, size_t nbyte, int flags) {
     if (sb->state != SocketBlock::ACTIVE) {
-        logWarning("only an active socket can read");
+        logWarning("only an active socket can write");
         errno = EINVAL;
         return -1;
     }
 
-    int ret = 0;
-    while ((ret = tcp_receive(sb->tcb, buf, nbyte)) <= 0) {
-        if (ret < 0) {
+    bool block = !(flags & MSG_DONTWAIT) && !sb->nonblock;
+    nbyte = std::min<size_t>(nbyte, INT_MAX);
+    size_t done = 0;
+    while (done < nbyte) {
+        int use = tcp_send(sb->tcb, (const char*)buf + done, nbyte - done);
+        if (use < 0) {
+            if (done > 0)
+                return done;
+            errno = EPIPE;
             return -1;
         }
-
-        int state = tcp_getstate(sb->tcb);
-        if (tcp_no_data_incoming_state(state)) {
-            return 0;
-        } else {
-            // blocking.
+        if (use > 0) {
+            done += use;
             continue;
         }
+
+        // the send buffer is full.
+        if (!tcp_can_send(tcp_getstate(sb->tcb))) {
+            return done;
+        }
+        if (!block) {
+            if (done > 0)
+                return done;
+            errno = EAGAIN;
+            return -1;
+        }
+        // keep sending. sleep until the remote acks something.
+        tcp_wait(sb->tcb, POLLOUT);
+    }
+    return done;
+}
+
+ssize_t __wrap_read(int fildes, void *buf, size_t nbyte) {
+
+    if (fildes < kSocketMinFd) {
+        // use real read to handle it.
+        return __real_read(fildes, buf, nbyte);
     }
-    return ret;
+
+    auto *sb = getSocketBlock(fildes);
+    if (sb == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return _socket_recv(sb, buf, nbyte, 0);
 }
 
 ssize_t __wrap_write(int fildes, const void *buf, size_t nbyte) {
@@ -315,32 +419,86 @@ ssize_t __wrap_write(int fildes, const void *buf, size_t nbyte) {
         return -1;
     }
 
-    if (sb->state != SocketBlock::ACTIVE) {
-        logWarning("only an active socket can read");
-        errno = EINVAL;
+    return _socket_send(sb, buf, nbyte, 0);
+}
+
+ssize_t __wrap_recv(int socket, void *buf, size_t length, int flags) {
+
+    if (socket < kSocketMinFd) {
+        // use real recv to handle it.
+        return __real_recv(socket, buf, length, flags);
+    }
+
+    auto *sb = getSocketBlock(socket);
+    if (sb == nullptr) {
+        errno = EBADF;
         return -1;
     }
 
-    int rest_len = nbyte;
-    int done = 0;
-    while (rest_len != 0) {
-        int use = tcp_send(sb->tcb, (char*) buf + done, rest_len);
-        if (use == 0) {
-            int state = tcp_getstate(sb->tcb);
-            if (tcp_can_send(state)) {
-                // keep sending.
-                continue;
-            } else {
-                return done;
-            }
-        } else if (use < 0) {
+    if (flags & ~(MSG_DONTWAIT | MSG_WAITALL | MSG_NOSIGNAL)) {
+        logWarning("unimplemented recv flags: %d", flags);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return _socket_recv(sb, buf, length, flags);
+}
+
+ssize_t __wrap_send(int socket, const void *buf, size_t length, int flags) {
+
+    if (socket < kSocketMinFd) {
+        // use real send to handle it.
+        return __real_send(socket, buf, length, flags);
+    }
+
+    auto *sb = getSocketBlock(socket);
+    if (sb == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+
+    // no SIGPIPE is ever raised, so MSG_NOSIGNAL is a no-op.
+    if (flags & ~(MSG_DONTWAIT | MSG_NOSIGNAL)) {
+        logWarning("unimplemented send flags: %d", flags);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return _socket_send(sb, buf, length, flags);
+}
+
+int __wrap_fcntl(int fildes, int cmd, ...) {
+    // the argument is an int or a pointer, depending on `cmd`. pass it on as it is.
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void*);
+    va_end(ap);
+
+    if (fildes < kSocketMinFd) {
+        // use real fcntl to handle it.
+        return __real_fcntl(fildes, cmd, arg);
+    }
+
+    auto *sb = getSocketBlock(fildes);
+    if (sb == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+
+    switch (cmd) {
+        case F_GETFL:
+            return O_RDWR | (sb->nonblock ? O_NONBLOCK : 0);
+        case F_SETFL:
+            // the other status flags mean nothing to a PNX socket.
+            sb->nonblock = ((long)arg & O_NONBLOCK) != 0;
+            return 0;
+        case F_GETFD:
+        case F_SETFD:
+            // there is no exec for PNX fds.
+            return 0;
+        default:
+            logWarning("unimplemented fcntl: cmd %d", cmd);
+            errno = EINVAL;
             return -1;
-        } else {
-            done += use;
-            rest_len -= use;
-        }
     }
-    return nbyte;
 }
 
 int __wrap_close(int fildes) {
@@ -352,10 +510,15 @@ int __wrap_close(int fildes) {
 
     auto *sb = getSocketBlock(fildes);
     if (sb == nullptr) {
+        if (epoll_close(fildes) == 0)
+            return 0;
         errno = EBADF;
         return -1;
     }
 
+    // no more events for the epoll instances.
+    epoll_forget(sb);
+
     if (sb->state == SocketBlock::ACTIVE) {
         if (tcp_close(sb->tcb) < 0) {
             logWarning("fail to close a TCP connection.");
@@ -365,11 +528,17 @@ int __wrap_close(int fildes) {
     } else if (sb->state == SocketBlock::PASSIVE_BINDED || sb->state == SocketBlock::PASSIVE_LISTENING) {
         tcp_unregister_listening_socket(sb, sb->addr.sin_port);
 
-        while (sb->accepting.size() > 0) {
-            auto tcb = sb->accepting.pop();
-            if (tcb.has_value() == false) break; // all clean up
+        // no more connections are queued after this. the half-open ones close themselves.
+        std::deque<TCB*> accepting;
+        {
+            std::lock_guard<std::mutex> lock(sb->lock);
+            sb->state = SocketBlock::CLOSED;
+            accepting.swap(sb->accepting);
+        }
+        sb->cond.notify_all();
 
-            if (tcp_close(tcb.value()) < 0) {
+        for (TCB *tcb : accepting) {
+            if (tcp_close(tcb) < 0) {
                 logWarning("fail to close a TCP connection.");
             }
         }
@@ -396,26 +565,142 @@ int __wrap_setsockopt(int socket, int level, int option_name, const void *option
         // use real setsockopt to handle it.
         return __real_setsockopt(socket, level, option_name, option_value, option_len);
     }
-    { (void)socket; (void)level; (void)option_name; (void)option_value; (void)option_len; } // make compiler happy
-    logWarning("unimplemented setsockopt");
+
+    auto *sb = getSocketBlock(socket);
+    if (sb == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (level == SOL_SOCKET && (option_name == SO_SNDBUF || option_name == SO_RCVBUF)) {
+        if (option_value == nullptr || option_len < sizeof(int) || *(const int*)option_value <= 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        size_t size = *(const int*)option_value;
+        size = std::max(kTcpMinBufferSize, std::min(size, kTcpMaxBufferSize));
+        if (option_name == SO_SNDBUF)
+            sb->opts.sndbuf = size;
+        else
+            sb->opts.rcvbuf = size;
+
+        if (sb->tcb != nullptr)
+            tcp_setopts(sb->tcb, sb->opts);
+        return 0;
+    }
+
+    if (level == IPPROTO_TCP && option_name == TCP_CONGESTION) {
+        if (option_value == nullptr || option_len < 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        // like Linux, the name need not end with 0.
+        const char *value = (const char*)option_value;
+        std::string name(value, strnlen(value, std::min<size_t>(option_len, kTcpCongNameMax - 1)));
+        if (!tcp_cong_available(name.c_str())) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        sb->opts.congestion = name;
+        if (sb->tcb != nullptr)
+            tcp_setopts(sb->tcb, sb->opts);
+        return 0;
+    }
+
+    logWarning("unimplemented setsockopt: level %d, option %d", level, option_name);
     return 0;
 }
 
-int socket_recv_new_tcp_conn(SocketBlock *sb, TCB* tcb) {
-    if (sb->state != SocketBlock::PASSIVE_LISTENING) {
-      logWarning("only a passive-listening socket can accept new connection.");
-      errno = EINVAL;
-      return -1;
+int __wrap_getsockopt(int socket, int level, int option_name, void *option_value, socklen_t *option_len) {
+    if (socket < kSocketMinFd) {
+        // use real getsockopt to handle it.
+        return __real_getsockopt(socket, level, option_name, option_value, option_len);
+    }
+
+    auto *sb = getSocketBlock(socket);
+    if (sb == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (option_value == nullptr || option_len == nullptr || *option_len < sizeof(int)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (level == IPPROTO_TCP && option_name == TCP_INFO) {
+        // like Linux, a shorter buffer gets the front part.
+        struct tcp_info info;
+        if (sb->tcb != nullptr) {
+            tcp_get_info(sb->tcb, &info);
+        } else {
+            memset(&info, 0, sizeof(info));
+            info.tcpi_state = TCP_CLOSE;
+        }
+        *option_len = std::min<socklen_t>(*option_len, sizeof(info));
+        memcpy(option_value, &info, *option_len);
+        return 0;
+    }
+
+    if (level == IPPROTO_TCP && option_name == TCP_CONGESTION) {
+        char name[kTcpCongNameMax] = {};
+        const char *algo;
+        if (sb->tcb != nullptr)
+            algo = tcp_get_congestion(sb->tcb);
+        else
+            algo = sb->opts.congestion.empty() ? tcp_cong_default() : sb->opts.congestion.c_str();
+        strncpy(name, algo, sizeof(name) - 1);
+        *option_len = std::min<socklen_t>(*option_len, sizeof(name));
+        memcpy(option_value, name, *option_len);
+        return 0;
+    }
+
+    if (level == SOL_SOCKET) {
+        int value;
+        if (option_name == SO_ERROR) {
+            // e.g. the result of a non-blocking connect. cleared once read.
+            value = sb->tcb != nullptr ? tcp_get_error(sb->tcb) : 0;
+        } else if (option_name == SO_SNDBUF) {
+            value = sb->opts.sndbuf;
+        } else if (option_name == SO_RCVBUF) {
+            value = sb->opts.rcvbuf;
+        } else if (option_name == SO_TYPE) {
+            value = SOCK_STREAM;
+        } else {
+            logWarning("unimplemented getsockopt: level %d, option %d", level, option_name);
+            errno = ENOPROTOOPT;
+            return -1;
+        }
+        *(int*)option_value = value;
+        *option_len = sizeof(int);
+        return 0;
     }
 
+    logWarning("unimplemented getsockopt: level %d, option %d", level, option_name);
+    errno = ENOPROTOOPT;
+    return -1;
+}
+
+int socket_recv_new_tcp_conn(SocketBlock *sb, TCB* tcb) {
     {
+        std::lock_guard<std::mutex> lock(sb->lock);
+        if (sb->state != SocketBlock::PASSIVE_LISTENING) {
+            logWarning("only a passive-listening socket can accept new connection.");
+            errno = EINVAL;
+            return -1;
+        }
+
         if (sb->accepting.size() >= (size_t)sb->backlog) {
             logWarning("passive socket backlog is full.");
             errno = EINVAL;
             return -1;
         }
-        sb->accepting.push(tcb);
+        sb->accepting.push_back(tcb);
     }
+    sb->cond.notify_all();
+    epoll_notify(sb);
 
     logInfo("a new connection is added to socket %d", sb->fd);
     return 0;
@@ -424,4 +709,33 @@ int socket_recv_new_tcp_conn(SocketBlock *sb, TCB* tcb) {
 
 struct sockaddr_in socket_get_localaddress(SocketBlock * sb) {
     return sb->addr;
-}
\ No newline at end of file
+}
+
+TcpSockOpts socket_get_tcp_opts(SocketBlock *sb) {
+    return sb->opts;
+}
+
+int socket_poll(SocketBlock *sb) {
+    switch (sb->state) {
+        case SocketBlock::ACTIVE:
+            if (sb->tcb == nullptr)
+                return POLLERR | POLLHUP; // fail to open.
+            return tcp_poll(sb->tcb);
+
+        case SocketBlock::PASSIVE_LISTENING: {
+            std::lock_guard<std::mutex> lock(sb->lock);
+            return sb->accepting.empty() ? 0 : POLLIN;
+        }
+
+        case SocketBlock::CLOSED:
+            return POLLNVAL;
+
+        default:
+            // not connected, as Linux reports.
+            return POLLOUT | POLLHUP;
+    }
+}
+
+void socket_tcp_event(SocketBlock *sb) {
+    epoll_notify(sb);
+}
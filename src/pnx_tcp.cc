@@ -1,10 +1,14 @@
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <deque>
 #include <unordered_map>
 #include <unordered_set>
+#include <shared_mutex>
 #include <assert.h>
+#include <cstdlib>
 
 
 #include "ringbuffer.h"
@@ -16,15 +20,19 @@
 #include "logger.h"
 #include "pnx_utils.h"
 #include "gracefully_shutdown.h"
+#include "timer_wheel.h"
 #include "rustex.h"
 
 
-using Seq = TCB::Sender::Sequence;
-
-static std::mutex tcp_lock;
-static BlockingRingBuffer<TCB*, 100> orphaned_tcb;
+// orphans are handed to the recycler when they reach CLOSE. all guarded by recycler_mutex.
+static std::mutex recycler_mutex;
+static std::condition_variable recycler_cond;
+static std::deque<TCB*> closed_orphans;
+static size_t orphan_count = 0; // not freed yet. the recycler waits for all of them on exit.
+static bool tcb_recycler_can_stop = false;
 static std::thread tcb_recycler;
-static std::atomic<bool> tcb_recycler_can_stop{false};
+// shared by the send and receive buffers of all TCBs.
+static MemBudget tcp_mem_budget{kTcpMemLimit};
 
 struct SocketPair {
     struct sockaddr_in local;
@@ -45,62 +53,191 @@ struct SocketPairHash {
     }
 };
 
-// for those TCB owned by a socket.
-static std::unordered_map<SocketPair, TCB*, SocketPairHash> active_tcb_map{};
-static std::unordered_map<SocketPair, TCB*, SocketPairHash> orphaned_tcb_map{};
-static std::unordered_map<uint16_t, SocketBlock*> listening_socket;
+// the connection table, split into shards by the hash of the 4-tuple,
+// so that lookups of independent connections do not contend.
+// lock order: shard lock, then TCB lock. a TCB found in a shard is locked before the shard is unlocked,
+// so the recycler can wait out its last users after taking it off the table.
+struct TcbShard {
+    std::shared_mutex lock;
+    // for those TCB owned by a socket.
+    std::unordered_map<SocketPair, TCB*, SocketPairHash> active_tcb_map;
+    // closed by the user, but still talking to the remote until CLOSE.
+    std::unordered_map<SocketPair, TCB*, SocketPairHash> orphaned_tcb_map;
+};
+static const size_t kTcbShards = 64;
+static TcbShard tcb_shards[kTcbShards];
+
+static TcbShard& _tcp_shard(const SocketPair &pair) {
+    return tcb_shards[SocketPairHash()(pair) % kTcbShards];
+}
+
+// read-mostly. looked up by every SYN.
+static rustex::mutex<std::unordered_map<uint16_t, SocketBlock*>> listening_socket;
 
 static int _tcp_close(TCB *tcb);
+static void _tcp_orphan(TCB *tcb);
+
+// called with the TCB lock held, after anything that may change what the users wait for.
+// wake them up, and hand the TCB to the recycler once it's an orphan and CLOSED.
+static void _tcp_wakeup(TCB *tcb) {
+    tcb->cond.notify_all();
+    if (tcb->owner != nullptr)
+        socket_tcp_event(tcb->owner);
+
+    if (tcb->orphan && tcb->state == TCP_CLOSE && !tcb->recycled) {
+        tcb->recycled = true;
+        {
+            std::lock_guard<std::mutex> lock(recycler_mutex);
+            closed_orphans.push_back(tcb);
+        }
+        recycler_cond.notify_one();
+    }
+}
 
 class PnxTcpInitailizer {
 public:
     static void initialize() {
+        char *env_mem = getenv("PNX_TCP_MEM_LIMIT");
+        if (env_mem != nullptr) {
+            tcp_mem_budget.limit = strtoull(env_mem, nullptr, 10);
+            logInfo("tcp memory limit: %zu bytes", tcp_mem_budget.limit.load());
+        }
+
         tcb_recycler = std::thread{[&]() {
-            while (tcb_recycler_can_stop.load() == false || orphaned_tcb.size() > 0) {
-                auto task = orphaned_tcb.pop();
-                if (!task.has_value()) continue;
-                auto tcb = task.value();
-                if (tcb->state == TCP_CLOSE) {
-                    // stop the timer. （if it's not stopped yet)
-                    tcb->timer_stop.store(true);
-                    tcb->timer.join();
-
-
-                    // remove from orphaned_tcb_map
-                    std::unique_lock<std::mutex> lock(tcp_lock);
-                    orphaned_tcb_map.erase({tcb->local, tcb->remote});
-                    lock.unlock();
-
-                    logInfo("tcb_recycler: delete tcb %x", tcb);
-                    delete tcb;
-                } else {
-                    // put it back. simply busy waiting.
-                    orphaned_tcb.push(tcb);
+            std::unique_lock<std::mutex> lock(recycler_mutex);
+            while (true) {
+                recycler_cond.wait(lock, []() { 
+                    return !closed_orphans.empty() || (tcb_recycler_can_stop && orphan_count == 0);
+                });
+                if (closed_orphans.empty())
+                    break;
+                TCB *tcb = closed_orphans.front();
+                closed_orphans.pop_front();
+                lock.unlock();
+
+                // remove from the table, so that no one can find it any more.
+                // a self-orphaned passive TCB is still in the active map.
+                SocketPair pair{tcb->local, tcb->remote};
+                TcbShard &shard = _tcp_shard(pair);
+                {
+                    std::unique_lock<std::shared_mutex> shard_lock(shard.lock);
+                    shard.orphaned_tcb_map.erase(pair);
+                    auto it = shard.active_tcb_map.find(pair);
+                    if (it != shard.active_tcb_map.end() && it->second == tcb)
+                        shard.active_tcb_map.erase(it);
                 }
+
+                // wait for whoever found it before.
+                { std::lock_guard<std::mutex> tcb_lock(tcb->lock); }
+
+                // stop the timer. （if it's not stopped yet)
+                // dont hold the TCB lock here, the callback may be waiting for it.
+                timer_cancel_sync(&tcb->timer);
+                timer_cancel_sync(&tcb->pace_timer);
+
+                logInfo("tcb_recycler: delete tcb %x", tcb);
+                delete tcb;
+
+                lock.lock();
+                orphan_count--;
             }
         }};
         
         add_exit_clean_up([&]() {
-            std::unique_lock<std::mutex> lock(tcp_lock);
-
             // close all active connections.
-            for (auto& pair : active_tcb_map) {
-                TCB* tcb = pair.second;
-                logInfo("tcb_recycler: close tcb %x", tcb);
-                _tcp_close(tcb);
+            // hold the shard, so that the recycler can not free the self-orphaned ones under us.
+            for (auto& shard : tcb_shards) {
+                std::unique_lock<std::shared_mutex> lock(shard.lock);
+                for (auto& pair : shard.active_tcb_map) {
+                    TCB *tcb = pair.second;
+                    logInfo("tcb_recycler: close tcb %x", tcb);
+                    std::lock_guard<std::mutex> tcb_lock(tcb->lock);
+                    _tcp_close(tcb);
+                    _tcp_wakeup(tcb);
+                    shard.orphaned_tcb_map[pair.first] = tcb;
+                }
+                shard.active_tcb_map.clear();
             }
-            lock.unlock();
-            // orphaned_tcbs close has been sent.
+            // orphaned_tcbs close has been sent. wait for all of them to be CLOSED.
 
-            tcb_recycler_can_stop.store(true);
+            {
+                std::lock_guard<std::mutex> lock(recycler_mutex);
+                tcb_recycler_can_stop = true;
+            }
+            recycler_cond.notify_all();
             tcb_recycler.join();
 
-        }, EXIT_CLEAN_UP_PRIORITY_TCP_RECVING);
+        }, EXIT_CLEAN_UP_PRIORITY_TCP_CLOSING);
     }
 };
 
-// every TCB has a timer thread for simplicity.
+static int _tcp_send_segment(TCB* tcb, size_t max_payload);
+static int _tcp_send_segment_at(TCB* tcb, uint32_t seq, size_t max_payload);
+static int _tcp_send_pure_ACK(TCB *tcb, uint32_t seq);
+static int _tcp_send_reset(TCB *tcb);
+static int _tcp_output(TCB *tcb, bool force_ack);
+
+// the payload of a full segment, options aside.
+static inline uint32_t _tcp_mss(TCB *tcb) {
+    return tcb->send.mss;
+}
+
+// the largest payload of a segment in an IP packet of `mtu` bytes.
+static uint32_t _tcp_mtu_to_mss(size_t mtu) {
+    if (mtu < kTcpDefaultMss + sizeof(iphdr) + sizeof(tcphdr)) {
+        // no route yet. every IPv4 host takes 576 bytes anyway.
+        return kTcpDefaultMss;
+    }
+    return mtu - sizeof(iphdr) - sizeof(tcphdr);
+}
+
+// what the SYN of the remote allows in a segment.
+static uint32_t _tcp_remote_mss(const TcpOptions &opts) {
+    return opts.mss == 0 ? kTcpDefaultMss : std::max<uint32_t>(opts.mss, kTcpMinMss);
+}
+
+// the MSS is what the remote allows, and the route carries.
+static void _tcp_update_mss(TCB *tcb, uint32_t route_mss) {
+    uint32_t mss = std::min(tcb->send.remote_mss, route_mss);
+    if (mss == tcb->send.mss)
+        return;
+    logDebug("tcp_update_mss: %u -> %u", tcb->send.mss, mss);
+    tcb->send.mss = mss;
+    if (tcb->send.cc)
+        tcb->send.cc->set_mss(mss);
+}
+
+// the current retransmission timeout, with the backoff of the timeouts in a row.
+static size_t _tcp_rto(TCB *tcb) {
+    int shift = std::min(tcb->send.retrans_count, 30);
+    return std::min<size_t>((size_t)tcb->send.rto << shift, kTcpMaxRTO);
+}
+
+// the same for the persist timer, with the zero window probes in a row.
+static size_t _tcp_persist_timeout(TCB *tcb) {
+    int shift = std::min(tcb->send.probe_count, 30);
+    return std::min<size_t>((size_t)tcb->send.rto << shift, kTcpMaxRTO);
+}
+
+// update the RTO with a new RTT sample, see RFC 6298 2.2 and 2.3.
+static void _tcp_rtt_sample(TCB *tcb, uint32_t rtt) {
+    auto &s = tcb->send;
+    if (s.srtt == 0) {
+        s.srtt = std::max(rtt, 1u);
+        s.rttvar = rtt / 2;
+    } else {
+        uint32_t delta = s.srtt > rtt ? s.srtt - rtt : rtt - s.srtt;
+        s.rttvar = (3 * (uint64_t)s.rttvar + delta) / 4;
+        s.srtt = std::max<uint32_t>((7 * (uint64_t)s.srtt + rtt) / 8, 1);
+    }
+    size_t rto = s.srtt + std::max<size_t>(kTcpClockGranularity, 4 * (size_t)s.rttvar);
+    s.rto = std::max(kTcpMinRTO, std::min(rto, kTcpMaxRTO));
+    logTrace("rtt sample %u us: srtt=%u, rttvar=%u, rto=%u", rtt, s.srtt, s.rttvar, s.rto);
+}
+
+// every TCB has a timer on the shared timer wheel, armed only when there is something to wait for.
 // check last segment timeout and launch retransmission.
+// called with the TCB lock held.
 static int _tcp_timer(TCB *tcb) {
     if (tcb->state == TCP_CLOSE) {
         // we do not need to do anything when the TCB is closed.
@@ -108,45 +245,90 @@ static int _tcp_timer(TCB *tcb) {
     }
 
     if (tcb->state == TCP_TIME_WAIT) {
-        // wait 2MSL and close the connection.
-        if (get_time_us() - tcb->send.last_sent_time >= 2 * kTcpMSL) {
-            logDebug("state trans: TCP_TIME_WAIT -> TCP_CLOSE");
-            tcb->state = TCP_CLOSE;
-        }
+        // the timer was armed for 2MSL when entering TIME_WAIT.
+        logDebug("state trans: TCP_TIME_WAIT -> TCP_CLOSE");
+        tcb->state = TCP_CLOSE;
         return 0;
     }
 
-    // check if the last segment is timeout.
-    if (tcb->send.waiting_for_ack()) {
-        if (get_time_us() - tcb->send.last_sent_time >= kTcpTimeout) {
-
-            if (tcb->send.retrans_count >= kTcpMaxRetrans) {
-                // close the connection.
-                logDebug("state trans: %d -> TCP_CLOSE", tcb->state);
-                tcb->state = TCP_CLOSE;
-                return 0;
-            }
+    if (tcb->send.in_flight() == 0 && tcb->send.have_unsent() && tcb->send.remote_recv_window == 0) {
+        // the remote closed its window. probe it until it opens again.
+        // the probe carries an old seq, so the remote always answers with its current window.
+        logDebug("tcp_timer: zero window probe %d", tcb->send.probe_count);
+        tcb->send.probe_count++;
+        timer_schedule(&tcb->timer, _tcp_persist_timeout(tcb));
+        return _tcp_send_pure_ACK(tcb, tcb->send.unack - 1);
+    }
 
-            logWarning("tcp_timer: retransmission timeout, retransmit the last segment");
+    // check if the oldest segment is timeout.
+    if (tcb->send.waiting_for_ack()) {
+        size_t elapsed = get_time_us() - tcb->send.last_sent_time;
+        size_t rto = _tcp_rto(tcb);
+        if (elapsed < rto) {
+            // the remote acked something after the timer was armed.
+            timer_schedule(&tcb->timer, rto - elapsed);
+            return 0;
+        }
 
-            // update the last segment info.
-            tcb->send.last_seg.hdr->ack_seq = htonl(tcb->recv.next);
-            // tcb->send.last_seg.hdr->window = htons((uint16_t)tcb->recv.buf.rest_capacity());
-            tcb->send.last_seg.fill_in_tcp_checksum();
+        int max_retrans = tcb->send.syn ? kTcpSynRetries : kTcpMaxRetrans;
+        if (tcb->send.retrans_count >= max_retrans) {
+            // close the connection.
+            // a passive one which never got established has no user to close it.
+            bool unowned = tcb->state == TCP_SYN_RECV;
+            logDebug("state trans: %d -> TCP_CLOSE", tcb->state);
+            tcb->state = TCP_CLOSE;
+            tcb->error = ETIMEDOUT;
+            if (unowned)
+                _tcp_close(tcb);
+            return 0;
+        }
 
-            // retransmit the last segment.
-            tcb->send.last_sent_time = get_time_us();
-            tcb->send.retrans_count++;
-            if (ip_send_packet(tcb->send.last_seg.src, tcb->send.last_seg.dst, IPPROTO_TCP, tcb->send.last_seg.buf, tcb->send.last_seg.len) != 0) {
-                logWarning("tcp_timer: fail to retransmit the last segment");
-                return -1;
-            }
+        logWarning("tcp_timer: retransmission timeout, go back to seq %u", tcb->send.unack);
+
+        // everything in flight is considered lost. go back to unack and resend the oldest segment only.
+        // the ack of it tells how much the remote really has, and the rest is resent from the buffer then.
+        // the window shrinks on the first timeout only. the later ones find nothing more in flight.
+        if (tcb->send.retrans_count == 0)
+            tcb->send.cc->on_rto(tcb->send.in_flight(), get_time_us());
+        tcb->send.in_recovery = false;
+        tcb->send.recovery_inflation = 0;
+        tcb->send.dupacks = 0;
+        tcb->send.recover = tcb->send.max_sent;
+        // the sacked data is not resent. but a remote which times out again may have dropped
+        // it (reneging, RFC 2018 8), so forget it then.
+        if (tcb->send.retrans_count > 0)
+            tcb->send.sacked.clear();
+        tcb->send.retrans_count++;
+        tcb->send.total_retrans++;
+        // whatever is acked next may be of the retransmission, so it's no RTT sample.
+        tcb->send.rtt_timing = false;
+        tcb->send.next = tcb->send.unack;
+        if (_tcp_send_segment(tcb, _tcp_mss(tcb)) < 0) {
+            logWarning("tcp_timer: fail to retransmit");
+            return -1;
         }
+        tcb->send.last_sent_time = get_time_us();
+        timer_schedule(&tcb->timer, _tcp_rto(tcb));
     }
     return 0;
 }
 
-static int _init_TCB(TCB* tcb, const sockaddr_in *local, const sockaddr_in *remote, std::shared_ptr<Segment> syn) {
+// (re)start the congestion control with the algorithm `name`, or the default one if it's empty.
+static void _tcp_set_congestion(TCB *tcb, const std::string &name) {
+    const char *algo = name.empty() ? tcp_cong_default() : name.c_str();
+    if (tcb->send.cc != nullptr && strcmp(algo, tcb->send.cc->name()) == 0)
+        return;
+    TcpCongestion *cc = tcp_cong_create(algo, _tcp_mss(tcb));
+    if (cc == nullptr) {
+        // checked by setsockopt already.
+        logWarning("unknown tcp congestion control %s", algo);
+        cc = tcp_cong_create(tcp_cong_default(), _tcp_mss(tcb));
+    }
+    tcb->send.cc.reset(cc);
+}
+
+static int _init_TCB(TCB* tcb, const sockaddr_in *local, const sockaddr_in *remote, const Segment *syn, 
+    const TcpSockOpts &opts) {
     // treat this as the start point of the TCP module.
     static bool init_done = false;
     static std::mutex mutex;
@@ -167,19 +349,42 @@ static int _init_TCB(TCB* tcb, const sockaddr_in *local, const sockaddr_in *remo
 
         { // init the sender part.
             tcb->send.init_seq = rand() % 10000;
-            // tcb->send.remote_recv_window = 0;
+            // learnt from the SYNACK. the SYN itself is not limited by the window.
+            tcb->send.remote_recv_window = 0;
+            tcb->send.wl1 = tcb->send.wl2 = 0;
+            // until the SYNACK tells, as much as the route carries.
+            tcb->send.mss = tcb->send.remote_mss = _tcp_mtu_to_mss(ip_route_mtu(remote->sin_addr));
             tcb->send.next = tcb->send.init_seq;
             tcb->send.unack = tcb->send.init_seq;
+            tcb->send.max_sent = tcb->send.init_seq;
+            tcb->send.syn = tcb->send.fin = false;
             tcb->send.retrans_count = 0;
+            tcb->send.total_retrans = 0;
+            tcb->send.probe_count = 0;
             tcb->send.last_sent_time = 0;
+            tcb->send.srtt = tcb->send.rttvar = 0;
+            tcb->send.rto = kTcpInitRTO;
+            tcb->send.rtt_timing = false;
+            tcb->send.pace_next = 0;
+            tcb->send.dupacks = 0;
+            tcb->send.in_recovery = false;
+            tcb->send.recover = tcb->send.init_seq;
+            tcb->send.recovery_inflation = 0;
+            tcb->send.retrans_next = tcb->send.init_seq;
+            tcb->send.retrans_sacked = 0;
         }
 
         { // init the receiver part.
             // we dont know the receiver part for an active open.
             tcb->recv.init_seq = 0;
             tcb->recv.next = 0;
-            // tcb->recv.window = kTcpRecvBufferSize;
+            tcb->recv.window = 0;
+            tcb->recv.mss = tcb->send.mss;
+            tcb->recv.sack_recent = 0;
         }
+
+        // offered on the SYN, and agreed if the SYNACK offers it as well.
+        tcb->sack_ok = false;
     } else {
         assert(syn->hdr->syn == 1);
 
@@ -187,54 +392,162 @@ static int _init_TCB(TCB* tcb, const sockaddr_in *local, const sockaddr_in *remo
         tcb->passive = true;
         tcb->local = *local;
         tcb->remote = *remote;
+        // a malformed option list is taken as none.
+        TcpOptions syn_opts;
+        if (!syn->parse_options(&syn_opts))
+            syn_opts = TcpOptions();
+        uint32_t route_mss = _tcp_mtu_to_mss(ip_route_mtu(remote->sin_addr));
 
         { // init the sender part.
             tcb->send.init_seq = rand() % 10000;
-            // tcb->send.remote_recv_window = syn->hdr->window;
+            tcb->send.remote_recv_window = syn->hdr->window;
+            tcb->send.wl1 = syn->hdr->seq;
+            tcb->send.wl2 = tcb->send.init_seq;
+            tcb->send.remote_mss = _tcp_remote_mss(syn_opts);
+            tcb->send.mss = std::min(tcb->send.remote_mss, route_mss);
             tcb->send.next = tcb->send.init_seq;
             tcb->send.unack = tcb->send.init_seq;
+            tcb->send.max_sent = tcb->send.init_seq;
+            tcb->send.syn = tcb->send.fin = false;
             tcb->send.retrans_count = 0;
+            tcb->send.total_retrans = 0;
+            tcb->send.probe_count = 0;
             tcb->send.last_sent_time = 0;
+            tcb->send.srtt = tcb->send.rttvar = 0;
+            tcb->send.rto = kTcpInitRTO;
+            tcb->send.rtt_timing = false;
+            tcb->send.pace_next = 0;
+            tcb->send.dupacks = 0;
+            tcb->send.in_recovery = false;
+            tcb->send.recover = tcb->send.init_seq;
+            tcb->send.recovery_inflation = 0;
+            tcb->send.retrans_next = tcb->send.init_seq;
+            tcb->send.retrans_sacked = 0;
         }
 
         { // init the receiver part.
             tcb->recv.init_seq = syn->hdr->seq;
             tcb->recv.next = syn->hdr->seq + 1; // init_recv_seq used by SYN
-            // tcb->recv.window = kTcpRecvBufferSize;
+            tcb->recv.window = 0;
+            tcb->recv.mss = route_mss;
+            tcb->recv.sack_recent = tcb->recv.next;
         }
-    }
 
-    tcb->timer = std::thread{[tcb]() {
-        while (tcb->timer_stop.load() == false) {
-            // sleep 10 ms
-            std::this_thread::sleep_for(std::chrono::milliseconds(10)); 
-            
-            std::lock_guard<std::mutex> lock(tcp_lock);
-            if (tcb->state == TCP_CLOSE) {
-                break;
-            }
+        // offered back on the SYNACK if the SYN offers it.
+        tcb->sack_ok = syn_opts.sack_permitted;
+    }
 
-            if (_tcp_timer(tcb) != 0) {
-                logWarning("tcp_timer: error happens");
-            }
+    tcb->listener = nullptr;
+    tcb->owner = nullptr;
+    tcb->error = 0;
+    tcb->orphan = false;
+    tcb->recycled = false;
+
+    // nothing is allocated until the data comes.
+    tcb->send.buf.set_budget(&tcp_mem_budget);
+    tcb->recv.buf.set_budget(&tcp_mem_budget);
+    tcb->send.buf.set_limit(opts.sndbuf);
+    tcb->recv.buf.set_limit(opts.rcvbuf);
+    _tcp_set_congestion(tcb, opts.congestion);
+
+    // nothing is armed yet. the first segment sent will do it.
+    tcb->timer.callback = [tcb]() {
+        std::lock_guard<std::mutex> lock(tcb->lock);
+        if (_tcp_timer(tcb) != 0) {
+            logWarning("tcp_timer: error happens");
         }
-    }};
-
-    // make sure it's joinable
-    assert(tcb->timer.joinable());
+        _tcp_wakeup(tcb);
+    };
+    tcb->pace_timer.callback = [tcb]() {
+        std::lock_guard<std::mutex> lock(tcb->lock);
+        if (tcb->state != TCP_CLOSE && _tcp_output(tcb, false) != 0) {
+            logWarning("tcp_pace_timer: fail to send segments");
+        }
+    };
 
     return 0;
 }
 
-static int _tcp_send_pure_ACK(TCB *tcb) {
+static void _tcp_enter_time_wait(TCB *tcb) {
+    logDebug("state trans: %d -> TCP_TIME_WAIT", tcb->state);
+    tcb->state = TCP_TIME_WAIT;
+    // wait 2MSL and close the connection. this replaces any pending retransmission.
+    timer_schedule(&tcb->timer, 2 * kTcpMSL);
+}
+
+// the remote may still send data in these states.
+static inline bool _tcp_can_recv_data(int state) {
+    return state == TCP_ESTABLISHED || state == TCP_FIN_WAIT1 || state == TCP_FIN_WAIT2;
+}
+
+// the window we advertise. there is no window scaling, so it's capped by the 16-bit field.
+// it shrinks when the memory budget runs short, so the remote does not send what we must drop.
+// every outgoing segment carries it, so remember it as the last advertised one.
+static uint16_t _tcp_recv_window(TCB *tcb) {
+    tcb->recv.window = (uint16_t)std::min<size_t>(tcb->recv.buf.room(), UINT16_MAX);
+    return tcb->recv.window;
+}
+
+// hand a segment of the connection to IP, through its cached route when there is one.
+static int _tcp_ip_output(TCB *tcb, Segment *seg) {
+    if (!ip_dst_valid(tcb->dst.get())) {
+        tcb->dst = ip_dst_lookup(seg->dst);
+        // the route may have changed. the next segments follow it.
+        if (tcb->dst != nullptr)
+            _tcp_update_mss(tcb, _tcp_mtu_to_mss(tcb->dst->mtu));
+    }
+    if (tcb->dst == nullptr) {
+        // no route, or the neighbour is not resolved yet.
+        return ip_send_packet(seg->src, seg->dst, IPPROTO_TCP, std::move(seg->pkt));
+    }
+    return ip_send_packet_dst(seg->src, tcb->dst.get(), IPPROTO_TCP, std::move(seg->pkt));
+}
+
+// the options of an outgoing segment: the MSS and SACK-permitted on a SYN, and the SACK blocks
+// of the out-of-order queue on the others. return their length.
+static size_t _tcp_options(TCB *tcb, bool syn, uint8_t *opts) {
+    if (syn) {
+        uint16_t mss = htons(std::min<uint32_t>(tcb->recv.mss, UINT16_MAX));
+        opts[0] = kTcpOptMss;
+        opts[1] = 4;
+        memcpy(opts + 2, &mss, sizeof(mss));
+        if (tcb->state != TCP_SYN_SENT && !tcb->sack_ok)
+            return 4;
+        const uint8_t sack_permitted[] = {kTcpOptNop, kTcpOptNop, kTcpOptSackPermitted, 2};
+        memcpy(opts + 4, sack_permitted, sizeof(sack_permitted));
+        return 4 + sizeof(sack_permitted);
+    }
+
+    if (!tcb->sack_ok || tcb->recv.ooo.empty())
+        return 0;
+    TcpSackBlock blocks[kTcpMaxSackBlocks];
+    size_t n = tcb->recv.ooo.sack_blocks(tcb->recv.next, tcb->recv.sack_recent, blocks, kTcpMaxSackBlocks);
+    if (n == 0)
+        return 0;
+    opts[0] = opts[1] = kTcpOptNop;
+    opts[2] = kTcpOptSack;
+    opts[3] = 2 + n * 8;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t edges[2] = {htonl(blocks[i].start), htonl(blocks[i].end)};
+        memcpy(opts + 4 + i * 8, edges, sizeof(edges));
+    }
+    return 4 + n * 8;
+}
+
+static int _tcp_send_pure_ACK(TCB *tcb, uint32_t seq) {
     Segment ack{sizeof(struct tcphdr)};
     ack.hdr->source = tcb->local.sin_port;
     ack.hdr->dest = tcb->remote.sin_port;
-    ack.hdr->seq = tcb->send.next;
+    ack.hdr->seq = seq;
     ack.hdr->ack_seq = tcb->recv.next;
     ack.hdr->ack = 1;
     ack.hdr->doff = sizeof(struct tcphdr) / 4;
-    ack.hdr->window = tcb->recv.buf.rest_capacity();
+    ack.hdr->window = _tcp_recv_window(tcb);
+
+    uint8_t opts[kTcpMaxOptionLen];
+    size_t opts_len = _tcp_options(tcb, false, opts);
+    if (opts_len > 0)
+        ack.add_options(opts, opts_len);
 
     ack.ntoh(); // reverse some fields
 
@@ -245,7 +558,7 @@ static int _tcp_send_pure_ACK(TCB *tcb) {
 
     logTrace("a pure ACK is sent");
 
-    if (ip_send_packet(ack.src, ack.dst, IPPROTO_TCP, ack.buf, ack.len) != 0) { 
+    if (_tcp_ip_output(tcb, &ack) != 0) { 
         logWarning("fail to send a pure ACK");
         return -1;
     }
@@ -253,94 +566,435 @@ static int _tcp_send_pure_ACK(TCB *tcb) {
     return 0;
 }
 
-static int _tcp_send_segment(TCB* tcb) {
-    // construct a segment from tcb->send.buf.
+// abort the connection. the remote learns it by a RST, and nothing is sent or taken any more.
+static int _tcp_send_reset(TCB *tcb) {
+    Segment rst{sizeof(struct tcphdr)};
+    rst.hdr->source = tcb->local.sin_port;
+    rst.hdr->dest = tcb->remote.sin_port;
+    rst.hdr->seq = tcb->send.max_sent;
+    rst.hdr->ack_seq = tcb->recv.next;
+    rst.hdr->ack = 1;
+    rst.hdr->rst = 1;
+    rst.hdr->doff = sizeof(struct tcphdr) / 4;
+    rst.hdr->window = 0;
+
+    rst.ntoh();
+    rst.src = tcb->local.sin_addr;
+    rst.dst = tcb->remote.sin_addr;
+    rst.fill_in_tcp_checksum();
+
+    logDebug("state trans: %d -> TCP_CLOSE, reset", tcb->state);
+    tcb->state = TCP_CLOSE;
+    if (_tcp_ip_output(tcb, &rst) != 0) {
+        logWarning("fail to send a RST");
+        return -1;
+    }
+    return 0;
+}
 
-    // when the buffer is empty, send a pure ACK, which does not require retransmission.
-    // otherwise, send the first kTcpMaxSession bytes (at most), until a control seq.
-    // if the first is a control signal, send it solely.
+static int _tcp_send_segment_at(TCB* tcb, uint32_t seq, size_t max_payload) {
+    // construct a segment from tcb->send.buf, starting at `seq`, between unack and send.next
+    // for a retransmission. send.next is left to the caller.
 
-    if (tcb->send.waiting_for_ack() || tcb->send.buf.empty()) {
-        // send a pure ACK.
-        return _tcp_send_pure_ACK(tcb);
-    }
+    // send the first max_payload bytes (at most), and piggyback the FIN if they are the last ones.
+    // the SYN is always sent solely.
+    // return the sequence space consumed.
 
+    uint32_t offset = seq - tcb->send.unack;
+    assert(offset < tcb->send.seq_size());
 
     size_t payload_len = 0;
+    bool syn = false, fin = false;
 
-    char segment[kTcpMaxSegmentSize];
-    struct tcphdr *hdr = (struct tcphdr*)segment;
-    memset(hdr, 0, sizeof(struct tcphdr));
+    // the payload is copied straight from the send buffer into the packet buffer.
+    Segment seg{sizeof(struct tcphdr)};
+    seg.src = tcb->local.sin_addr;
+    seg.dst = tcb->remote.sin_addr;
+    struct tcphdr *hdr = seg.hdr;
     hdr->source = tcb->local.sin_port;
     hdr->dest = tcb->remote.sin_port;
-    hdr->seq = tcb->send.next;
+    hdr->seq = seq;
     hdr->ack_seq = tcb->recv.next;
     hdr->doff = sizeof(struct tcphdr) / 4;
 
     // if a initial SYN is sent, then the ack bit is 0.
     // Otherwise we always send a ACK.
     hdr->ack = tcb->state == TCP_SYN_SENT ? 0 : 1;
-    hdr->window = tcb->recv.buf.rest_capacity();
-    
-    if (tcb->send.buf.peek().value().isCtrl()) {
-        payload_len = 0;
-        hdr->fin = tcb->send.buf.peek().value().fin;
-        hdr->syn = tcb->send.buf.peek().value().syn;
-        tcb->send.buf.pop();
-    } else {
-        // get kTcpMaxSession bytes from the buffer, or until a control seq.
-        while (payload_len + sizeof(tcphdr) < kTcpMaxSegmentSize && !tcb->send.buf.empty() 
-            // && (int64_t) payload_len < (int64_t) tcb->send.remote_recv_window - (tcb->send.next - tcb->send.unack)
-            ) {
-            Seq seq = tcb->send.buf.peek().value();
-            if (seq.isCtrl()) break;
-            segment[sizeof(tcphdr) + payload_len] = tcb->send.buf.pop()->byte;
-            ++payload_len;
-        }
+    hdr->window = _tcp_recv_window(tcb);
+
+    syn = tcb->send.syn && offset == 0;
+    uint8_t opts[kTcpMaxOptionLen];
+    size_t opts_len = _tcp_options(tcb, syn, opts);
+    if (opts_len > 0)
+        seg.add_options(opts, opts_len);
+
+    if (!syn) {
+        // copy max_payload bytes from the buffer at most. the options take room from the payload,
+        // and what the remote has sacked is not sent again.
+        size_t data_offset = offset - tcb->send.syn;
+        max_payload = std::min({max_payload, _tcp_mss(tcb) + sizeof(tcphdr) - seg.hlen, seg.tailroom()});
+        max_payload = tcb->send.sacked.next_sacked(seq, seq + max_payload) - seq;
+        payload_len = tcb->send.buf.peek(data_offset, seg.tail(), max_payload);
+        seg.append(payload_len);
+        fin = tcb->send.fin && data_offset + payload_len == tcb->send.buf.size();
     }
-    
-    Segment seg{segment, sizeof(struct tcphdr) + payload_len, tcb->local.sin_addr, tcb->remote.sin_addr};
+    hdr->syn = syn;
+    hdr->fin = fin;
+
     seg.ntoh();
     seg.fill_in_tcp_checksum();
 
     // tcb state update
-    tcb->send.retrans_count = 0;
-    tcb->send.last_sent_time = get_time_us();
-    tcb->send.next += payload_len + seg.hdr->fin + seg.hdr->syn;
-    tcb->send.last_seg = seg;
+    uint32_t seq_len = payload_len + fin + syn;
+    if (tcb->send.waiting_for_ack() == false || seq == tcb->send.unack) {
+        // nothing was outstanding, or the oldest segment is resent. (re)start the retransmission
+        // timer, so that the resent one gets a whole RTO to be acked.
+        tcb->send.last_sent_time = get_time_us();
+    }
+    if (seq_len > 0 && seq == tcb->send.max_sent && !tcb->send.rtt_timing) {
+        // new data, never sent before. time it.
+        tcb->send.rtt_timing = true;
+        tcb->send.rtt_seq = seq + seq_len;
+        tcb->send.rtt_start = get_time_us();
+    }
+    tcb->send.max_sent = seq_max(tcb->send.max_sent, seq + seq_len);
+    uint64_t rate = tcb->send.cc->pacing_rate();
+    if (rate > 0 && payload_len > 0) {
+        // a tick late is not a reason to send slower, but an idle connection gets no credit.
+        size_t now = get_time_us();
+        tcb->send.pace_next = std::max(tcb->send.pace_next, now - std::min(now, kTcpClockGranularity))
+            + seq_len * 1000000 / rate;
+    }
 
-    logTrace("a segment is sent. payload_len=%llu, fin=%d, syn=%d", payload_len, seg.hdr->fin, seg.hdr->syn);
+    logTrace("a segment is sent. seq=%u, payload_len=%zu, fin=%d, syn=%d", 
+        ntohl(seg.hdr->seq), payload_len, fin, syn);
 
-    if (ip_send_packet(seg.src, seg.dst, IPPROTO_TCP, seg.buf, seg.len) != 0) {
+    // a segment that can not go out, e.g. dropped by a full device queue, is taken as lost
+    // on the wire. it's in the sequence space already, so the retransmission timer covers it.
+    if (_tcp_ip_output(tcb, &seg) != 0) {
         logWarning("fail to send a segment");
-        return -1;
     }
 
-    return 0;
+    return seq_len;
 }
 
-static int _tcp_make_sure_sendback(TCB *tcb) {
-    // make sure there will be an event to send any update of tcb to the remote.
-    if (tcb->send.waiting_for_ack() == false) {
-        if (_tcp_send_segment(tcb) != 0) {
-            logWarning("_tcp_makesure_sendback: fail to send segments");
+// send the segment at send.next.
+static int _tcp_send_segment(TCB* tcb, size_t max_payload) {
+    int seq_len = _tcp_send_segment_at(tcb, tcb->send.next, max_payload);
+    tcb->send.next += seq_len;
+    return seq_len;
+}
+
+// whether the pacing rate lets the next segment go now. if not, the pace timer sends it later.
+static bool _tcp_pace(TCB *tcb) {
+    if (tcb->send.cc->pacing_rate() == 0)
+        return true;
+    size_t now = get_time_us();
+    if (tcb->send.pace_next <= now)
+        return true;
+    if (!tcb->pace_timer.pending())
+        timer_schedule(&tcb->pace_timer, tcb->send.pace_next - now);
+    return false;
+}
+
+// in SACK recovery, the next hole below the highest sacked seq which is not resent yet.
+// return false if there is none.
+static bool _tcp_next_lost(TCB *tcb, uint32_t *seq, uint32_t *len) {
+    auto &s = tcb->send;
+    if (!s.in_recovery || s.sacked.empty())
+        return false;
+    uint32_t highest = s.sacked.highest();
+    uint32_t hole = s.sacked.next_unsacked(seq_max(s.retrans_next, s.unack));
+    if (seq_geq(hole, highest))
+        return false;
+    *seq = hole;
+    *len = s.sacked.next_sacked(hole, highest) - hole;
+    return true;
+}
+
+// what the sender takes as still in the network, see RFC 6675 SetPipe(): in flight, but neither
+// sacked nor, in recovery, lost and waiting to be resent. without SACK, simply in flight.
+static uint32_t _tcp_pipe(TCB *tcb) {
+    auto &s = tcb->send;
+    if (s.sacked.empty())
+        return s.in_flight();
+    uint32_t pipe = s.in_flight() - s.sacked.bytes_below(s.next);
+    if (s.in_recovery) {
+        uint32_t from = seq_max(s.retrans_next, s.unack);
+        uint32_t to = s.sacked.highest();
+        if (seq_lt(from, to)) {
+            uint32_t lost = (to - from) - (s.sacked.bytes_below(to) - s.sacked.bytes_below(from));
+            pipe -= std::min(pipe, lost);
+        }
+    }
+    return pipe;
+}
+
+// send as much as the remote window and the congestion window allow: the lost holes first in
+// SACK recovery, then from send.next.
+// if nothing can be sent and `force_ack` is set, send a pure ACK instead,
+// so that the remote always learns our progress.
+static int _tcp_output(TCB *tcb, bool force_ack) {
+    int sent = 0;
+    for (;;) {
+        // after a timeout, what the remote has sacked is skipped.
+        tcb->send.next = tcb->send.sacked.next_unsacked(tcb->send.next);
+        uint32_t lost_seq = 0, lost_len = 0;
+        bool retransmit = _tcp_next_lost(tcb, &lost_seq, &lost_len);
+        if (!retransmit && !tcb->send.have_unsent())
+            break;
+
+        uint32_t in_flight = tcb->send.in_flight();
+        size_t max_payload = 0;
+
+        // control bits are never blocked by the window, so a lone SYN or FIN always goes.
+        bool ctrl_only = !retransmit && 
+            ((tcb->send.syn && in_flight == 0) || in_flight - tcb->send.syn == tcb->send.buf.size());
+        if (!ctrl_only) {
+            uint32_t pipe = _tcp_pipe(tcb);
+            uint32_t cwnd = tcb->send.cc->cwnd() + tcb->send.recovery_inflation;
+            if (pipe >= cwnd || (!retransmit && in_flight >= tcb->send.remote_recv_window)) {
+                // the window is full.
+                break;
+            }
+            if (retransmit) {
+                // a hole is resent whole, up to a segment, once the window has room for it.
+                lost_len = std::min(lost_len, _tcp_mss(tcb));
+                if (cwnd - pipe < lost_len || !_tcp_pace(tcb))
+                    break;
+                tcb->send.total_retrans++;
+                tcb->send.rtt_timing = false;
+                tcb->send.retrans_next = lost_seq + _tcp_send_segment_at(tcb, lost_seq, lost_len);
+                sent++;
+                continue;
+            }
+            max_payload = std::min(cwnd - pipe, tcb->send.remote_recv_window - in_flight);
+
+            // avoid the silly window syndrome: do not chop the data into tiny segments
+            // while an ack of the in-flight ones will open the window further.
+            size_t unsent = tcb->send.seq_size() - in_flight;
+            size_t full = _tcp_mss(tcb);
+            if (in_flight > 0 && max_payload < full && max_payload < unsent)
+                break;
+            if (!_tcp_pace(tcb))
+                break;
+        }
+
+        if (_tcp_send_segment(tcb, max_payload) < 0) {
             return -1;
         }
+        sent++;
     }
+
+    // waiting for an ack, or for the window to open.
+    if ((tcb->send.waiting_for_ack() || tcb->send.have_unsent()) && !tcb->timer.pending())
+        timer_schedule(&tcb->timer, _tcp_rto(tcb));
+
+    if (sent == 0 && force_ack)
+        return _tcp_send_pure_ACK(tcb, tcb->send.next);
     return 0;
 }
 
-static int _tcp_send_ctrl(TCB* tcb, Seq ctrl) {
-    if (tcb->send.buf.push(ctrl) == 0) {
-        logWarning("fail to send syn due to full buffer");
+static int _tcp_make_sure_sendback(TCB *tcb) {
+    // make sure there will be an event to send any update of tcb to the remote.
+    if (_tcp_output(tcb, true) != 0) {
+        logWarning("_tcp_makesure_sendback: fail to send segments");
         return -1;
     }
+    return 0;
+}
+
+static int _tcp_send_syn(TCB* tcb) {
+    tcb->send.syn = true;
     return _tcp_make_sure_sendback(tcb);
 }
 
-static TCB* _tcp_open(const sockaddr_in* local, const sockaddr_in* given_remote, std::shared_ptr<Segment> syn) {
+// queue a FIN behind the data. nothing can be sent after it.
+static int _tcp_send_fin(TCB* tcb) {
+    tcb->send.fin = true;
+    return _tcp_make_sure_sendback(tcb);
+}
+
+// the segment at unack is taken as lost. resend it at once, and start the fast recovery.
+static void _tcp_fast_retransmit(TCB *tcb) {
+    auto &s = tcb->send;
+    logDebug("tcp_fast_retransmit: %d duplicate acks, resend seq %u", s.dupacks, s.unack);
+    s.cc->on_loss(s.in_flight(), get_time_us());
+    s.in_recovery = true;
+    s.recover = s.max_sent;
+    // the duplicate acks so far are of segments that have left the network.
+    // with SACK, the pipe tells that already.
+    s.recovery_inflation = tcb->sack_ok ? 0 : s.dupacks * _tcp_mss(tcb);
+    s.total_retrans++;
+    // the timed segment may be acked by the retransmission.
+    s.rtt_timing = false;
+    s.retrans_next = s.unack + _tcp_send_segment_at(tcb, s.unack, _tcp_mss(tcb));
+    s.retrans_sacked = 0;
+}
+
+// whether the segment at unack is lost, and a fast recovery starts for it.
+static bool _tcp_unack_lost(TCB *tcb) {
+    auto &s = tcb->send;
+    // after a timeout, the duplicate acks of what was sent before it are no news.
+    if (s.in_recovery || seq_lt(s.unack, s.recover))
+        return false;
+    // with SACK, as many segments sacked beyond unack tell it as well, whatever the acks that
+    // carried them, see RFC 6675 5.
+    return s.dupacks >= kTcpDupAckThreshold || s.sacked.bytes() > (kTcpDupAckThreshold - 1) * _tcp_mss(tcb);
+}
+
+// an ack of nothing new, which carries nothing else either. see RFC 5681 3.2 and RFC 6582.
+static void _tcp_handle_dupack(TCB *tcb) {
+    auto &s = tcb->send;
+    s.dupacks++;
+    if (s.in_recovery) {
+        // one more segment has left the network. let another one in.
+        if (!tcb->sack_ok)
+            s.recovery_inflation += _tcp_mss(tcb);
+        return;
+    }
+    if (_tcp_unack_lost(tcb))
+        _tcp_fast_retransmit(tcb);
+}
+
+// take the SACK blocks of an incoming segment which acks `ack` into the scoreboard.
+// blocks out of (ack, max_sent] are stale or bogus, and ignored.
+static void _tcp_handle_sack(TCB *tcb, const Segment *seg, uint32_t ack) {
+    TcpOptions opts;
+    if (!seg->parse_options(&opts) || opts.sack_blocks == 0)
+        return;
+    auto &s = tcb->send;
+    size_t resent = s.sacked.bytes_below(s.retrans_next);
+    for (size_t i = 0; i < opts.sack_blocks; i++) {
+        const TcpSackBlock &b = opts.sack[i];
+        if (seq_lt(b.start, ack) || seq_gt(b.end, s.max_sent))
+            continue;
+        size_t added = s.sacked.insert(b.start, b.end);
+        logTrace("tcp_handle_sack: [%u, %u), %zu new bytes", b.start, b.end, added);
+    }
+    if (!s.in_recovery || seq_leq(s.retrans_next, ack))
+        return;
+
+    // the holes are resent in order, so what is sacked below retrans_next now left after the
+    // resent segment at unack, and mostly got there first. that one is lost again then.
+    s.retrans_sacked += s.sacked.bytes_below(s.retrans_next) - resent;
+    if (s.retrans_sacked >= kTcpDupAckThreshold * _tcp_mss(tcb)) {
+        logDebug("tcp_handle_sack: the resent seq %u is lost, resend it again", ack);
+        s.retrans_sacked = 0;
+        s.total_retrans++;
+        _tcp_send_segment_at(tcb, ack, _tcp_mss(tcb));
+    }
+}
+
+// process the ack_seq and the window of an incoming segment.
+// return 1 if something new is acked, 0 otherwise.
+static int _tcp_handle_ack(TCB *tcb, const Segment *seg) {
+    if (seg->hdr->ack == 0)
+        return 0;
+
+    uint32_t ack = seg->hdr->ack_seq;
+    if (seq_gt(ack, tcb->send.max_sent)) {
+        logWarning("tcp_handle_ack: ack something not sent yet. ack_seq=%u, max_sent=%u", ack, tcb->send.max_sent);
+        return 0;
+    }
+
+    if (seq_lt(ack, tcb->send.unack)) {
+        // an old duplicate.
+        return 0;
+    }
+
+    // only a newer segment may update the window.
+    uint32_t old_window = tcb->send.remote_recv_window;
+    if (seq_lt(tcb->send.wl1, seg->hdr->seq) 
+        || (tcb->send.wl1 == seg->hdr->seq && seq_leq(tcb->send.wl2, ack))) {
+        tcb->send.remote_recv_window = seg->hdr->window;
+        tcb->send.wl1 = seg->hdr->seq;
+        tcb->send.wl2 = ack;
+        if (tcb->send.remote_recv_window > 0)
+            tcb->send.probe_count = 0;
+    }
+
+    if (tcb->sack_ok) {
+        tcb->send.sacked.advance(ack);
+        _tcp_handle_sack(tcb, seg, ack);
+    }
+
+    if (ack == tcb->send.unack) {
+        if (tcb->send.waiting_for_ack() && !seg->have_payload() && seg->hdr->syn == 0 && seg->hdr->fin == 0
+            && seg->hdr->window == old_window)
+            _tcp_handle_dupack(tcb);
+        else if (_tcp_unack_lost(tcb))
+            _tcp_fast_retransmit(tcb);
+        return 0;
+    }
+
+    logTrace("tcp_handle_ack: ack upd. ack_seq=%u, unack=%u", ack, tcb->send.unack);
+    TcpAckSample sample{ack - tcb->send.unack, tcb->send.in_flight(), 0, 0, (uint64_t)get_time_us(), 
+        tcb->send.in_recovery};
+    uint32_t acked = sample.acked;
+    if (tcb->send.syn) {
+        tcb->send.syn = false;
+        acked--;
+    }
+    acked -= tcb->send.buf.drop(acked);
+    if (acked > 0) {
+        assert(tcb->send.fin && acked == 1);
+        tcb->send.fin = false;
+    }
+    tcb->send.unack = ack;
+    if (tcb->send.rtt_timing && seq_geq(ack, tcb->send.rtt_seq)) {
+        tcb->send.rtt_timing = false;
+        sample.rtt = std::max<size_t>(sample.now - tcb->send.rtt_start, 1);
+        _tcp_rtt_sample(tcb, sample.rtt);
+    }
+    if (seq_lt(tcb->send.next, ack)) {
+        // acked by segments sent before a timeout.
+        tcb->send.next = ack;
+    }
+    tcb->send.dupacks = 0;
+    if (tcb->send.in_recovery) {
+        if (seq_geq(ack, tcb->send.recover)) {
+            logDebug("tcp_handle_ack: fast recovery done");
+            tcb->send.in_recovery = false;
+            tcb->send.recovery_inflation = 0;
+        } else if (!tcb->sack_ok) {
+            // a partial ack: the segment after it is lost as well. resend it at once, and take
+            // back the inflation of what has been acked, but for the resent segment.
+            uint32_t inflation = tcb->send.recovery_inflation;
+            tcb->send.recovery_inflation = (inflation > sample.acked ? inflation - sample.acked : 0) + _tcp_mss(tcb);
+            tcb->send.total_retrans++;
+            _tcp_send_segment_at(tcb, ack, _tcp_mss(tcb));
+        } else {
+            // a partial ack. the other holes are resent by _tcp_output(), but if it is beyond
+            // what has been resent, the segment after it is lost as well, even if nothing is
+            // sacked above it.
+            tcb->send.retrans_sacked = 0;
+            if (seq_geq(ack, tcb->send.retrans_next)) {
+                tcb->send.total_retrans++;
+                tcb->send.rtt_timing = false;
+                tcb->send.retrans_next = ack + _tcp_send_segment_at(tcb, ack, _tcp_mss(tcb));
+            }
+        }
+    }
+    sample.in_flight = tcb->send.in_flight();
+    tcb->send.cc->on_ack(sample);
+    // the SACK blocks may tell a new loss already.
+    if (_tcp_unack_lost(tcb))
+        _tcp_fast_retransmit(tcb);
+
+    tcb->send.retrans_count = 0;
+    // restart the retransmission timer for the rest.
+    tcb->send.last_sent_time = get_time_us();
+    if (!tcb->send.waiting_for_ack() && !tcb->send.have_unsent() && tcb->state != TCP_TIME_WAIT)
+        timer_cancel(&tcb->timer);
+    return 1;
+}
+
+static TCB* _tcp_open(const sockaddr_in* local, const sockaddr_in* given_remote, const Segment *syn, 
+    const TcpSockOpts &opts, SocketBlock *listener) {
     // if a SYN packet is given, then an active TCB is created.
     // otherwise a passive TCB is created, and jump to TCP_SYN_RECV state.
+    // a passive TCB joins `listener` once established.
     sockaddr_in remote;
     if (given_remote != nullptr) {
         remote = *given_remote;
@@ -351,13 +1005,15 @@ static TCB* _tcp_open(const sockaddr_in* local, const sockaddr_in* given_remote,
     }
 
     SocketPair pair{*local, remote};
+    TcbShard &shard = _tcp_shard(pair);
+    std::unique_lock<std::shared_mutex> shard_lock(shard.lock);
 
-    if (active_tcb_map.find(pair) != active_tcb_map.end()) {
+    if (shard.active_tcb_map.find(pair) != shard.active_tcb_map.end()) {
         logWarning("unimplemented tcp_open: already exists (active)");
         return nullptr;
     }
 
-    if (orphaned_tcb_map.find(pair) != orphaned_tcb_map.end()) {
+    if (shard.orphaned_tcb_map.find(pair) != shard.orphaned_tcb_map.end()) {
         logWarning("unimplemented tcp_open: already exists (orphaned)");
         return nullptr;
     }
@@ -368,20 +1024,29 @@ static TCB* _tcp_open(const sockaddr_in* local, const sockaddr_in* given_remote,
         inet_ntoa_safe(local->sin_addr).get(), ntohs(local->sin_port),
         inet_ntoa_safe(remote.sin_addr).get(), ntohs(remote.sin_port),
         tcb);
-    active_tcb_map[pair] = tcb;
+    shard.active_tcb_map[pair] = tcb;
+
+    // visible from now on, but nobody can touch it before it's initialized.
+    std::lock_guard<std::mutex> lock(tcb->lock);
+    shard_lock.unlock();
 
-    _init_TCB(tcb, local, &remote, syn);
+    _init_TCB(tcb, local, &remote, syn, opts);
+    tcb->listener = listener;
 
     if (syn != nullptr) {
         // passive open by a SYN, send back a SYN(ack)
-        if (_tcp_send_ctrl(tcb, Seq{.syn = 1, .fin = 0, .byte = 0}) != 0) {
+        if (_tcp_send_syn(tcb) != 0) {
             logWarning("tcp_open: fail to send SYNACK");
             logDebug("state trans: _ -> TCP_CLOSE", tcb->state);
             tcb->state = TCP_CLOSE;
+            // nobody else knows it.
+            _tcp_close(tcb);
+            _tcp_wakeup(tcb);
+            return nullptr;
         }
     } else {
         // active open, send a SYN without ack.
-        if (_tcp_send_ctrl(tcb, Seq{.syn = 1, .fin = 0, .byte = 0}) != 0) {
+        if (_tcp_send_syn(tcb) != 0) {
             logWarning("tcp_open: fail to send SYN");
             logDebug("state trans: _ -> TCP_CLOSE", tcb->state);
             tcb->state = TCP_CLOSE;
@@ -392,41 +1057,75 @@ static TCB* _tcp_open(const sockaddr_in* local, const sockaddr_in* given_remote,
     return tcb;
 }
 
-TCB* tcp_open(const sockaddr_in* local, const sockaddr_in* given_remote, std::shared_ptr<Segment> syn) {
-    std::lock_guard<std::mutex> lock(tcp_lock);
-    return _tcp_open(local, given_remote, syn);
+TCB* tcp_open(const sockaddr_in* local, const sockaddr_in* given_remote, const Segment *syn, 
+    const TcpSockOpts &opts) {
+    return _tcp_open(local, given_remote, syn, opts, nullptr);
+}
+
+void tcp_set_owner(TCB* tcb, SocketBlock *sb) {
+    std::lock_guard<std::mutex> lock(tcb->lock);
+    tcb->owner = sb;
+}
+
+void tcp_setopts(TCB* tcb, const TcpSockOpts &opts) {
+    std::lock_guard<std::mutex> lock(tcb->lock);
+    // a smaller limit only takes effect as the buffers drain.
+    tcb->send.buf.set_limit(opts.sndbuf);
+    tcb->recv.buf.set_limit(opts.rcvbuf);
+    _tcp_set_congestion(tcb, opts.congestion);
 }
 
 int tcp_register_listening_socket(SocketBlock *sb, uint16_t port /* network order */) {
-    std::lock_guard<std::mutex> lock(tcp_lock);
+    auto listening = listening_socket.lock_mut();
 
-    if (listening_socket.find(port) != listening_socket.end()) {
+    if (listening->find(port) != listening->end()) {
         logWarning("tcp_register_listening_socket: already exists");
         return -1;
     }
 
-    listening_socket[port] = sb;
+    (*listening)[port] = sb;
     return 0;
 }
 
 int tcp_unregister_listening_socket(SocketBlock *sb, uint16_t port) {
-    std::lock_guard<std::mutex> lock(tcp_lock);
+    auto listening = listening_socket.lock_mut();
 
-    if (listening_socket.find(port) == listening_socket.end()) {
+    auto it = listening->find(port);
+    if (it == listening->end()) {
         logWarning("tcp_unregister_listening_socket: not found");
         return -1;
     }
-    if (listening_socket[port] != sb) {
+    if (it->second != sb) {
         logWarning("tcp_unregister_listening_socket: not match");
         return -1;
     }
-    listening_socket.erase(port);
+    listening->erase(it);
     return 0;
 }
 
+static void _tcp_orphan(TCB *tcb) {
+    SocketPair pair{tcb->local, tcb->remote};
+    TcbShard &shard = _tcp_shard(pair);
+    std::unique_lock<std::shared_mutex> lock(shard.lock);
+    shard.active_tcb_map.erase(pair);
+    shard.orphaned_tcb_map[pair] = tcb;
+}
+
 static int _tcp_close(TCB *tcb) {
     // close the connection as soon as possible, and then recycle it.
     // send FIN and wait for CLOSED state.
+    if (tcb->orphan) {
+        // closed before.
+        return 0;
+    }
+
+    // the recycler takes it once CLOSE, see _tcp_wakeup().
+    tcb->orphan = true;
+    {
+        std::lock_guard<std::mutex> lock(recycler_mutex);
+        orphan_count++;
+    }
+
     switch (tcb->state) {
         case TCP_CLOSE:
         case TCP_FIN_WAIT1:
@@ -447,7 +1146,7 @@ static int _tcp_close(TCB *tcb) {
         case TCP_ESTABLISHED:
             logDebug("state trans: %d -> TCP_FIN_WAIT1", tcb->state);
             tcb->state = TCP_FIN_WAIT1;
-            if (_tcp_send_ctrl(tcb, Seq{.syn = 0, .fin = 1, .byte = 0}) < 0) {
+            if (_tcp_send_fin(tcb) < 0) {
                 logWarning("tcp_close: fail to send FIN");
                 return -1;
             }
@@ -455,7 +1154,7 @@ static int _tcp_close(TCB *tcb) {
         case TCP_CLOSE_WAIT:
             logDebug("state trans: _ -> TCP_LAST_ACK", tcb->state);
             tcb->state = TCP_LAST_ACK;
-            if (_tcp_send_ctrl(tcb, Seq{.syn = 0, .fin = 1, .byte = 0}) < 0) {
+            if (_tcp_send_fin(tcb) < 0) {
                 logWarning("tcp_close: fail to send FIN");
                 return -1;
             }
@@ -463,29 +1162,31 @@ static int _tcp_close(TCB *tcb) {
         default:
             return -1;
     }
-
-    // insert into orphaned_tcb 
-    orphaned_tcb.push(tcb);
-    orphaned_tcb_map[SocketPair{tcb->local, tcb->remote}] = tcb; // we hold the lock. No race here.
     return 0;
 }
 
 int tcp_close(TCB *tcb) {
-    std::unique_lock<std::mutex> lock(tcp_lock);
-
     // dont move this into _tcp_close since when we clean up, 
-    // we iterate active_tcb_map and _tcp_close it.
-    SocketPair pair{tcb->local, tcb->remote};
-    active_tcb_map.erase(pair);
+    // we iterate the active maps and _tcp_close it.
+    // moved to the orphaned map before it is pushed to the recycler.
+    _tcp_orphan(tcb);
 
-    return _tcp_close(tcb);
+    std::lock_guard<std::mutex> lock(tcb->lock);
+
+    // nobody will read it any more.
+    tcb->recv.buf.release();
+    tcb->owner = nullptr;
+
+    int ret = _tcp_close(tcb);
+    _tcp_wakeup(tcb);
+    return ret;
 }
 
 
 int tcp_send(TCB* tcb, const void *buf, int len) {
     // send is a non-blocking interface.
 
-    std::unique_lock<std::mutex> lock(tcp_lock);
+    std::unique_lock<std::mutex> lock(tcb->lock);
         
     // check state
     if (tcb->state != TCP_ESTABLISHED) {
@@ -502,15 +1203,11 @@ int tcp_send(TCB* tcb, const void *buf, int len) {
     if (len == 0)
         return 0;
 
-    // push the data into the buffer.
-    int i = 0;
-    for (i = 0; i < len; i++) {
-        if (tcb->send.buf.push(Seq{.syn = 0, .fin = 0, .byte = ((char*)buf)[i]}) == 0) {
-            break;
-        }
-    }
+    // push the data into the buffer, as much as it can take.
+    int i = tcb->send.buf.push((const char*)buf, len);
 
-    if (_tcp_make_sure_sendback(tcb) < 0) {
+    // no ack is forced here. write() keeps calling us while the buffer is full.
+    if (_tcp_output(tcb, false) < 0) {
         logWarning("tcp_send: fail to sendback");
         return -1;
     }
@@ -520,13 +1217,22 @@ int tcp_send(TCB* tcb, const void *buf, int len) {
 int tcp_receive(TCB *tcb, void *buf, int len) {
     // recv is not blocking.
 
-    std::unique_lock<std::mutex> lock(tcp_lock);
+    std::unique_lock<std::mutex> lock(tcb->lock);
 
     // we only care about recv.buf, no matter what state we are.
     
     int recv = std::min(len, (int)tcb->recv.buf.size());
     assert(true == tcb->recv.buf.pop((char*) buf, recv));
 
+    // the remote stops sending when our window gets too small for a segment.
+    // tell it as soon as the window opens again, instead of waiting for its probe.
+    size_t full = tcb->recv.mss;
+    if (recv > 0 && _tcp_can_recv_data(tcb->state) && tcb->recv.window < full 
+        && tcb->recv.buf.room() >= full) {
+        logTrace("tcp_receive: window update");
+        _tcp_send_pure_ACK(tcb, tcb->send.next);
+    }
+
     // int recv = 0;
     // while (recv < len && !tcb->recv.buf.empty()) {
     //     ((char*)buf)[recv++] = tcb->recv.buf.front();
@@ -537,12 +1243,12 @@ int tcp_receive(TCB *tcb, void *buf, int len) {
 }
 
 sockaddr_in tcp_getpeeraddress(TCB *tcb) { 
-    std::lock_guard lock(tcp_lock);
+    std::lock_guard lock(tcb->lock);
     return tcb->remote;
 }
 
 int tcp_getstate(TCB *tcb) {
-    std::lock_guard lock(tcp_lock);
+    std::lock_guard lock(tcb->lock);
     return tcb->state;
 }
 
@@ -555,15 +1261,94 @@ int tcp_can_send(int state) {
     return state == TCP_ESTABLISHED || state == TCP_CLOSE_WAIT;
 }
 
-static int _tcp_handle_segment_syn_recv(TCB *tcb, std::shared_ptr<Segment> seg) {
-    // handle pure ack only
-    if (seg->len != sizeof(struct tcphdr) || seg->hdr->syn == 1 || seg->hdr->fin == 1) {
-        logWarning("tcp_handle_segment_syn_recv: not an pure ack");
+static int _tcp_poll(TCB *tcb) {
+    int revents = 0;
+    if (!tcb->recv.buf.empty() || tcp_no_data_incoming_state(tcb->state))
+        revents |= POLLIN;
+    if (tcp_no_data_incoming_state(tcb->state))
+        revents |= POLLRDHUP;
+    if (tcp_can_send(tcb->state) && tcb->send.buf.room() > 0)
+        revents |= POLLOUT;
+    if (tcb->state == TCP_CLOSE)
+        revents |= POLLHUP;
+    if (tcb->error != 0)
+        revents |= POLLERR;
+    return revents;
+}
+
+int tcp_get_error(TCB *tcb) {
+    std::lock_guard<std::mutex> lock(tcb->lock);
+    int error = tcb->error;
+    tcb->error = 0;
+    return error;
+}
+
+void tcp_get_info(TCB *tcb, struct tcp_info *info) {
+    std::lock_guard<std::mutex> lock(tcb->lock);
+    memset(info, 0, sizeof(*info));
+    info->tcpi_state = tcb->state;
+    info->tcpi_retransmits = tcb->send.retrans_count;
+    info->tcpi_backoff = tcb->send.retrans_count;
+    info->tcpi_probes = tcb->send.probe_count;
+    info->tcpi_rto = _tcp_rto(tcb);
+    info->tcpi_snd_mss = tcb->send.mss;
+    info->tcpi_rcv_mss = tcb->recv.mss;
+    info->tcpi_advmss = tcb->recv.mss;
+    info->tcpi_rtt = tcb->send.srtt;
+    info->tcpi_rttvar = tcb->send.rttvar;
+    info->tcpi_total_retrans = tcb->send.total_retrans;
+    if (tcb->send.retrans_count > 0)
+        info->tcpi_ca_state = TCP_CA_Loss;
+    else if (tcb->send.in_recovery)
+        info->tcpi_ca_state = TCP_CA_Recovery;
+    else if (tcb->send.dupacks > 0)
+        info->tcpi_ca_state = TCP_CA_Disorder;
+    else
+        info->tcpi_ca_state = TCP_CA_Open;
+    // the counts are in segments, as Linux reports them.
+    uint32_t mss = _tcp_mss(tcb);
+    info->tcpi_unacked = (tcb->send.in_flight() + mss - 1) / mss;
+    if (tcb->sack_ok)
+        info->tcpi_options |= TCPI_OPT_SACK;
+    info->tcpi_sacked = (tcb->send.sacked.bytes() + mss - 1) / mss;
+    info->tcpi_snd_cwnd = tcb->send.cc->cwnd() / mss;
+    // "infinite" as Linux reports it.
+    uint32_t ssthresh = tcb->send.cc->ssthresh();
+    info->tcpi_snd_ssthresh = ssthresh == UINT32_MAX ? 0x7fffffff : ssthresh / mss;
+}
+
+const char *tcp_get_congestion(TCB *tcb) {
+    std::lock_guard<std::mutex> lock(tcb->lock);
+    // the names are static.
+    return tcb->send.cc->name();
+}
+
+int tcp_poll(TCB *tcb) {
+    std::lock_guard<std::mutex> lock(tcb->lock);
+    return _tcp_poll(tcb);
+}
+
+int tcp_wait(TCB *tcb, int events) {
+    std::unique_lock<std::mutex> lock(tcb->lock);
+    int revents = 0;
+    tcb->cond.wait(lock, [&]() {
+        revents = _tcp_poll(tcb);
+        return (revents & (events | POLLHUP)) != 0;
+    });
+    return revents;
+}
+
+static int _tcp_handle_segment_established(TCB *tcb, Segment *seg);
+
+static int _tcp_handle_segment_syn_recv(TCB *tcb, Segment *seg) {
+    // handle the ack of my SYNACK. it may carry data already, since the remote is established.
+    if (seg->hdr->syn == 1) {
+        logWarning("tcp_handle_segment_syn_recv: strange SYN bit");
         return -1;
     }
 
     // check if the ack is valid.
-    if (seg->hdr->ack_seq != tcb->send.next) {
+    if (seg->hdr->ack_seq != tcb->send.init_seq + 1) {
         logWarning("tcp_handle_segment_syn_recv: not acking my synack");
         return -1;
     }
@@ -580,17 +1365,25 @@ static int _tcp_handle_segment_syn_recv(TCB *tcb, std::shared_ptr<Segment> seg)
     //     return -1;
     // }
 
-    if (seg->hdr->ack_seq > tcb->send.unack)
-        tcb->send.unack = seg->hdr->ack_seq;
+    _tcp_handle_ack(tcb, seg);
 
     logDebug("state trans: TCP_SYN_RECV -> TCP_ESTABLISHED");
     tcb->state = TCP_ESTABLISHED;
+
+    // ready to be accepted. if the listening socket has gone or is full, nobody will own it.
+    if (socket_recv_new_tcp_conn(tcb->listener, tcb) < 0) {
+        logWarning("tcp_handle_segment_syn_recv: not accepted, close it");
+        return _tcp_close(tcb);
+    }
+
+    if (seg->need_to_ack())
+        return _tcp_handle_segment_established(tcb, seg);
     return 0;
 }
 
-static int _tcp_handle_segment_syn_sent(TCB *tcb, std::shared_ptr<Segment> seg) {
+static int _tcp_handle_segment_syn_sent(TCB *tcb, Segment *seg) {
     // handle pure SYN ACK only
-    if (seg->len != sizeof(tcphdr) || 
+    if (seg->have_payload() || 
         seg->hdr->syn == 0 || seg->hdr->ack == 0 || seg->hdr->fin == 1) {
 
         logWarning("tcp_handle_segment_syn_sent: not a SYNACK");
@@ -606,10 +1399,17 @@ static int _tcp_handle_segment_syn_sent(TCB *tcb, std::shared_ptr<Segment> seg)
     // fill in remote info
     tcb->recv.init_seq = seg->hdr->seq;
     tcb->recv.next = seg->hdr->seq + 1; // init_recv_seq used by SYN
-    // tcb->send.remote_recv_window = seg->hdr->window;
-
-    if (seg->hdr->ack_seq > tcb->send.unack)
-        tcb->send.unack = seg->hdr->ack_seq;
+    tcb->send.remote_recv_window = seg->hdr->window;
+    tcb->send.wl1 = seg->hdr->seq;
+    tcb->send.wl2 = seg->hdr->ack_seq;
+    TcpOptions opts;
+    if (!seg->parse_options(&opts))
+        opts = TcpOptions();
+    tcb->sack_ok = opts.sack_permitted;
+    tcb->send.remote_mss = _tcp_remote_mss(opts);
+    _tcp_update_mss(tcb, tcb->recv.mss);
+
+    _tcp_handle_ack(tcb, seg);
 
     logDebug("state trans: TCP_SYN_SENT -> TCP_ESTABLISHED");
     tcb->state = TCP_ESTABLISHED;
@@ -620,59 +1420,85 @@ static int _tcp_handle_segment_syn_sent(TCB *tcb, std::shared_ptr<Segment> seg)
     return 0;
 }
 
-static int _tcp_handle_segment_established(TCB *tcb, std::shared_ptr<Segment> seg) {
-    // normal or fin
+// take the payload of an in-order segment into recv.buf, then whatever it joins in the out-of-order queue.
+// a segment larger than the buffer room is taken partially, and the rest is left for the remote to resend.
+// return true if the remote FIN is reached. recv.next is not advanced over it here.
+static bool _tcp_recv_data(TCB *tcb, const Segment *seg) {
+    size_t len = seg->payload_len();
+    size_t take = tcb->recv.buf.push(seg->payload, len);
+    if (take < len)
+        logDebug("tcp_recv_data: recv buffer is full or out of memory, take %zu of %zu bytes", take, len);
+
+    logTrace("tcp_recv_data: recv %zu bytes", take);
+    tcb->recv.next += take;
+    if (take < len)
+        return false;
+
+    bool fin = seg->hdr->fin == 1;
+    if (!fin && !tcb->recv.ooo.empty()) {
+        tcb->recv.next += tcb->recv.ooo.deliver(tcb->recv.next, [tcb](const char *data, size_t n) {
+            return tcb->recv.buf.push(data, n);
+        }, &fin);
+    }
+    if (fin)
+        tcb->recv.ooo.clear();
+    return fin;
+}
 
-    // handle ack update first
-    if (seg->hdr->ack_seq > tcb->send.unack) {
-        
-        logDebug("tcp_handle_segment_established: ack upd. ack_seq=%u, unack=%u", seg->hdr->ack_seq, tcb->send.unack);
-        tcb->send.unack = seg->hdr->ack_seq;
+// keep a segment beyond recv.next until the gap is filled. only the part inside the receive buffer is kept.
+static void _tcp_queue_out_of_order(TCB *tcb, const Segment *seg) {
+    uint32_t seq = seg->hdr->seq;
+    size_t room = tcb->recv.buf.rest_capacity();
+    size_t offset = seq - tcb->recv.next;
+    if (offset >= room) {
+        logDebug("tcp_queue_out_of_order: seq %u is out of the window", seq);
+        return;
     }
 
-    if (seg->have_payload())
-        logTrace("tcp_handle_segment_established: recv %llu bytes", seg->payload_len());
+    size_t len = std::min(seg->payload_len(), room - offset);
+    size_t added = tcb->recv.ooo.insert(seq, seg->payload, len);
+    if (len > 0)
+        tcb->recv.sack_recent = seq;
+    if (seg->hdr->fin == 1 && len == seg->payload_len())
+        tcb->recv.ooo.set_fin(seq + len);
 
-    // push the data into the buffer.
-    // TODO: we only recv whole segment, which is not efficient.
-    // the reason we have to do so: we only accept segments whose first byte is exactly recv.next.
+    logDebug("tcp_queue_out_of_order: seq %u, %zu new bytes, %zu bytes in %zu intervals queued", 
+        seq, added, tcb->recv.ooo.bytes(), tcb->recv.ooo.intervals());
+}
 
-    if (tcb->recv.buf.push_all((char*)seg->buf.get() + sizeof(struct tcphdr), seg->payload_len()) == false) {
-        // buffer overflow, drop this segment.
-        logWarning("tcp_handle_segment_established: recv buffer overflow");
-        return -1;
-    }
+static int _tcp_handle_segment_established(TCB *tcb, Segment *seg) {
+    // normal or fin
 
-    tcb->recv.next += seg->payload_len();
+    // handle ack update first
+    _tcp_handle_ack(tcb, seg);
 
     // handle fin
-    if (seg->hdr->fin == 1) {
+    if (_tcp_recv_data(tcb, seg)) {
         logDebug("state trans: TCP_ESTABLISHED -> TCP_CLOSE_WAIT");
         tcb->state = TCP_CLOSE_WAIT;
         tcb->recv.next++;
     }
 
-    if (seg->need_to_ack())
-        if (_tcp_make_sure_sendback(tcb) < 0) {
-            logWarning("tcp_handle_segment_established: fail to sendback");
-            return -1;
-        }
+    // the ack may open the window for more data, and new data must be acked.
+    if (_tcp_output(tcb, seg->need_to_ack()) < 0) {
+        logWarning("tcp_handle_segment_established: fail to sendback");
+        return -1;
+    }
 
     return 0;
 }
 
-static int _tcp_handle_segment_fin_wait1(TCB *tcb, std::shared_ptr<Segment> seg) {
-    // we have close() the tcp conn. 
+// everything queued, including my FIN, is acked.
+static inline bool _tcp_fin_acked(TCB *tcb) {
+    return tcb->send.buf.empty() && !tcb->send.fin;
+}
+
+static int _tcp_handle_segment_fin_wait1(TCB *tcb, Segment *seg) {
+    // we have close() the tcp conn, but the remote may still send data.
     // two possibility: 1. the remote FIN reached. 2. my FIN is acked, 
 
     // update ack
-    if (seg->hdr->ack_seq > tcb->send.unack)
-        tcb->send.unack = seg->hdr->ack_seq;
-
-    if (seg->have_payload()) {
-        logWarning("tcp_handle_segment_fin_wait1: not a pure segment");
-        return -1;
-    }
+    _tcp_handle_ack(tcb, seg);
 
     if (seg->hdr->syn == 1) {
         logWarning("tcp_handle_segment_fin_wait1: strange SYN bit");
@@ -680,7 +1506,7 @@ static int _tcp_handle_segment_fin_wait1(TCB *tcb, std::shared_ptr<Segment> seg)
     }
 
     // case 1: with fin
-    if (seg->hdr->fin == 1) {
+    if (_tcp_recv_data(tcb, seg)) {
         tcb->recv.next ++;
         if (_tcp_make_sure_sendback(tcb) < 0) {
             logWarning("tcp_handle_segment_fin_wait1: fail to sendback");
@@ -689,55 +1515,60 @@ static int _tcp_handle_segment_fin_wait1(TCB *tcb, std::shared_ptr<Segment> seg)
         tcb->state = TCP_CLOSING;
         
         // if my FIN is acked, trans to TCP_TIME_WAIT directly
-        if (tcb->send.waiting_for_ack() == false) {
-            tcb->state = TCP_TIME_WAIT;
+        if (_tcp_fin_acked(tcb)) {
+            _tcp_enter_time_wait(tcb);
         }
 
         return 0;
     }
 
     // case 2: without fin
-    if (tcb->send.buf.empty() && tcb->send.waiting_for_ack() == false) {
+    if (_tcp_fin_acked(tcb)) {
         // my FIN is sent, and acked (by this segment).
         logDebug("state trans: TCP_FIN_WAIT1 -> TCP_FIN_WAIT2");
         tcb->state = TCP_FIN_WAIT2;
-        return 0;
     }
 
-    logWarning("unexpected case in tcp_handle_segment_fin_wait1");
-    return -1;
+    // still flushing the send buffer before my FIN, and the data must be acked.
+    return _tcp_output(tcb, seg->need_to_ack());
 }
 
-static int _tcp_handle_segment_fin_wait2(TCB *tcb, std::shared_ptr<Segment> seg) {
-    if (seg->hdr->ack_seq > tcb->send.unack)
-        tcb->send.unack = seg->hdr->ack_seq;
-
+static int _tcp_handle_segment_fin_wait2(TCB *tcb, Segment *seg) {
+    _tcp_handle_ack(tcb, seg);
     
-    // only pure FIN with ack can be received in this state.
-    if (seg->have_payload() || seg->hdr->syn == 1 || seg->hdr->fin == 0) {
-        logWarning("tcp_handle_segment_fin_wait2: not a pure FIN");
+    if (seg->hdr->syn == 1) {
+        logWarning("tcp_handle_segment_fin_wait2: strange SYN bit");
         return -1;
     }
 
-    // a pure FIN with ack
-    tcb->recv.next++;
-    logDebug("state trans: TCP_FIN_WAIT2 -> TCP_TIME_WAIT");
-    tcb->state = TCP_TIME_WAIT;
-    if (_tcp_make_sure_sendback(tcb) < 0) {
+    if (_tcp_recv_data(tcb, seg)) {
+        tcb->recv.next++;
+        _tcp_enter_time_wait(tcb);
+    }
+
+    if (_tcp_output(tcb, seg->need_to_ack()) < 0) {
         logWarning("tcp_handle_segment_fin_wait2: fail to sendback");
         return -1;
     }
     return 0;
 }
 
-static int _tcp_handle_segment_close_wait(TCB *tcb, std::shared_ptr<Segment> seg) {
-    // abandon this seg since we have received a FIN.
-    { (void)tcb; (void)seg; }
-    logWarning("tcp_handle_segment_close_wait: recv segment in CLOSE_WAIT state");
-    return -1;
+static int _tcp_handle_segment_close_wait(TCB *tcb, Segment *seg) {
+    // we may still be sending. take the ack, but abandon the rest since we have received a FIN.
+    _tcp_handle_ack(tcb, seg);
+    if (_tcp_output(tcb, false) < 0) {
+        logWarning("tcp_handle_segment_close_wait: fail to send segments");
+        return -1;
+    }
+
+    if (seg->need_to_ack()) {
+        logWarning("tcp_handle_segment_close_wait: recv segment in CLOSE_WAIT state");
+        return -1;
+    }
+    return 0;
 }
 
-static int _tcp_handle_segment_closing(TCB *tcb, std::shared_ptr<Segment> seg) {
+static int _tcp_handle_segment_closing(TCB *tcb, Segment *seg) {
     // only allow pure ACK of my FIN in this state
 
     if (seg->have_payload() || seg->hdr->syn == 1 || seg->hdr->fin == 1) {
@@ -745,17 +1576,17 @@ static int _tcp_handle_segment_closing(TCB *tcb, std::shared_ptr<Segment> seg) {
         return -1;
     }
 
-    if (seg->hdr->ack_seq != tcb->send.next) {
+    _tcp_handle_ack(tcb, seg);
+    if (!_tcp_fin_acked(tcb)) {
         logWarning("tcp_handle_segment_closing: not acking my FIN");
-        return -1;
+        return _tcp_output(tcb, false);
     }
 
-    logDebug("state trans: TCP_CLOSING -> TCP_TIME_WAIT");
-    tcb->state = TCP_TIME_WAIT;
+    _tcp_enter_time_wait(tcb);
     return 0;
 }
 
-static int _tcp_handle_segment_last_ack(TCB *tcb, std::shared_ptr<Segment> seg) {
+static int _tcp_handle_segment_last_ack(TCB *tcb, Segment *seg) {
     // only allow pure ACK of my FIN in this state
 
     if (seg->have_payload() || seg->hdr->syn == 1 || seg->hdr->fin == 1) {
@@ -763,43 +1594,46 @@ static int _tcp_handle_segment_last_ack(TCB *tcb, std::shared_ptr<Segment> seg)
         return -1;
     }
 
-    if (seg->hdr->ack_seq != tcb->send.next) {
+    _tcp_handle_ack(tcb, seg);
+    if (!_tcp_fin_acked(tcb)) {
         logWarning("tcp_handle_segment_last_ack: not acking my FIN");
-        return -1;
+        return _tcp_output(tcb, false);
     }
 
     logDebug("state trans: TCP_LAST_ACK -> TCP_CLOSE");
     tcb->state = TCP_CLOSE;
-    tcb->send.unack++;
     return 0;
 }
 
-static int _tcp_handle_segment_time_wait(TCB *tcb, std::shared_ptr<Segment> seg) {
+static int _tcp_handle_segment_time_wait(TCB *tcb, Segment *seg) {
     // if we receive a FIN again, ack back again, which is done by determining tcp_segment_handler();
     { (void)tcb; (void)seg; }
     return 0;
 }
 
-int tcp_segment_handler(const void* buf, int len, const struct in_addr& src, const struct in_addr& dst) {
-    std::lock_guard<std::mutex> lock(tcp_lock);
+static int _tcp_handle_segment(TCB *tcb, Segment *seg);
 
+int tcp_segment_handler(const void* buf, int len, const struct in_addr& src, const struct in_addr& dst) {
     if (len < 0 || (size_t)len < sizeof(struct tcphdr)) {
         logWarning("tcp_segment_handler: too short to contain a tcp header");
         return -1;
     }
 
-    // construct a Segment
-    std::shared_ptr<Segment> seg = std::make_shared<Segment>(buf, len, src, dst);
-
-
-    // the very first thing is to check the checksum.
-    auto ck = seg->hdr->check;
-    seg->fill_in_tcp_checksum();
-    if (seg->hdr->check != ck) {
+    // the very first thing is to check the checksum and the header length, in the buffer of the lower layer.
+    if (!_tcp_checksum_ok(buf, len, src, dst)) {
         logWarning("tcp_segment_handler: checksum error");
         return -1;
     }
+    size_t hlen = ((const struct tcphdr*)buf)->doff * 4;
+    if (hlen < sizeof(struct tcphdr) || hlen > (size_t)len) {
+        logWarning("tcp_segment_handler: bad header length %zu", hlen);
+        return -1;
+    }
 
+    // borrow the segment rather than copying it. its payload is copied once, into the receive buffer
+    // or the out-of-order queue, and nothing keeps the segment after this call.
+    Segment segment{(const struct tcphdr*)buf, (size_t)len, src, dst};
+    Segment *seg = &segment;
     seg->ntoh();
     SocketPair tuple4;
     tuple4.local.sin_addr = dst;
@@ -812,31 +1646,34 @@ int tcp_segment_handler(const void* buf, int len, const struct in_addr& src, con
 
         logInfo("tcp_segment_handler: recv a SYN");
 
-        // check if there is a listening socket
-        if (listening_socket.find(seg->hdr->dest) == listening_socket.end()) {
+        // check if there is a listening socket.
+        // sockets are never freed, so the TCB can keep it till established.
+        auto listening = listening_socket.lock();
+        auto it = listening->find(seg->hdr->dest);
+        if (it == listening->end()) {
             logWarning("tcp_segment_handler: no listening socket");
             return -1;
         }
-        SocketBlock *sb = listening_socket[seg->hdr->dest];
+        SocketBlock *sb = it->second;
         
-        TCB *tcb = _tcp_open(&tuple4.local, &tuple4.remote, seg);
+        // a passive TCB inherits the options of its listening socket.
+        TCB *tcb = _tcp_open(&tuple4.local, &tuple4.remote, seg, socket_get_tcp_opts(sb), sb);
         if (tcb == nullptr) {
             logWarning("tcp_segment_handler: reject to open a new connection");
             return -1;
         }
-        assert(tcb->state == TCP_SYN_RECV); // wait for the ack of syn.
-
-        socket_recv_new_tcp_conn(sb, tcb);
-
+        // wait for the ack of syn. it's given to the listening socket then.
         return 0;
     }
 
     // for other cases, there should be a specific socket to handle this segment.
     TCB *tcb = nullptr;
-    if (active_tcb_map.find(tuple4) != active_tcb_map.end()) {
-        tcb = active_tcb_map[tuple4];
-    } else if (orphaned_tcb_map.find(tuple4) != orphaned_tcb_map.end()) {
-        tcb = orphaned_tcb_map[tuple4];
+    TcbShard &shard = _tcp_shard(tuple4);
+    std::shared_lock<std::shared_mutex> shard_lock(shard.lock);
+    if (auto it = shard.active_tcb_map.find(tuple4); it != shard.active_tcb_map.end()) {
+        tcb = it->second;
+    } else if (auto it = shard.orphaned_tcb_map.find(tuple4); it != shard.orphaned_tcb_map.end()) {
+        tcb = it->second;
     } else {
         logWarning("tcp_segment_handler: no open socket can reponse. tuple4: from %s:%d to %s:%d", 
             inet_ntoa_safe(tuple4.local.sin_addr).get(), ntohs(tuple4.local.sin_port), 
@@ -844,24 +1681,91 @@ int tcp_segment_handler(const void* buf, int len, const struct in_addr& src, con
         return -1;
     }
 
+    // lock it before leaving the shard, so that the recycler can not free it under us.
+    std::lock_guard<std::mutex> lock(tcb->lock);
+    shard_lock.unlock();
+
+    int ret = _tcp_handle_segment(tcb, seg);
+    // whatever it changed, let the waiters check again.
+    _tcp_wakeup(tcb);
+    return ret;
+}
+
+// the remote aborts the connection. a RST is taken only in the window, so that an old or forged
+// one does not kill it, see RFC 9293 3.10.7.
+static int _tcp_handle_reset(TCB *tcb, Segment *seg) {
+    bool acceptable;
+    if (tcb->state == TCP_SYN_SENT) {
+        // it must ack my SYN.
+        acceptable = seg->hdr->ack == 1 && seg->hdr->ack_seq == tcb->send.max_sent;
+    } else {
+        uint32_t window = std::max<uint32_t>(tcb->recv.window, 1);
+        acceptable = seq_geq(seg->hdr->seq, tcb->recv.next) && seq_lt(seg->hdr->seq, tcb->recv.next + window);
+    }
+    if (!acceptable) {
+        logWarning("tcp_handle_reset: RST out of the window, seq=%u", seg->hdr->seq);
+        return -1;
+    }
+
+    // a passive one which never got established has no user to close it.
+    bool unowned = tcb->state == TCP_SYN_RECV;
+    logDebug("state trans: %d -> TCP_CLOSE, reset by the remote", tcb->state);
+    if (tcb->state != TCP_TIME_WAIT)
+        tcb->error = tcb->state == TCP_SYN_SENT ? ECONNREFUSED : ECONNRESET;
+    tcb->state = TCP_CLOSE;
+    if (unowned)
+        _tcp_close(tcb);
+    // the caller wakes up the waiters.
+    return 0;
+}
+
+static int _tcp_handle_segment(TCB *tcb, Segment *seg) {
+
     if (tcb->state == TCP_CLOSE) {
         logWarning("tcp_segment_handler: recv a segment when the connection closed");
         return -1;
     }
 
+    if (seg->hdr->rst == 1)
+        return _tcp_handle_reset(tcb, seg);
+
+    // new data after close() has nobody to read it. it's not buffered, nor acked:
+    // the remote is reset, see RFC 9293 3.10.7.4.
+    if (tcb->owner == nullptr && (tcb->state == TCP_FIN_WAIT1 || tcb->state == TCP_FIN_WAIT2)
+        && seg->have_payload() && seq_gt(seg->hdr->seq + seg->payload_len(), tcb->recv.next)) {
+        logDebug("tcp_segment_handler: data after close, reset the connection");
+        return _tcp_send_reset(tcb);
+    }
+
     // the second thing is to check the seq.
     // if the seq does not match, we abandon this segment and clarify our progress again. 
     // reasons: maybe last connection with the same tuple4, or outdated segment, or ACK loss.
     
+    // when we can still receive data, a segment partially received before is trimmed to recv.next,
+    // and a segment beyond it is queued until the gap is filled.
+    
+    if (_tcp_can_recv_data(tcb->state) && seg->hdr->syn == 0 
+        && seq_lt(seg->hdr->seq, tcb->recv.next) && seg->have_payload()) {
+        size_t old = tcb->recv.next - seg->hdr->seq;
+        if (old < seg->payload_len()) {
+            logDebug("tcp_handle_segment: trim %zu bytes received before", old);
+            seg->trim_front(old);
+        }
+    }
+
     if (tcb->state != TCP_SYN_SENT && tcb->recv.next != seg->hdr->seq) {
         // syn_sent state we dont have remote infomation.
 
-        if (seg->hdr->ack_seq > tcb->send.unack) {
-            tcb->send.unack = seg->hdr->ack_seq;
-            // tcb->send.remote_recv_window = seg->hdr->window;
+        _tcp_handle_ack(tcb, seg);
+
+        if (_tcp_can_recv_data(tcb->state) && seg->hdr->syn == 0 && seg->need_to_ack()
+            && seq_gt(seg->hdr->seq, tcb->recv.next)) {
+            // a gap before it. the ack below is a duplicate one, which tells the remote where the gap is.
+            _tcp_queue_out_of_order(tcb, seg);
+        } else {
+            logWarning("tcp_handle_segment: seq not consistent %u != %u, ack back again.", tcb->recv.next, seg->hdr->seq);
         }
 
-        logWarning("tcp_handle_segment: seq not consistent %u != %u, ack back again.", tcb->recv.next, seg->hdr->seq);
         // sync our progress to remote.
         // possibily an ACK loss.
         if (_tcp_make_sure_sendback(tcb) < 0) {
@@ -880,23 +1784,23 @@ int tcp_segment_handler(const void* buf, int len, const struct in_addr& src, con
 
     switch (tcb->state) {
         case TCP_SYN_RECV:
-            return _tcp_handle_segment_syn_recv(tcb, std::move(seg));
+            return _tcp_handle_segment_syn_recv(tcb, seg);
         case TCP_SYN_SENT:
-            return _tcp_handle_segment_syn_sent(tcb, std::move(seg));
+            return _tcp_handle_segment_syn_sent(tcb, seg);
         case TCP_ESTABLISHED:
-            return _tcp_handle_segment_established(tcb, std::move(seg));
+            return _tcp_handle_segment_established(tcb, seg);
         case TCP_FIN_WAIT1:
-            return _tcp_handle_segment_fin_wait1(tcb, std::move(seg));
+            return _tcp_handle_segment_fin_wait1(tcb, seg);
         case TCP_FIN_WAIT2:
-            return _tcp_handle_segment_fin_wait2(tcb, std::move(seg));
+            return _tcp_handle_segment_fin_wait2(tcb, seg);
         case TCP_CLOSE_WAIT:
-            return _tcp_handle_segment_close_wait(tcb, std::move(seg));
+            return _tcp_handle_segment_close_wait(tcb, seg);
         case TCP_CLOSING:
-            return _tcp_handle_segment_closing(tcb, std::move(seg));
+            return _tcp_handle_segment_closing(tcb, seg);
         case TCP_LAST_ACK:
-            return _tcp_handle_segment_last_ack(tcb, std::move(seg));
+            return _tcp_handle_segment_last_ack(tcb, seg);
         case TCP_TIME_WAIT:
-            return _tcp_handle_segment_time_wait(tcb, std::move(seg));
+            return _tcp_handle_segment_time_wait(tcb, seg);
         default:
             logWarning("tcp_segment_handler: invalid state");
             return -1;
@@ -4,6 +4,7 @@
 #include <time.h>
 #include <stdio.h>
 #include <cstring>
+#include <cstdlib>
 
 long long get_time_ns() {
     struct timespec ts;
@@ -0,0 +1,54 @@
+#include "route_trie.h"
+
+#include <algorithm>
+
+static int _prefix_len(in_addr mask) {
+    return __builtin_popcount(mask.s_addr);
+}
+
+RouteTrie::RouteTrie(const std::vector<Route> &routes) : root_(1 << 16, 0), hops_(1) {
+    // from the shortest prefix to the longest, so that a longer one always overwrites.
+    std::vector<size_t> order(routes.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return _prefix_len(routes[a].mask) < _prefix_len(routes[b].mask);
+    });
+
+    for (size_t i : order) {
+        const Route &r = routes[i];
+        hops_.push_back(r.hop);
+        insert(ntohl(r.dest.s_addr & r.mask.s_addr), _prefix_len(r.mask), hops_.size() - 1);
+    }
+}
+
+void RouteTrie::insert(uint32_t prefix, int len, uint32_t value) {
+    // walk down the levels: the root takes 16 bits, each node 8 more.
+    long node = -1; // -1 for the root
+    int end = 16;   // the bits consumed at the end of this level
+    while (true) {
+        uint32_t *slots = node < 0 ? root_.data() : nodes_[node].slots;
+        int bits = node < 0 ? 16 : 8;
+        uint32_t index = (prefix >> (32 - end)) & ((1u << bits) - 1);
+
+        if (len <= end) {
+            // expand the prefix over the slots it covers. none is a node yet, as the
+            // longer routes which create nodes come later.
+            std::fill(slots + index, slots + index + (1u << (end - len)), value);
+            return;
+        }
+
+        uint32_t e = slots[index];
+        if ((e & kNode) == 0) {
+            // the route covering this slot so far is pushed down into the new node.
+            Node child;
+            std::fill(child.slots, child.slots + 256, e);
+            nodes_.push_back(child);
+            e = kNode | (uint32_t)(nodes_.size() - 1);
+            // nodes_ may have moved.
+            (node < 0 ? root_.data() : nodes_[node].slots)[index] = e;
+        }
+        node = e & ~kNode;
+        end += 8;
+    }
+}
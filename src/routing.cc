@@ -2,11 +2,13 @@
 #include "logger.h"
 #include "device.h"
 #include "pnx_utils.h"
-#include "rustex.h"
 #include "packetio.h"
+#include "route_trie.h"
+#include "pnx_ip.h"
 
 #include <arpa/inet.h>
 #include <algorithm>
+#include <atomic>
 
 
 struct RoutingEntry : public std::enable_shared_from_this<RoutingEntry> {
@@ -46,6 +48,7 @@ public:
 };
 
 #include <vector>
+#include <unordered_map>
 
 
 // static_routing_table_ comes from add_static_routing_entry.
@@ -56,9 +59,10 @@ public:
 // dynamic_routing_table_ does not contain direct entries.
 
 static
-std::vector<std::shared_ptr<RoutingEntry>> 
-    static_routing_table_, 
-    dynamic_routing_table_;
+std::vector<std::shared_ptr<RoutingEntry>> static_routing_table_;
+// by the key of the distance vector entry it comes from.
+static
+std::unordered_map<uint64_t, std::shared_ptr<RoutingEntry>> dynamic_routing_table_;
 
 
 #include <mutex>
@@ -66,6 +70,32 @@ std::vector<std::shared_ptr<RoutingEntry>>
 static 
 std::mutex routing_table_mtx_; // lock of the routing tables
 
+// the routing tables merged into a trie for get_next_hop(), rebuilt when either table changes.
+// lookups take no lock: each thread keeps a reference to the current trie, which is never
+// modified, and loads it again only when route_trie_gen_ tells it's replaced.
+static std::shared_ptr<const RouteTrie> route_trie_ = std::make_shared<RouteTrie>(std::vector<RouteTrie::Route>{});
+static std::atomic<uint64_t> route_trie_gen_{1};
+
+static void request_full_distance_upd();
+
+// with routing_table_mtx_ held.
+static void publish_routing_table() {
+    std::vector<RouteTrie::Route> routes;
+    routes.reserve(dynamic_routing_table_.size() + static_routing_table_.size());
+    // a static entry wins over a dynamic one of the same prefix.
+    for (auto &kv : dynamic_routing_table_) {
+        auto &entry = kv.second;
+        routes.push_back({entry->dest, entry->mask, {entry->device_id, entry->next_hop, false}});
+    }
+    for (auto &entry : static_routing_table_) {
+        bool direct = std::dynamic_pointer_cast<DirectRoutingEntry>(entry) != nullptr;
+        routes.push_back({entry->dest, entry->mask, {entry->device_id, entry->next_hop, direct}});
+    }
+    std::atomic_store(&route_trie_, std::shared_ptr<const RouteTrie>(std::make_shared<RouteTrie>(routes)));
+    route_trie_gen_.fetch_add(1, std::memory_order_release);
+    ip_dst_invalidate();
+}
+
 
 static void route_table_init_from_OS() {
     // initialize from OS routing table.
@@ -156,6 +186,7 @@ static void route_table_init_from_OS() {
     }
 
     std::sort(static_routing_table_.begin(), static_routing_table_.end());
+    publish_routing_table();
 
     // print the routing table.
     logDebug("routing table:");
@@ -176,42 +207,19 @@ std::pair<int, in_addr> get_next_hop(const in_addr dest) {
     }
 
     // find the routing entry with the longest prefix match.
-    // i.e. from the tail of the routing table.
-
-
-
-    std::unique_lock<std::mutex> lock(routing_table_mtx_);
-    // combines two routing tables
-    // we suppose the number of entries is small. dont worry about performance.
-    std::vector<std::shared_ptr<RoutingEntry>> routing_table;
-    routing_table.reserve(static_routing_table_.size() + dynamic_routing_table_.size());
-    routing_table.insert(routing_table.end(), static_routing_table_.begin(), static_routing_table_.end());
-    routing_table.insert(routing_table.end(), dynamic_routing_table_.begin(), dynamic_routing_table_.end());
-    lock.unlock();
-
-    std::sort(routing_table.begin(), routing_table.end());
-
-    for (auto it = routing_table.rbegin(); it != routing_table.rend(); it++) {
-        auto entry = *it;
-
-        // check if it is a direct routing entry.
-        // use dynamic cast.
-        auto direct_entry = std::dynamic_pointer_cast<DirectRoutingEntry>(entry);
-        if (direct_entry != nullptr) {
-            // it is a direct routing entry.
-            // check if the subnet number matches.
-            if (subnet_match(dest, direct_entry->dest, direct_entry->mask)) {
-                return { direct_entry->device_id, dest };
-            }
-        } else {
-            // it is a normal routing entry.
-            // check if the subnet number matches.
-            if (subnet_match(dest, entry->dest, entry->mask)) {
-                return { entry->device_id, entry->next_hop };
-            }
-        }
+    thread_local uint64_t gen = 0;
+    thread_local std::shared_ptr<const RouteTrie> trie;
+    uint64_t current = route_trie_gen_.load(std::memory_order_acquire);
+    if (gen != current) {
+        trie = std::atomic_load(&route_trie_);
+        gen = current;
+    }
+    const RouteNextHop *hop = trie->lookup(dest);
+    if (hop == nullptr) {
+        return { -1, {0} };
     }
-    return { -1, {0} };
+    // a direct entry means the destination is a neighbour.
+    return { hop->device_id, hop->direct ? dest : hop->next_hop };
 }
 
 int add_static_routing_entry(const in_addr dest, const in_addr mask,
@@ -243,12 +251,21 @@ int add_static_routing_entry(const in_addr dest, const in_addr mask,
         static_routing_table_.push_back(std::make_shared<DirectRoutingEntry>(dest, mask, id));
 
     std::sort(static_routing_table_.begin(), static_routing_table_.end());
+    publish_routing_table();
+    lock.unlock();
+
+    // let the neighbours know a new subnet at once.
+    if (direct)
+        request_full_distance_upd();
     return 0;
 }
 
 
 // ====== dynamic routing ======
 
+// a hop count this large means unreachable. it also bounds counting to infinity.
+static const int kInfinity = 16;
+
 struct DistanceEntry {
     // for routing purpose, we only concern about the subnet number.
     in_addr ip;             
@@ -259,6 +276,11 @@ struct DistanceEntry {
     in_addr updated_from;   // for the routing table update.
     int recv_dev_id;
 
+    // when updated_from last confirmed it, or when it became unreachable.
+    long long heard_us;
+    // to be sent in the next triggered update.
+    bool changed;
+
     DistanceEntry() {}
     DistanceEntry(const in_addr ip, const in_addr mask, int hops) {
         this->ip.s_addr = ip.s_addr & mask.s_addr;
@@ -266,44 +288,40 @@ struct DistanceEntry {
         this->hops = hops;
     }
 
-    bool operator==(const DistanceEntry &rhs) const {
-        return this->subnet().s_addr == rhs.subnet().s_addr 
-            && mask.s_addr == rhs.mask.s_addr;
-    }
-
-
     inline in_addr subnet() const {
         in_addr subnet;
         subnet.s_addr = ip.s_addr & mask.s_addr;
         return subnet;
     }
 
+    uint64_t key() const {
+        return (uint64_t)subnet().s_addr << 32 | mask.s_addr;
+    }
+
 
     static const int kSizeOnwire = sizeof(ip.s_addr) + sizeof(mask.s_addr) + sizeof(hops);
 
-    std::string to_bytes() const {
-        std::string bytes;
+    // `hops` as advertised, which differs from ours under poison reverse.
+    void to_bytes(std::string &bytes, int hops) const {
         // use network order
         uint32_t ip = htonl(this->ip.s_addr);
         uint32_t mask = htonl(this->mask.s_addr);
-        uint32_t hops = htonl(this->hops);
+        uint32_t nhops = htonl(hops);
         
         bytes.append((char *)&ip, sizeof(ip));
         bytes.append((char *)&mask, sizeof(mask));
-        bytes.append((char *)&hops, sizeof(hops));
-
-        return bytes;
+        bytes.append((char *)&nhops, sizeof(nhops));
     }
 
-    static DistanceEntry from_bytes(const std::string &bytes) {
+    static DistanceEntry from_bytes(const char *bytes) {
         DistanceEntry entry;
         // use network order
         uint32_t ip;
         uint32_t mask;
         uint32_t hops;
-        memcpy(&ip, bytes.data(), sizeof(ip));
-        memcpy(&mask, bytes.data() + sizeof(ip), sizeof(mask));
-        memcpy(&hops, bytes.data() + sizeof(ip) + sizeof(mask), sizeof(hops));
+        memcpy(&ip, bytes, sizeof(ip));
+        memcpy(&mask, bytes + sizeof(ip), sizeof(mask));
+        memcpy(&hops, bytes + sizeof(ip) + sizeof(mask), sizeof(hops));
         entry.ip.s_addr = ntohl(ip);
         entry.mask.s_addr = ntohl(mask);
         entry.hops = ntohl(hops);
@@ -312,59 +330,164 @@ struct DistanceEntry {
     }
 };
 
-struct DEHash {
-    size_t operator()(const DistanceEntry &entry) const {
-        return entry.ip.s_addr & entry.mask.s_addr;
+#include <unordered_map>
+#include <condition_variable>
+
+// the distance vector, by DistanceEntry::key().
+// lock order: dv_mutex_, then routing_table_mtx_.
+static std::mutex dv_mutex_;
+static std::unordered_map<uint64_t, DistanceEntry> distance_vec_;
+// some entries changed, and a triggered update is due at trigger_at_us_.
+static bool triggered_ = false;
+static long long trigger_at_us_ = 0;
+// the whole vector is to be sent at once, e.g. for a new device.
+static bool full_due_ = false;
+static std::condition_variable dv_cond_;
+
+// every entry is advertised this often, and the changes sooner, gathered for a short while.
+static const int kRoutingPeriod = 5000; // ms
+static const int kTriggeredDelay = 50; // ms
+// a route not heard of for so long is taken as unreachable, i.e. its neighbour is dead.
+static const int kRouteTimeout = 3 * kRoutingPeriod; // ms
+// and it's advertised as unreachable for so long before it's forgotten.
+static const int kRouteGarbage = 2 * kRoutingPeriod; // ms
+
+// with dv_mutex_ held.
+static void _mark_changed(DistanceEntry *entry) {
+    entry->changed = true;
+    if (!triggered_) {
+        triggered_ = true;
+        trigger_at_us_ = get_time_us() + kTriggeredDelay * 1000LL;
+        dv_cond_.notify_one();
     }
-};
+}
 
-#include <unordered_set>
-static rustex::mutex<std::unordered_set<DistanceEntry, DEHash>> distance_vec_{};
+static void request_full_distance_upd() {
+    std::lock_guard<std::mutex> lock(dv_mutex_);
+    full_due_ = true;
+    dv_cond_.notify_one();
+}
 
-static std::string distance_vec_to_bytes() {
-    auto dv = distance_vec_.lock();
-    std::string bytes;
-    // the first 4 bytes is the number of entries.
-    int dcnt = get_dev_cnt();
-    uint32_t num = htonl((int)(dv->size() + dcnt));
-    bytes.append((char *)&num, sizeof(num));
+// bring the dynamic routing table in line with one distance vector entry.
+// with dv_mutex_ and routing_table_mtx_ held.
+static void _update_routing_entry(const DistanceEntry &entry) {
+    if (entry.hops >= kInfinity) {
+        dynamic_routing_table_.erase(entry.key());
+        logInfo("route to %s/%s is lost", 
+            inet_ntoa_safe(entry.ip).get(), inet_ntoa_safe(entry.mask).get());
+        return;
+    }
+    dynamic_routing_table_[entry.key()] = std::make_shared<RoutingEntry>(entry.ip, entry.mask, 
+        entry.updated_from, entry.recv_dev_id);
+    logInfo("route to %s/%s via %s, hops=%d", 
+        inet_ntoa_safe(entry.ip).get(), inet_ntoa_safe(entry.mask).get(), 
+        inet_ntoa_safe(entry.updated_from).get(), entry.hops);
+}
 
-    // then append all entries.
-    for (auto entry : *dv) {
-        bytes.append(entry.to_bytes());
+// the update for one device: either every entry, or the changed ones.
+// with split horizon and poison reverse: routes learned on the device go back as unreachable.
+// with dv_mutex_ held.
+static std::string _distance_upd_payload(int dev_id, bool full) {
+    std::string entries;
+    uint32_t num = 0;
+    for (auto &kv : distance_vec_) {
+        const DistanceEntry &entry = kv.second;
+        if (!full && !entry.changed)
+            continue;
+        entry.to_bytes(entries, entry.recv_dev_id == dev_id ? kInfinity : entry.hops);
+        num++;
+    }
+    if (full) {
+        // add scope links
+        int dcnt = get_dev_cnt();
+        for (int id = 0; id < dcnt; id++) {
+            DistanceEntry{*dev_ip(id), *dev_mask(id), 0}.to_bytes(entries, 0);
+            num++;
+        }
     }
+    if (num == 0)
+        return "";
+
+    // the source ip, the number of entries, then the entries.
+    std::string payload;
+    auto ip = dev_ip(dev_id);
+    payload.append((char *)&ip->s_addr, sizeof(ip->s_addr));
+    num = htonl(num);
+    payload.append((char *)&num, sizeof(num));
+    payload.append(entries);
+    return payload;
+}
 
-    // add scope links
+// with dv_mutex_ held.
+static void _send_distance_upd(bool full) {
+    int dcnt = get_dev_cnt();
     for (int id = 0; id < dcnt; id++) {
-        bytes.append(DistanceEntry{*dev_ip(id), *dev_mask(id), 0}.to_bytes());
+        std::string payload = _distance_upd_payload(id, full);
+        if (payload.empty())
+            continue;
+        if (send_frame(payload.data(), payload.size(), kRoutingProtocolCode, &kBroadcast, id) != 0) {
+            logError("fail to send routing upd to device %s", get_device_name(id));
+        }
     }
+    for (auto &kv : distance_vec_)
+        kv.second.changed = false;
+    triggered_ = false;
+}
 
-    return bytes;
+// time out the routes whose neighbour went silent, and forget the ones unreachable for long.
+// with dv_mutex_ held.
+static void _expire_routes() {
+    long long now = get_time_us();
+    bool updated = false;
+    for (auto it = distance_vec_.begin(); it != distance_vec_.end(); ) {
+        DistanceEntry &entry = it->second;
+        if (entry.hops < kInfinity && now - entry.heard_us > kRouteTimeout * 1000LL) {
+            logWarning("route to %s/%s times out, %s is silent", 
+                inet_ntoa_safe(entry.ip).get(), inet_ntoa_safe(entry.mask).get(), 
+                inet_ntoa_safe(entry.updated_from).get());
+            entry.hops = kInfinity;
+            entry.heard_us = now;
+            _mark_changed(&entry);
+            std::lock_guard<std::mutex> lock(routing_table_mtx_);
+            _update_routing_entry(entry);
+            updated = true;
+        } else if (entry.hops >= kInfinity && now - entry.heard_us > kRouteGarbage * 1000LL) {
+            it = distance_vec_.erase(it);
+            continue;
+        }
+        ++it;
+    }
+    if (updated) {
+        std::lock_guard<std::mutex> lock(routing_table_mtx_);
+        publish_routing_table();
+    }
 }
 
-// return -1 when error, 0 when success without upd, 1 when success with upd.
-static int resolve_distance_upd(const int recv_dev_id, const in_addr source, const std::string &bytes) {
+// merge a neighbour's distance vector into ours. return -1 when error, 0 when success.
+static int resolve_distance_upd(const int recv_dev_id, const in_addr source, const char *bytes, size_t len) {
     // parse the bytes.
     // the first 4 bytes is the number of entries.
     uint32_t num;
-    memcpy(&num, bytes.data(), sizeof(num));
+    if (len < sizeof(num)) {
+        logError("too short distance upd.");
+        return -1;
+    }
+    memcpy(&num, bytes, sizeof(num));
     num = ntohl(num);
 
     // check the length.
-    if (bytes.size() < sizeof(num) + num * DistanceEntry::kSizeOnwire) {
+    if ((len - sizeof(num)) / DistanceEntry::kSizeOnwire < num) {
         logError("too short distance upd.");
         return -1;
     }
 
-    auto dv = distance_vec_.lock_mut();
+    std::lock_guard<std::mutex> dv_lock(dv_mutex_);
+    long long now = get_time_us();
 
     // get every entry to update the current distance vector.
-    int updated = 0;
+    bool updated = false;
     for (int i = 0; i < (int)num; i++) {
-        DistanceEntry entry = 
-            DistanceEntry::from_bytes(
-                bytes.substr(sizeof(num) + i * DistanceEntry::kSizeOnwire, 
-                DistanceEntry::kSizeOnwire));
+        DistanceEntry entry = DistanceEntry::from_bytes(bytes + sizeof(num) + i * DistanceEntry::kSizeOnwire);
 
         // filter out scope link
         if (get_dev_from_subnet(entry.ip, entry.mask) != -1)
@@ -372,82 +495,58 @@ static int resolve_distance_upd(const int recv_dev_id, const in_addr source, con
 
         entry.updated_from = source;
         entry.recv_dev_id = recv_dev_id;
-        entry.hops++;
-
-        // check if the entry is in the distance vector.
-        auto it = dv->find(entry);
-        if (it == dv->end()) {
-            // it is not in the distance vector.
-            // add it.
-            dv->insert(entry);
-            updated = 1;
+        entry.hops = std::min(entry.hops + 1, kInfinity);
+        entry.heard_us = now;
+        entry.changed = false;
+
+        auto it = distance_vec_.find(entry.key());
+        if (it == distance_vec_.end()) {
+            // a new one. an unreachable one is no news.
+            if (entry.hops >= kInfinity)
+                continue;
+            it = distance_vec_.emplace(entry.key(), entry).first;
         } else {
-            // it is in the distance vector.
-            // check if the hops is smaller.
-            if (it->hops > entry.hops) {
-                // the hops is smaller.
-                // update it.
-                dv->erase(it);
-                dv->insert(entry);
-                updated = 1;
-            } else {
-                // the hops is not smaller.
-                // ignore it.
+            DistanceEntry &cur = it->second;
+            bool same_hop = cur.updated_from.s_addr == source.s_addr && cur.recv_dev_id == recv_dev_id;
+            if (same_hop && cur.hops == entry.hops) {
+                // a refresh. an unreachable one keeps its garbage timer.
+                if (cur.hops < kInfinity)
+                    cur.heard_us = now;
                 continue;
             }
+            // the current next hop is believed, even when it gets worse. others only when better.
+            if (!same_hop && entry.hops >= cur.hops)
+                continue;
+            cur = entry;
         }
-    }
-    return updated;
-}
 
-static 
-std::vector<std::shared_ptr<RoutingEntry>> generate_dynamic_routing_table_from_dv() {
-    std::vector<std::shared_ptr<RoutingEntry>> routing_table;
-    auto dv = distance_vec_.lock();
-
-    // print the distance vector
-    logDebug("distance vector:");
-    for (auto entry : *dv) {
-        logDebug("dest=%s, mask=%s, hops=%d, updated_from=%s", 
-            inet_ntoa_safe(entry.ip).get(), inet_ntoa_safe(entry.mask).get(), 
-            entry.hops, inet_ntoa_safe(entry.updated_from).get());
+        _mark_changed(&it->second);
+        std::lock_guard<std::mutex> lock(routing_table_mtx_);
+        _update_routing_entry(it->second);
+        updated = true;
     }
 
-    // for each entry in the distance vector, generate a routing entry.
-    for (auto entry : *dv) {
-        routing_table.push_back(std::make_shared<RoutingEntry>(entry.ip, entry.mask, 
-            entry.updated_from, get_dev_from_subnet(entry.updated_from, entry.mask)));
-    }
-
-    std::sort(routing_table.begin(), routing_table.end());
-
-    // print the routing table.
-    logDebug("dynamic routing table:");
-    for (auto entry : routing_table) {
-        logDebug("dest=%s, mask=%s, next_hop=%s, device=%s", 
-            inet_ntoa_safe(entry->dest).get(), inet_ntoa_safe(entry->mask).get(), 
-            inet_ntoa_safe(entry->next_hop).get(), get_device_name(entry->device_id));
+    if (updated) {
+        std::lock_guard<std::mutex> lock(routing_table_mtx_);
+        publish_routing_table();
     }
-    return routing_table;
+    return 0;
 }
 
 int distance_upd_handler(int dev_id, const char *payload, size_t payload_len) {
     struct in_addr from;
+    if (payload_len < sizeof(from)) {
+        logError("too short distance upd.");
+        return -1;
+    }
     memcpy(&from, payload, sizeof(from));
+    if (from.s_addr == dev_ip(dev_id)->s_addr) {
+        return 0; // our own
+    }
 
-    // construct a string from the buffer
-    std::string bytes(payload + sizeof(from), payload_len - sizeof(from));
-
-    int result = resolve_distance_upd(dev_id, from, bytes);
-
-    if (result < 0) {
+    if (resolve_distance_upd(dev_id, from, payload + sizeof(from), payload_len - sizeof(from)) < 0) {
         logError("fail to resolve routing update.");
         return -1;
-    } else if (result > 0) {
-        // update the routing table.
-        std::unique_lock<std::mutex> lock(routing_table_mtx_);
-        dynamic_routing_table_ = std::move(generate_dynamic_routing_table_from_dv());
-        logInfo("routing table updated.");
     }
     return 0;
 }
@@ -455,33 +554,27 @@ int distance_upd_handler(int dev_id, const char *payload, size_t payload_len) {
 
 #include <thread>
 
-static const int kRoutingPeriod = 1000; // ms
 int fire_distance_upd_daemon() {
     std::thread t = std::thread([]() {
-        // int upd_times = 10;
+        std::unique_lock<std::mutex> lock(dv_mutex_);
+        long long next_full_us = get_time_us();
         while (true) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(kRoutingPeriod));
-            // if (--upd_times == 0) {
-            //     // stop the thread.
-            //     return;
-            // }
-            // send distance upd to all neighbors.
-            // broadcast to all devices.
-            std::string dv_bytes = distance_vec_to_bytes();
-            
-            int dcnt = get_dev_cnt();
-            for (int id = 0; id < dcnt; id++) {
-                // send the distance upd.
-                
-                std::string payload;
-                auto ip = dev_ip(id);
-                payload.append((char *)&ip->s_addr, sizeof(ip->s_addr));
-                payload.append(dv_bytes);
-
-                if (send_frame(payload.data(), payload.size(), kRoutingProtocolCode, &kBroadcast, id) != 0) {
-                    logError("fail to send routing upd to device %s", get_device_name(id));
-                }
+            long long now = get_time_us();
+            if (now >= next_full_us || full_due_) {
+                // send the whole distance vector to all neighbours.
+                // broadcast to all devices.
+                _expire_routes();
+                _send_distance_upd(true);
+                next_full_us = now + kRoutingPeriod * 1000LL;
+                full_due_ = false;
+            } else if (triggered_ && now >= trigger_at_us_) {
+                // only the changes.
+                _send_distance_upd(false);
             }
+
+            long long wake_us = triggered_ ? std::min(next_full_us, trigger_at_us_) : next_full_us;
+            if (!full_due_)
+                dv_cond_.wait_for(lock, std::chrono::microseconds(std::max(wake_us - get_time_us(), 0LL)));
         }
     });
     
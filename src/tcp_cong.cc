@@ -0,0 +1,400 @@
+#include "tcp_cong.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+TcpCongestion::TcpCongestion(uint32_t mss) : mss_(mss), ssthresh_(UINT32_MAX) {
+    // the initial window, RFC 6928.
+    cwnd_ = std::min(10 * mss, std::max(2 * mss, 14600u));
+}
+
+bool TcpCongestion::cwnd_limited(const TcpAckSample &s) const {
+    // in slow start the window doubles every RTT, so half of it in flight is enough.
+    // otherwise it's full, but for the tail the sender keeps back to avoid tiny segments.
+    if (cwnd_ < ssthresh_)
+        return 2 * (uint64_t)s.prior_in_flight >= cwnd_;
+    return (uint64_t)s.prior_in_flight + 2 * mss_ >= cwnd_;
+}
+
+void TcpCongestion::set_mss(uint32_t mss) {
+    cwnd_ = std::min<uint64_t>(std::max<uint64_t>((uint64_t)cwnd_ * mss / mss_, mss), UINT32_MAX / 2);
+    if (ssthresh_ != UINT32_MAX)
+        ssthresh_ = std::min<uint64_t>(std::max<uint64_t>((uint64_t)ssthresh_ * mss / mss_, 2 * mss), UINT32_MAX / 2);
+    mss_ = mss;
+}
+
+uint32_t TcpCongestion::slow_start(uint32_t acked) {
+    if (cwnd_ >= ssthresh_)
+        return acked;
+    uint32_t grow = std::min(acked, ssthresh_ - cwnd_);
+    cwnd_ += grow;
+    return acked - grow;
+}
+
+// ====== NewReno ======
+
+class Reno : public TcpCongestion {
+    // bytes acked in congestion avoidance since cwnd last grew.
+    uint32_t acked_ = 0;
+
+    void _backoff(uint32_t in_flight) {
+        ssthresh_ = std::max(in_flight / 2, 2 * mss_);
+        acked_ = 0;
+    }
+
+public:
+    explicit Reno(uint32_t mss) : TcpCongestion(mss) {}
+
+    const char *name() const { return "reno"; }
+
+    void on_ack(const TcpAckSample &s) {
+        if (s.in_recovery || !cwnd_limited(s))
+            return;
+        uint32_t acked = slow_start(s.acked);
+        // one segment more per window acked.
+        acked_ += acked;
+        if (acked_ >= cwnd_) {
+            acked_ -= cwnd_;
+            cwnd_ += mss_;
+        }
+    }
+
+    void on_loss(uint32_t in_flight, uint64_t now) {
+        (void)now;
+        _backoff(in_flight);
+        cwnd_ = ssthresh_;
+    }
+
+    void on_rto(uint32_t in_flight, uint64_t now) {
+        (void)now;
+        _backoff(in_flight);
+        cwnd_ = mss_;
+    }
+};
+
+// ====== CUBIC ======
+
+class Cubic : public TcpCongestion {
+    // RFC 9438 4.5 and 4.6.
+    static constexpr double kC = 0.4;
+    static constexpr double kBeta = 0.7;
+
+    // in segments.
+    double w_max_ = 0;      // the window at the last loss
+    double w_last_max_ = 0; // and at the one before, for fast convergence
+    double w_est_ = 0;      // what Reno would have by now
+    // in seconds, how long the window takes to get back to w_max_.
+    double k_ = 0;
+    // the start of the current congestion avoidance, 0 if not started.
+    uint64_t epoch_ = 0;
+    uint32_t min_rtt_ = 0;
+
+    void _backoff() {
+        double w = (double)cwnd_ / mss_;
+        // the last loss came before the window reached the one before: others are
+        // taking over the path. give up some more.
+        w_max_ = w < w_last_max_ ? w * (1 + kBeta) / 2 : w;
+        w_last_max_ = w;
+        ssthresh_ = std::max<uint32_t>(cwnd_ * kBeta, 2 * mss_);
+        epoch_ = 0;
+    }
+
+public:
+    explicit Cubic(uint32_t mss) : TcpCongestion(mss) {}
+
+    const char *name() const { return "cubic"; }
+
+    void on_ack(const TcpAckSample &s) {
+        if (s.rtt > 0 && (min_rtt_ == 0 || s.rtt < min_rtt_))
+            min_rtt_ = s.rtt;
+        if (s.in_recovery || !cwnd_limited(s))
+            return;
+        uint32_t acked = slow_start(s.acked);
+        if (acked == 0)
+            return;
+
+        double w = (double)cwnd_ / mss_;
+        if (epoch_ == 0) {
+            epoch_ = s.now;
+            if (w_max_ <= w) {
+                k_ = 0;
+                w_max_ = w;
+            } else {
+                k_ = cbrt((w_max_ - w) / kC);
+            }
+            w_est_ = w;
+        }
+
+        // where the cubic function is one RTT later, but at most 1.5 times the window.
+        double t = (double)(s.now - epoch_ + min_rtt_) / 1e6;
+        double target = kC * (t - k_) * (t - k_) * (t - k_) + w_max_;
+        target = std::max(w, std::min(target, 1.5 * w));
+
+        // never slower than Reno.
+        double segs = (double)acked / mss_;
+        w_est_ += 3 * (1 - kBeta) / (1 + kBeta) * segs / w;
+        target = std::max(target, w_est_);
+
+        w += (target - w) / w * segs;
+        cwnd_ = std::min<double>(w * mss_, UINT32_MAX / 2);
+    }
+
+    void on_loss(uint32_t in_flight, uint64_t now) {
+        (void)in_flight;
+        (void)now;
+        _backoff();
+        cwnd_ = ssthresh_;
+    }
+
+    void on_rto(uint32_t in_flight, uint64_t now) {
+        (void)in_flight;
+        (void)now;
+        _backoff();
+        cwnd_ = mss_;
+    }
+};
+
+// ====== BBR, simplified ======
+
+class BbrLite : public TcpCongestion {
+    enum Mode { STARTUP, DRAIN, PROBE_BW, PROBE_RTT };
+
+    // 2 / ln(2), the smallest gain that doubles the rate every round.
+    static constexpr double kHighGain = 2.885;
+    static constexpr double kCwndGain = 2;
+    // the gains of PROBE_BW, a phase per min RTT: probe, drain what the probe queued, cruise.
+    static constexpr double kCycleGains[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+    static constexpr int kCycleLen = 8;
+    // the max delivery rate is of the last kBwRounds rounds.
+    static constexpr int kBwRounds = 10;
+    static constexpr uint64_t kMinRttWindow = 10000000;
+    static constexpr uint64_t kProbeRttTime = 200000;
+    // the round length before the first RTT sample.
+    static constexpr uint32_t kDefaultRtt = 1000;
+
+    Mode mode_ = STARTUP;
+    double pacing_gain_ = kHighGain;
+    double cwnd_gain_ = kHighGain;
+
+    // the delivery rate of each of the last rounds. a round lasts a min RTT.
+    uint64_t bw_rounds_[kBwRounds] = {};
+    uint64_t round_count_ = 0;
+    uint64_t round_start_ = 0;
+    uint64_t round_delivered_ = 0;
+
+    uint32_t min_rtt_ = 0;
+    uint64_t min_rtt_stamp_ = 0;
+
+    // STARTUP ends once the rate has not grown by 25% for 3 rounds.
+    uint64_t full_bw_ = 0;
+    int full_bw_rounds_ = 0;
+    bool filled_pipe_ = false;
+
+    int cycle_index_ = 0;
+    uint64_t cycle_start_ = 0;
+
+    // when PROBE_RTT may end, 0 until the flight has drained to its window.
+    uint64_t probe_rtt_done_ = 0;
+    uint32_t prior_cwnd_ = 0;
+
+    uint64_t _bw() const {
+        return *std::max_element(bw_rounds_, bw_rounds_ + kBwRounds);
+    }
+
+    // the bandwidth-delay product times `gain`. 0 while there is no model yet.
+    uint64_t _bdp(double gain) const {
+        return (uint64_t)(_bw() * min_rtt_ / 1e6 * gain);
+    }
+
+    void _enter_probe_bw(uint64_t now) {
+        mode_ = PROBE_BW;
+        cwnd_gain_ = kCwndGain;
+        // start anywhere but in the drain phase.
+        cycle_index_ = rand() % (kCycleLen - 1);
+        if (cycle_index_ >= 1)
+            cycle_index_++;
+        cycle_start_ = now;
+        pacing_gain_ = kCycleGains[cycle_index_];
+    }
+
+    void _on_round() {
+        if (filled_pipe_)
+            return;
+        uint64_t bw = _bw();
+        if (bw >= full_bw_ + full_bw_ / 4) {
+            full_bw_ = bw;
+            full_bw_rounds_ = 0;
+        } else if (++full_bw_rounds_ >= 3) {
+            filled_pipe_ = true;
+            mode_ = DRAIN;
+            // empty the queue STARTUP has built.
+            pacing_gain_ = 1 / kHighGain;
+            cwnd_gain_ = kHighGain;
+            logDebug("bbr: pipe filled, bw=%" PRIu64 " B/s, min_rtt=%u us", bw, min_rtt_);
+        }
+    }
+
+    void _update_mode(const TcpAckSample &s) {
+        uint32_t rtt = min_rtt_ ? min_rtt_ : kDefaultRtt;
+        switch (mode_) {
+            case DRAIN:
+                if (s.in_flight <= _bdp(1))
+                    _enter_probe_bw(s.now);
+                break;
+
+            case PROBE_BW: {
+                bool full_length = s.now - cycle_start_ >= rtt;
+                bool next = pacing_gain_ < 1 ? full_length || s.in_flight <= _bdp(1) : full_length;
+                if (next) {
+                    cycle_index_ = (cycle_index_ + 1) % kCycleLen;
+                    cycle_start_ = s.now;
+                    pacing_gain_ = kCycleGains[cycle_index_];
+                }
+                break;
+            }
+
+            case PROBE_RTT:
+                // hold a small window for a while, so that the queue drains and the RTT shows.
+                if (probe_rtt_done_ == 0 && s.in_flight <= 4 * mss_) {
+                    probe_rtt_done_ = s.now + std::max<uint64_t>(kProbeRttTime, rtt);
+                } else if (probe_rtt_done_ != 0 && s.now >= probe_rtt_done_) {
+                    min_rtt_stamp_ = s.now;
+                    cwnd_ = std::max(cwnd_, prior_cwnd_);
+                    if (filled_pipe_) {
+                        _enter_probe_bw(s.now);
+                    } else {
+                        mode_ = STARTUP;
+                        pacing_gain_ = cwnd_gain_ = kHighGain;
+                    }
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    void _update_pacing_rate() {
+        uint64_t bw = _bw();
+        if (bw == 0) {
+            // no model yet: the window per RTT.
+            bw = (uint64_t)cwnd_ * 1000000 / (min_rtt_ ? min_rtt_ : kDefaultRtt);
+        }
+        uint64_t rate = bw * pacing_gain_;
+        // STARTUP never slows down, as a round may be short of acks.
+        pacing_rate_ = mode_ == STARTUP ? std::max(pacing_rate_, rate) : rate;
+    }
+
+public:
+    explicit BbrLite(uint32_t mss) : TcpCongestion(mss) {
+        _update_pacing_rate();
+    }
+
+    const char *name() const { return "bbr"; }
+
+    void on_ack(const TcpAckSample &s) {
+        // the min RTT, and whether it's time to probe it again.
+        bool expired = min_rtt_ != 0 && s.now > min_rtt_stamp_ + kMinRttWindow;
+        if (s.rtt > 0 && (min_rtt_ == 0 || s.rtt <= min_rtt_ || expired)) {
+            min_rtt_ = s.rtt;
+            min_rtt_stamp_ = s.now;
+        }
+        if (expired && mode_ != PROBE_RTT) {
+            mode_ = PROBE_RTT;
+            pacing_gain_ = cwnd_gain_ = 1;
+            prior_cwnd_ = cwnd_;
+            probe_rtt_done_ = 0;
+        }
+
+        // the delivery rate of a round.
+        round_delivered_ += s.acked;
+        if (round_start_ == 0) {
+            round_start_ = s.now;
+            round_delivered_ = 0;
+        } else if (s.now - round_start_ >= (min_rtt_ ? min_rtt_ : kDefaultRtt)) {
+            bw_rounds_[round_count_ % kBwRounds] = round_delivered_ * 1000000 / (s.now - round_start_);
+            round_count_++;
+            round_start_ = s.now;
+            round_delivered_ = 0;
+            _on_round();
+        }
+
+        _update_mode(s);
+        _update_pacing_rate();
+
+        if (mode_ == PROBE_RTT) {
+            cwnd_ = std::min(cwnd_, 4 * mss_);
+            return;
+        }
+        uint64_t target = std::max<uint64_t>(_bdp(cwnd_gain_), 4 * mss_);
+        uint64_t cwnd = (uint64_t)cwnd_ + s.acked;
+        if (filled_pipe_)
+            cwnd = std::min(cwnd, target);
+        else if (!cwnd_limited(s))
+            cwnd = cwnd_;
+        cwnd_ = std::min<uint64_t>(cwnd, UINT32_MAX / 2);
+    }
+
+    // a loss alone says nothing about the path in the model.
+    void on_loss(uint32_t in_flight, uint64_t now) {
+        (void)in_flight;
+        (void)now;
+    }
+
+    void on_rto(uint32_t in_flight, uint64_t now) {
+        (void)in_flight;
+        (void)now;
+        // start over from one segment. the acks bring it back to the target quickly.
+        cwnd_ = mss_;
+    }
+};
+
+// ====== the registry ======
+
+struct TcpCongAlgo {
+    const char *name;
+    TcpCongestion *(*create)(uint32_t mss);
+};
+
+static const TcpCongAlgo algos[] = {
+    {"reno", [](uint32_t mss) -> TcpCongestion * { return new Reno(mss); }},
+    {"cubic", [](uint32_t mss) -> TcpCongestion * { return new Cubic(mss); }},
+    {"bbr", [](uint32_t mss) -> TcpCongestion * { return new BbrLite(mss); }},
+};
+
+static const TcpCongAlgo *_find_algo(const char *name) {
+    for (const auto &algo : algos) {
+        if (strcmp(algo.name, name) == 0)
+            return &algo;
+    }
+    return nullptr;
+}
+
+TcpCongestion *tcp_cong_create(const char *name, uint32_t mss) {
+    const TcpCongAlgo *algo = _find_algo(name);
+    return algo != nullptr ? algo->create(mss) : nullptr;
+}
+
+bool tcp_cong_available(const char *name) {
+    return _find_algo(name) != nullptr;
+}
+
+const char *tcp_cong_default() {
+    static const char *name = []() {
+        const char *env = getenv("PNX_TCP_CONGESTION");
+        if (env == nullptr)
+            return kTcpDefaultCongestion;
+        const TcpCongAlgo *algo = _find_algo(env);
+        if (algo == nullptr) {
+            logWarning("unknown tcp congestion control %s, use %s", env, kTcpDefaultCongestion);
+            return kTcpDefaultCongestion;
+        }
+        logInfo("tcp congestion control: %s", algo->name);
+        return algo->name;
+    }();
+    return name;
+}
@@ -0,0 +1,126 @@
+#include "tcp_reass.h"
+
+#include <iterator>
+
+size_t TcpReassQueue::insert(uint32_t seq, const char *data, size_t len) {
+    if (len == 0)
+        return 0;
+    uint32_t end = seq + len;
+
+    // cut off the head covered by the previous interval.
+    auto it = segs_.upper_bound(seq);
+    if (it != segs_.begin()) {
+        auto prev = std::prev(it);
+        uint32_t prev_end = prev->first + prev->second.size();
+        if (seq_geq(prev_end, end))
+            return 0; // nothing new
+        if (seq_gt(prev_end, seq)) {
+            size_t skip = prev_end - seq;
+            seq += skip;
+            data += skip;
+            len -= skip;
+        }
+    }
+
+    // drop the following intervals covered by the new one, and cut off the tail covered by the rest.
+    while (it != segs_.end() && seq_lt(it->first, end)) {
+        uint32_t it_end = it->first + it->second.size();
+        if (seq_gt(it_end, end)) {
+            len = it->first - seq;
+            end = it->first;
+            break;
+        }
+        bytes_ -= it->second.size();
+        it = segs_.erase(it);
+    }
+
+    if (len == 0)
+        return 0;
+
+    segs_.emplace_hint(it, seq, std::vector<char>(data, data + len));
+    bytes_ += len;
+    return len;
+}
+
+void TcpReassQueue::set_fin(uint32_t seq) {
+    has_fin_ = true;
+    fin_seq_ = seq;
+}
+
+size_t TcpReassQueue::deliver(uint32_t next, const std::function<size_t(const char*, size_t)>& sink, bool *fin) {
+    size_t total = 0;
+
+    while (!segs_.empty()) {
+        auto it = segs_.begin();
+        if (seq_gt(it->first, next))
+            break; // a gap
+
+        std::vector<char> &data = it->second;
+        uint32_t it_end = it->first + data.size();
+        if (seq_leq(it_end, next)) {
+            // received in order in the meantime.
+            bytes_ -= data.size();
+            segs_.erase(it);
+            continue;
+        }
+
+        size_t offset = next - it->first;
+        size_t avail = data.size() - offset;
+        size_t taken = sink(data.data() + offset, avail);
+        next += taken;
+        total += taken;
+
+        if (taken < avail) {
+            // keep the rest, keyed by its new start.
+            std::vector<char> rest(data.begin() + offset + taken, data.end());
+            bytes_ -= data.size() - rest.size();
+            segs_.erase(it);
+            segs_.emplace(next, std::move(rest));
+            break;
+        }
+        bytes_ -= data.size();
+        segs_.erase(it);
+    }
+
+    if (fin != nullptr)
+        *fin = has_fin_ && fin_seq_ == next;
+    return total;
+}
+
+void TcpReassQueue::clear() {
+    segs_.clear();
+    bytes_ = 0;
+    has_fin_ = false;
+}
+
+size_t TcpReassQueue::sack_blocks(uint32_t next, uint32_t recent, TcpSackBlock *blocks, size_t max) const {
+    if (max == 0)
+        return 0;
+
+    // the intervals beyond `next`, merged where they touch.
+    std::vector<TcpSackBlock> ranges;
+    for (const auto &seg : segs_) {
+        uint32_t start = seq_max(seg.first, next);
+        uint32_t end = seg.first + seg.second.size();
+        if (seq_leq(end, next))
+            continue;
+        if (!ranges.empty() && ranges.back().end == start)
+            ranges.back().end = end;
+        else
+            ranges.push_back({start, end});
+    }
+
+    size_t n = 0, first = ranges.size();
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (seq_geq(recent, ranges[i].start) && seq_lt(recent, ranges[i].end)) {
+            blocks[n++] = ranges[i];
+            first = i;
+            break;
+        }
+    }
+    for (size_t i = 0; i < ranges.size() && n < max; i++) {
+        if (i != first)
+            blocks[n++] = ranges[i];
+    }
+    return n;
+}
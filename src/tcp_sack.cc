@@ -0,0 +1,80 @@
+#include "tcp_sack.h"
+
+#include <iterator>
+
+size_t TcpSackScoreboard::insert(uint32_t start, uint32_t end) {
+    if (seq_geq(start, end))
+        return 0;
+    size_t before = bytes_;
+
+    // join the previous range if it reaches the new one.
+    auto it = ranges_.upper_bound(start);
+    if (it != ranges_.begin()) {
+        auto prev = std::prev(it);
+        if (seq_geq(prev->second, start)) {
+            if (seq_geq(prev->second, end))
+                return 0; // nothing new
+            start = prev->first;
+            bytes_ -= prev->second - prev->first;
+            ranges_.erase(prev);
+        }
+    }
+
+    // and swallow the following ones it reaches.
+    while (it != ranges_.end() && seq_leq(it->first, end)) {
+        end = seq_max(end, it->second);
+        bytes_ -= it->second - it->first;
+        it = ranges_.erase(it);
+    }
+
+    ranges_.emplace_hint(it, start, end);
+    bytes_ += end - start;
+    return bytes_ - before;
+}
+
+void TcpSackScoreboard::advance(uint32_t una) {
+    while (!ranges_.empty()) {
+        auto it = ranges_.begin();
+        if (seq_geq(it->first, una))
+            break;
+        uint32_t end = it->second;
+        bytes_ -= end - it->first;
+        ranges_.erase(it);
+        if (seq_gt(end, una)) {
+            // acked partially. keep the rest.
+            ranges_.emplace(una, end);
+            bytes_ += end - una;
+            break;
+        }
+    }
+}
+
+void TcpSackScoreboard::clear() {
+    ranges_.clear();
+    bytes_ = 0;
+}
+
+size_t TcpSackScoreboard::bytes_below(uint32_t seq) const {
+    size_t total = 0;
+    for (auto it = ranges_.begin(); it != ranges_.end() && seq_lt(it->first, seq); ++it)
+        total += seq_min(it->second, seq) - it->first;
+    return total;
+}
+
+uint32_t TcpSackScoreboard::next_unsacked(uint32_t seq) const {
+    auto it = ranges_.upper_bound(seq);
+    if (it != ranges_.begin()) {
+        auto prev = std::prev(it);
+        // ranges never touch, so its end is not sacked.
+        if (seq_gt(prev->second, seq))
+            return prev->second;
+    }
+    return seq;
+}
+
+uint32_t TcpSackScoreboard::next_sacked(uint32_t seq, uint32_t limit) const {
+    auto it = ranges_.upper_bound(seq);
+    if (it != ranges_.end() && seq_lt(it->first, limit))
+        return it->first;
+    return limit;
+}
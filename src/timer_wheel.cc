@@ -0,0 +1,242 @@
+#include "timer_wheel.h"
+
+#include <mutex>
+#include <cinttypes>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <cassert>
+
+#include "logger.h"
+#include "pnx_utils.h"
+#include "gracefully_shutdown.h"
+
+static const uint64_t kSlotMask = kTimerSlots - 1;
+static const uint64_t kWheelRange = 1ULL << (kTimerLevels * kTimerSlotBits);
+
+static void list_init(TimerListNode *head) {
+    head->prev = head->next = head;
+}
+
+static void list_add_tail(TimerListNode *head, TimerListNode *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static bool list_empty(const TimerListNode *head) {
+    return head->next == head;
+}
+
+TimerWheel::TimerWheel(uint64_t now_tick) : current_(now_tick), pending_count_(0) {
+    for (int level = 0; level < kTimerLevels; level++)
+        for (int i = 0; i < kTimerSlots; i++)
+            list_init(&slots_[level][i]);
+}
+
+void TimerWheel::unlink(TimerListNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+}
+
+void TimerWheel::link(Timer *t) {
+    if ((int64_t)(t->expires - current_) < 0) {
+        // already due. fire it on the very next tick.
+        t->expires = current_;
+    }
+
+    uint64_t delta = t->expires - current_;
+    if (delta >= kWheelRange) {
+        logWarning("timer wheel: delay of %" PRIu64 " ticks is clamped", delta);
+        t->expires = current_ + kWheelRange - 1;
+        delta = kWheelRange - 1;
+    }
+
+    // find the lowest level that covers delta.
+    int level = 0;
+    while (delta >= (1ULL << ((level + 1) * kTimerSlotBits)))
+        level++;
+
+    int slot = (t->expires >> (level * kTimerSlotBits)) & kSlotMask;
+    list_add_tail(&slots_[level][slot], t);
+}
+
+void TimerWheel::schedule(Timer *t, uint64_t expires) {
+    cancel(t);
+    t->expires = expires;
+    link(t);
+    pending_count_++;
+}
+
+bool TimerWheel::cancel(Timer *t) {
+    if (!t->pending())
+        return false;
+    unlink(t);
+    pending_count_--;
+    return true;
+}
+
+int TimerWheel::cascade(int level) {
+    int slot = (current_ >> (level * kTimerSlotBits)) & kSlotMask;
+
+    // detach the whole slot first, since re-linking may append to lower levels only.
+    TimerListNode *head = &slots_[level][slot];
+    TimerListNode *node = head->next;
+    list_init(head);
+
+    while (node != head) {
+        TimerListNode *next = node->next;
+        link(static_cast<Timer*>(node));
+        node = next;
+    }
+    return slot;
+}
+
+size_t TimerWheel::advance(uint64_t now_tick, TimerListNode *expired) {
+    size_t cnt = 0;
+    if (pending_count_ == 0) {
+        // nothing to fire. skip the idle period at once.
+        if ((int64_t)(now_tick - current_) >= 0)
+            current_ = now_tick + 1;
+        return 0;
+    }
+
+    while ((int64_t)(now_tick - current_) >= 0) {
+        int index = current_ & kSlotMask;
+
+        // the lower level wraps, pull the next round down from the upper levels.
+        for (int level = 1; index == 0 && level < kTimerLevels; level++)
+            index = cascade(level);
+
+        TimerListNode *head = &slots_[0][current_ & kSlotMask];
+        while (!list_empty(head)) {
+            TimerListNode *node = head->next;
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            list_add_tail(expired, node);
+            cnt++;
+        }
+        current_++;
+    }
+    return cnt;
+}
+
+uint64_t TimerWheel::next_busy_tick() const {
+    // look for work in level 0 until it wraps. at the wrapping tick the upper levels
+    // are cascaded, so we must wake up there anyway.
+    uint64_t tick = current_;
+    do {
+        if (!list_empty(&slots_[0][tick & kSlotMask]))
+            return tick;
+        tick++;
+    } while ((tick & kSlotMask) != 0);
+    return tick;
+}
+
+void TimerWheel::reset(uint64_t now_tick) {
+    assert(pending_count_ == 0);
+    current_ = now_tick;
+}
+
+
+// ====== the global timer service ======
+
+static std::mutex service_mutex_;
+static std::condition_variable service_cv_;   // wakes up the timer thread
+static std::condition_variable callback_done_cv_;
+static TimerWheel *wheel_ = nullptr;
+static Timer *running_ = nullptr;
+static bool service_stop_ = false;
+static std::thread service_thread_;
+
+static uint64_t now_tick() {
+    return (uint64_t)get_time_us() / kTimerTickUs;
+}
+
+static void timer_thread_go() {
+    std::unique_lock<std::mutex> lock(service_mutex_);
+    TimerListNode expired;
+    list_init(&expired);
+
+    while (!service_stop_) {
+        if (wheel_->pending_count() == 0) {
+            service_cv_.wait(lock);
+            continue;
+        }
+
+        uint64_t now = now_tick();
+        uint64_t busy = wheel_->next_busy_tick();
+        if ((int64_t)(busy - now) > 0) {
+            service_cv_.wait_for(lock, std::chrono::microseconds((busy - now) * kTimerTickUs));
+            continue;
+        }
+
+        wheel_->advance(now, &expired);
+
+        while (!list_empty(&expired)) {
+            Timer *t = static_cast<Timer*>(expired.next);
+            // taking it off the expired list makes it non-pending.
+            wheel_->cancel(t);
+
+            running_ = t;
+            lock.unlock();
+            t->callback();
+            lock.lock();
+            running_ = nullptr;
+            callback_done_cv_.notify_all();
+        }
+    }
+}
+
+static void timer_service_init() {
+    static std::once_flag flag;
+    std::call_once(flag, []() {
+        wheel_ = new TimerWheel(now_tick());
+        service_thread_ = std::thread(timer_thread_go);
+
+        add_exit_clean_up([]() {
+            {
+                std::lock_guard<std::mutex> lock(service_mutex_);
+                service_stop_ = true;
+            }
+            service_cv_.notify_all();
+            service_thread_.join();
+        }, EXIT_CLEAN_UP_PRIORITY_TIMER);
+    });
+}
+
+void timer_schedule(Timer *timer, uint64_t delay_us) {
+    timer_service_init();
+
+    std::lock_guard<std::mutex> lock(service_mutex_);
+    uint64_t now = now_tick();
+    if (wheel_->pending_count() == 0)
+        wheel_->reset(now);
+
+    // round up, a timer never fires early.
+    uint64_t expires = now + (delay_us + kTimerTickUs - 1) / kTimerTickUs;
+    wheel_->schedule(timer, expires);
+    service_cv_.notify_one();
+}
+
+bool timer_cancel(Timer *timer) {
+    timer_service_init();
+
+    std::lock_guard<std::mutex> lock(service_mutex_);
+    return wheel_->cancel(timer);
+}
+
+void timer_cancel_sync(Timer *timer) {
+    timer_service_init();
+
+    std::unique_lock<std::mutex> lock(service_mutex_);
+    while (true) {
+        // the callback may re-arm itself, so cancel again after each wait.
+        wheel_->cancel(timer);
+        if (running_ != timer)
+            return;
+        callback_done_cv_.wait(lock);
+    }
+}
@@ -83,13 +83,14 @@ int main(int argc, char **args) {
         sleep(5);
         while (1) {
             long long time = get_time_us();
-            std::shared_ptr<char[]> msg = std::make_shared<char[]>(1024);
-            sprintf(msg.get(), 
+            PacketPtr msg = packet_alloc();
+            int len = sprintf(msg->tail(), 
 "%lld hello world! iampadding iampadding iampadding \
 iampadding iampadding iampadding iampadding iampadding iampadding", 
             time);
+            msg->append(len);
 
-            ip_send_packet(*dev_ip(0), ip, IPPROTO_TCP, msg, strlen(msg.get()));
+            ip_send_packet(*dev_ip(0), ip, IPPROTO_TCP, std::move(msg));
             sleep(1);
         }
     }
@@ -0,0 +1,78 @@
+#include "packet_buf.h"
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+
+int main() {
+    // headers are prepended in front of the data, in the same buffer.
+    {
+        PacketPtr pkt = packet_alloc();
+        assert(pkt->len == 0 && pkt->headroom() == kPacketHeadroom);
+        memcpy(pkt->append(5), "hello", 5);
+        memcpy(pkt->prepend(3), "ip:", 3);
+        memcpy(pkt->prepend(4), "eth:", 4);
+        assert(pkt->len == 12 && memcmp(pkt->data(), "eth:ip:hello", 12) == 0);
+        assert(pkt->headroom() + pkt->len + pkt->tailroom() == PacketBuf::kRoom);
+        pkt->trim(5);
+        assert(pkt->len == 7);
+    }
+
+    // buffers are reused, not created again.
+    {
+        size_t before = packet_pool_size();
+        for (int i = 0; i < 100000; i++) {
+            std::vector<PacketPtr> held;
+            for (int k = 0; k < 10; k++)
+                held.push_back(packet_alloc());
+        }
+        assert(packet_pool_size() == before);
+    }
+
+    // allocated by one thread and freed by another, like TCP and the sender.
+    {
+        const int kPackets = 200000;
+        std::mutex m;
+        std::condition_variable cv;
+        std::deque<PacketPtr> q;
+        bool done = false;
+
+        std::thread consumer([&]() {
+            int seen = 0;
+            while (true) {
+                std::unique_lock<std::mutex> l(m);
+                cv.wait(l, [&]() { return !q.empty() || done; });
+                if (q.empty()) break;
+                PacketPtr pkt = std::move(q.front());
+                q.pop_front();
+                cv.notify_all();
+                l.unlock();
+                assert(pkt->len == sizeof(int) && *(int*)pkt->data() == seen);
+                seen++;
+            }
+            assert(seen == kPackets);
+        });
+
+        for (int i = 0; i < kPackets; i++) {
+            PacketPtr pkt = packet_alloc();
+            memcpy(pkt->append(sizeof(int)), &i, sizeof(int));
+            std::unique_lock<std::mutex> l(m);
+            // keep a bounded number in flight, so the pool must recycle through the depot.
+            cv.wait(l, [&]() { return q.size() < 256; });
+            q.push_back(std::move(pkt));
+            cv.notify_all();
+        }
+        {
+            std::lock_guard<std::mutex> l(m);
+            done = true;
+            cv.notify_all();
+        }
+        consumer.join();
+        assert(packet_pool_size() < 1024);
+    }
+    return 0;
+}
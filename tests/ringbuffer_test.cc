@@ -1,6 +1,9 @@
 #include "ringbuffer.h"
 
 #include <cassert>
+#include <cstdlib>
+#include <thread>
+#include <vector>
 
 int main() {
     RingBuffer<int, 1023> rb;
@@ -24,5 +27,95 @@ int main() {
             assert(buf2[i] == ++getcnt);
         }
     }
-}
 
+    // a growable buffer under a shared budget.
+    {
+        MemBudget budget(100000);
+        {
+            DynamicRingBuffer<char> a(60000, &budget), b(60000, &budget);
+            assert(budget.used == 0 && a.capacity() == 0);
+
+            DynamicRingBuffer<char> *bufs[2] = {&a, &b};
+            char in[2] = {0, 0}, out[2] = {0, 0};
+            char tmp[5000];
+            for (int _ = 0; _ < 4000; _++) {
+                int k = rand() % 2;
+                DynamicRingBuffer<char> &rb = *bufs[k];
+
+                // push a byte stream. it may stop short, but never exceeds the budget beyond the first pages.
+                size_t n = rand() % 5000;
+                for (size_t i = 0; i < n; i++) tmp[i] = in[k] + i;
+                size_t pushed = rb.push(tmp, n);
+                assert(pushed <= n && rb.size() <= rb.limit());
+                in[k] += pushed;
+                assert(budget.used <= 100000 + 2 * 4096);
+
+                size_t m = std::min<size_t>(rand() % 5000, rb.size());
+                assert(rb.peek(0, tmp, m) == m);
+                assert(rb.pop(tmp, m));
+                for (size_t i = 0; i < m; i++) assert(tmp[i] == (char)(out[k] + i));
+                out[k] += m;
+            }
+            assert(a.capacity() <= 60000 && b.capacity() <= 60000);
+        }
+        // everything is given back.
+        assert(budget.used == 0);
+    }
+
+    // many producers and one consumer. each producer's elements come out in its order.
+    {
+        const int kProducers = 4, kPerProducer = 200000;
+        MpscRing<long, 64> ring;
+
+        std::vector<std::thread> producers;
+        for (int p = 0; p < kProducers; p++) {
+            producers.emplace_back([&ring, p]() {
+                for (long i = 0; i < kPerProducer; i++) {
+                    long v = (long)p * kPerProducer + i;
+                    while (!ring.push(std::move(v)))
+                        std::this_thread::yield();
+                }
+            });
+        }
+
+        std::vector<long> next(kProducers, 0);
+        long got = 0, batch[16];
+        while (got < (long)kProducers * kPerProducer) {
+            size_t n = ring.pop(batch, 16);
+            if (n == 0)
+                std::this_thread::yield();
+            for (size_t i = 0; i < n; i++) {
+                int p = batch[i] / kPerProducer;
+                assert(batch[i] % kPerProducer == next[p]);
+                next[p]++;
+            }
+            got += n;
+        }
+        for (auto &t : producers) t.join();
+        assert(ring.empty());
+    }
+
+    // one producer and one consumer.
+    {
+        const long kTotal = 500000;
+        SpscRing<long, 128> ring;
+        std::thread producer([&ring]() {
+            for (long i = 0; i < kTotal; i++) {
+                long v = i;
+                while (!ring.push(std::move(v)))
+                    std::this_thread::yield();
+            }
+        });
+
+        long next = 0, batch[32];
+        while (next < kTotal) {
+            size_t n = ring.pop(batch, 32);
+            if (n == 0)
+                std::this_thread::yield();
+            for (size_t i = 0; i < n; i++)
+                assert(batch[i] == next++);
+        }
+        producer.join();
+        assert(ring.empty());
+    }
+}
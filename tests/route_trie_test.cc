@@ -0,0 +1,91 @@
+#include "route_trie.h"
+
+#include <cassert>
+#include <vector>
+#include <cstdlib>
+#include <arpa/inet.h>
+
+static in_addr _addr(uint32_t host) {
+    in_addr a;
+    a.s_addr = htonl(host);
+    return a;
+}
+
+static in_addr _mask(int len) {
+    return _addr(len == 0 ? 0 : ~0u << (32 - len));
+}
+
+// the longest prefix by a linear scan. the last route wins among equal prefixes.
+static int _brute(const std::vector<RouteTrie::Route> &routes, in_addr dest) {
+    int best = -1, best_len = -1;
+    for (size_t i = 0; i < routes.size(); i++) {
+        int len = __builtin_popcount(routes[i].mask.s_addr);
+        if ((dest.s_addr & routes[i].mask.s_addr) == (routes[i].dest.s_addr & routes[i].mask.s_addr)
+            && len >= best_len) {
+            best = i;
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+int main() {
+    // the usual shapes: a default route, a subnet, a host route inside it.
+    {
+        std::vector<RouteTrie::Route> routes = {
+            {_addr(0), _mask(0), {0, _addr(0x0a000001), false}},
+            {_addr(0x0a640100), _mask(24), {1, _addr(0), true}},
+            {_addr(0x0a640105), _mask(32), {2, _addr(0x0a640101), false}},
+            {_addr(0x0a640000), _mask(16), {3, _addr(0x0a640001), false}},
+        };
+        RouteTrie trie(routes);
+        assert(trie.lookup(_addr(0x08080808))->device_id == 0);
+        assert(trie.lookup(_addr(0x0a640102))->device_id == 1);
+        assert(trie.lookup(_addr(0x0a640105))->device_id == 2);
+        assert(trie.lookup(_addr(0x0a640205))->device_id == 3);
+        assert(RouteTrie({}).lookup(_addr(0x0a640102)) == nullptr);
+    }
+
+    // random tables against a linear scan, clustered so that prefixes nest.
+    for (int round = 0; round < 10; round++) {
+        std::vector<RouteTrie::Route> routes;
+        int n = 1 + rand() % 2000;
+        for (int i = 0; i < n; i++) {
+            int len = rand() % 33;
+            uint32_t dest = (0x0a000000 | (rand() & 0x00ffffff)) & (rand() % 4 ? 0xffff0fff : ~0u);
+            routes.push_back({_addr(dest), _mask(len), {i, _addr(dest + 1), false}});
+        }
+        RouteTrie trie(routes);
+        assert(trie.routes() == routes.size());
+
+        for (int k = 0; k < 5000; k++) {
+            const RouteTrie::Route &r = routes[rand() % n];
+            // near a route, or anywhere.
+            in_addr dest = rand() % 2 ? _addr(ntohl(r.dest.s_addr) ^ (rand() & 0x3ff)) : _addr(rand());
+            int want = _brute(routes, dest);
+            const RouteNextHop *hop = trie.lookup(dest);
+            if (want == -1) {
+                assert(hop == nullptr);
+            } else {
+                assert(hop != nullptr && hop->device_id == routes[want].hop.device_id);
+            }
+        }
+    }
+
+    // many routes: a full table's worth of /24s and longer.
+    {
+        std::vector<RouteTrie::Route> routes;
+        for (int i = 0; i < 100000; i++) {
+            uint32_t dest = (uint32_t)rand() << 8;
+            routes.push_back({_addr(dest), _mask(i % 10 ? 24 : 28), {i, _addr(dest + 1), false}});
+        }
+        RouteTrie trie(routes);
+        for (int k = 0; k < 1000; k++) {
+            const RouteTrie::Route &r = routes[rand() % routes.size()];
+            in_addr dest = _addr(ntohl(r.dest.s_addr) + 1);
+            int want = _brute(routes, dest);
+            assert(trie.lookup(dest)->device_id == routes[want].hop.device_id);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "tcp_cong.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <algorithm>
+
+static const uint32_t kMss = 1000;
+
+// a window's worth of acks, one per segment, as if the window was full.
+static void _ack_window(TcpCongestion *cc, uint64_t &now, uint32_t rtt) {
+    uint32_t cwnd = cc->cwnd();
+    for (uint32_t acked = 0; acked < cwnd; acked += kMss) {
+        now += rtt * kMss / cwnd;
+        cc->on_ack({kMss, cwnd, cwnd - kMss, rtt, now, false});
+    }
+}
+
+int main() {
+    assert(tcp_cong_create("none", kMss) == nullptr);
+    assert(tcp_cong_available("reno") && tcp_cong_available("cubic") && tcp_cong_available("bbr"));
+    assert(tcp_cong_available(tcp_cong_default()));
+
+    // reno: doubles per RTT in slow start, then one segment per RTT.
+    {
+        std::unique_ptr<TcpCongestion> cc(tcp_cong_create("reno", kMss));
+        uint64_t now = 1;
+        assert(cc->cwnd() == 10 * kMss);
+        _ack_window(cc.get(), now, 10000);
+        assert(cc->cwnd() == 20 * kMss);
+
+        cc->on_loss(20 * kMss, now);
+        assert(cc->cwnd() == 10 * kMss && cc->ssthresh() == 10 * kMss);
+        _ack_window(cc.get(), now, 10000);
+        assert(cc->cwnd() == 11 * kMss);
+
+        cc->on_rto(11 * kMss, now);
+        assert(cc->cwnd() == kMss && cc->ssthresh() == 5500);
+
+        // in recovery: no growth.
+        cc->on_ack({kMss, kMss, 0, 10000, now, true});
+        assert(cc->cwnd() == kMss);
+        // not limited by the window: no growth.
+        cc->on_ack({kMss, 0, 0, 10000, now, false});
+        assert(cc->cwnd() == kMss);
+
+        // a new MSS keeps the window in segments.
+        _ack_window(cc.get(), now, 10000);
+        cc->set_mss(kMss / 2);
+        assert(cc->cwnd() == kMss && cc->ssthresh() == 2750);
+    }
+
+    // cubic: backs off to 70%, and grows back along a cubic curve, flat around the old window.
+    // the RTT is long, so that it's not in the Reno-friendly region.
+    {
+        std::unique_ptr<TcpCongestion> cc(tcp_cong_create("cubic", kMss));
+        uint64_t now = 1;
+        while (cc->cwnd() < 100 * kMss)
+            _ack_window(cc.get(), now, 100000);
+        uint32_t w_max = cc->cwnd();
+        cc->on_loss(w_max, now);
+        assert(cc->cwnd() == (uint32_t)(w_max * 0.7));
+
+        // K = cbrt(W_max * (1 - beta) / C) seconds, about 5 s for 160 segments.
+        uint64_t start = now;
+        while (now - start < 5000000)
+            _ack_window(cc.get(), now, 100000);
+        assert(cc->cwnd() > w_max * 0.95 && cc->cwnd() < w_max * 1.05);
+        while (now - start < 12000000)
+            _ack_window(cc.get(), now, 100000);
+        assert(cc->cwnd() > w_max * 1.3);
+    }
+
+    // bbr: a 1 MB/s bottleneck and a 10 ms RTT, in steps of 100 us. the sender follows
+    // the window and the pacing rate. it finds the path rate, and keeps the queue short,
+    // whatever the losses.
+    {
+        std::unique_ptr<TcpCongestion> cc(tcp_cong_create("bbr", kMss));
+        assert(cc->pacing_rate() > 0);
+        const uint32_t kBdp = 10 * kMss;
+        std::deque<uint64_t> queue; // the send time of each segment at the bottleneck
+        std::deque<std::pair<uint64_t, uint64_t>> acks; // (arrival, send time)
+        uint32_t in_flight = 0, served = 0;
+        double credit = 0;
+        size_t max_queue = 0;
+        for (uint64_t now = 1; now < 5000000; now += 100) {
+            credit = std::min(credit + cc->pacing_rate() * 100 / 1e6, 2.0 * kMss);
+            while (in_flight + kMss <= cc->cwnd() && credit >= kMss) {
+                queue.push_back(now);
+                in_flight += kMss;
+                credit -= kMss;
+            }
+
+            served = queue.empty() ? 0 : served + 100;
+            if (served >= kMss) {
+                acks.push_back({now + 10000, queue.front()});
+                queue.pop_front();
+                served -= kMss;
+            }
+
+            while (!acks.empty() && acks.front().first <= now) {
+                cc->on_ack({kMss, in_flight, in_flight - kMss, (uint32_t)(now - acks.front().second), now, false});
+                in_flight -= kMss;
+                acks.pop_front();
+                if (rand() % 100 == 0)
+                    cc->on_loss(in_flight, now);
+            }
+            if (now > 3000000)
+                max_queue = std::max(max_queue, queue.size());
+        }
+        assert(cc->pacing_rate() > 700000 && cc->pacing_rate() < 1300000);
+        assert(cc->cwnd() >= kBdp && cc->cwnd() <= 3 * kBdp);
+        assert(max_queue * kMss <= kBdp * 3 / 2);
+    }
+    return 0;
+}
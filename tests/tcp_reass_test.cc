@@ -0,0 +1,96 @@
+#include "tcp_reass.h"
+
+#include <cassert>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+
+// cut a stream into overlapping pieces, feed them in random order,
+// and check the delivered bytes are exactly the stream.
+int main() {
+    std::mt19937 rng(1);
+    for (int round = 0; round < 200; round++) {
+        const size_t kLen = 20000 + rand() % 20000;
+        // start close to the wrap-around sometimes.
+        uint32_t isn = (round % 2) ? (uint32_t)(0 - rand() % 30000) : (uint32_t)rand();
+
+        std::string stream(kLen, 0);
+        for (size_t i = 0; i < kLen; i++)
+            stream[i] = (char)(rand() & 0xff);
+
+        std::vector<std::pair<size_t, size_t>> pieces; // (offset, len)
+        for (size_t off = 0; off < kLen; ) {
+            size_t len = std::min<size_t>(1 + rand() % 1500, kLen - off);
+            pieces.push_back({off, len});
+            // retransmissions with other boundaries.
+            if (rand() % 4 == 0) {
+                size_t roff = off >= 700 ? off - rand() % 700 : 0;
+                pieces.push_back({roff, std::min<size_t>(1 + rand() % 3000, kLen - roff)});
+            }
+            off += len;
+        }
+        std::shuffle(pieces.begin(), pieces.end(), rng);
+
+        TcpReassQueue q;
+        q.set_fin(isn + kLen);
+
+        std::string got;
+        uint32_t next = isn;
+        bool fin = false;
+        auto sink = [&](const char *data, size_t len) {
+            // a small receive buffer sometimes.
+            size_t take = (rand() % 5 == 0) ? (len + 1) / 2 : len;
+            got.append(data, take);
+            return take;
+        };
+
+        for (auto &p : pieces) {
+            uint32_t seq = isn + p.first;
+            if (seq_lt(seq, next)) {
+                // the caller trims what it already has, like tcp_segment_handler does.
+                size_t old = next - seq;
+                if (old >= p.second) continue;
+                q.insert(next, stream.data() + p.first + old, p.second - old);
+            } else {
+                q.insert(seq, stream.data() + p.first, p.second);
+            }
+            next += q.deliver(next, sink, &fin);
+        }
+        // drain what the short sink left.
+        while (!fin) {
+            size_t n = q.deliver(next, sink, &fin);
+            assert(n > 0 || fin);
+            next += n;
+        }
+
+        assert(got == stream);
+        assert(next == (uint32_t)(isn + kLen));
+        assert(q.bytes() == 0 && q.intervals() == 0);
+    }
+
+    // the SACK blocks: touching intervals merge, the latest block comes first, and only
+    // what is beyond `next` counts.
+    {
+        TcpReassQueue q;
+        char data[1000] = {};
+        uint32_t base = (uint32_t)-2500; // across the wrap-around
+        q.insert(base + 1000, data, 500);
+        q.insert(base + 1500, data, 500);
+        q.insert(base + 3000, data, 100);
+        q.insert(base + 4000, data, 100);
+        q.insert(base + 5000, data, 100);
+
+        TcpSackBlock blocks[4];
+        assert(q.sack_blocks(base, base + 4000, blocks, 4) == 4);
+        assert(blocks[0].start == base + 4000 && blocks[0].end == base + 4100);
+        assert(blocks[1].start == base + 1000 && blocks[1].end == base + 2000);
+        assert(blocks[2].start == base + 3000 && blocks[3].start == base + 5000);
+
+        assert(q.sack_blocks(base + 1200, base + 5000, blocks, 2) == 2);
+        assert(blocks[0].start == base + 5000 && blocks[1].start == base + 1200 && blocks[1].end == base + 2000);
+        assert(q.sack_blocks(base, base, blocks, 0) == 0);
+    }
+    return 0;
+}
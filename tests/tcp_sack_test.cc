@@ -0,0 +1,85 @@
+#include "tcp_sack.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <vector>
+
+// sack random ranges of a window, and check the scoreboard against a plain bitmap of it.
+int main() {
+    const uint32_t kWindow = 5000;
+    for (int round = 0; round < 200; round++) {
+        // start close to the wrap-around sometimes.
+        uint32_t una = (round % 2) ? (uint32_t)(0 - rand() % kWindow) : (uint32_t)rand();
+        uint32_t end = una + kWindow;
+        std::vector<bool> sacked(kWindow, false); // by offset from the first una
+
+        uint32_t base = una;
+        TcpSackScoreboard sb;
+        for (int op = 0; op < 100; op++) {
+            if (rand() % 10 == 0) {
+                // a cumulative ack.
+                una += rand() % 300;
+                if (seq_gt(una, end))
+                    una = end;
+                sb.advance(una);
+                for (uint32_t s = base; s != una; s++)
+                    sacked[s - base] = false;
+            } else {
+                uint32_t start = una + rand() % (end - una + 1);
+                uint32_t len = rand() % 400;
+                uint32_t stop = seq_min(start + len, end);
+                size_t fresh = 0;
+                for (uint32_t s = start; s != stop; s++) {
+                    fresh += !sacked[s - base];
+                    sacked[s - base] = true;
+                }
+                assert(sb.insert(start, stop) == fresh);
+            }
+
+            size_t total = 0;
+            for (uint32_t s = una; s != end; s++)
+                total += sacked[s - base];
+            assert(sb.bytes() == total);
+            assert(sb.empty() == (total == 0));
+
+            // probe a few seqs.
+            for (int k = 0; k < 5; k++) {
+                uint32_t seq = una + rand() % (end - una + 1);
+                size_t below = 0;
+                for (uint32_t s = una; s != seq; s++)
+                    below += sacked[s - base];
+                assert(sb.bytes_below(seq) == below);
+
+                uint32_t unsacked = seq;
+                while (unsacked != end && sacked[unsacked - base])
+                    unsacked++;
+                assert(sb.next_unsacked(seq) == unsacked);
+
+                uint32_t next = unsacked;
+                while (next != end && !sacked[next - base])
+                    next++;
+                assert(sb.next_sacked(unsacked, end) == next);
+            }
+            if (!sb.empty()) {
+                uint32_t highest = end;
+                while (!sacked[highest - 1 - base])
+                    highest--;
+                assert(sb.highest() == highest);
+            }
+        }
+
+        sb.clear();
+        assert(sb.empty() && sb.bytes() == 0 && sb.ranges() == 0);
+    }
+
+    // ranges that touch merge into one.
+    TcpSackScoreboard sb;
+    assert(sb.insert(100, 200) == 100);
+    assert(sb.insert(300, 400) == 100);
+    assert(sb.insert(200, 300) == 100);
+    assert(sb.ranges() == 1 && sb.highest() == 400);
+    assert(sb.insert(150, 350) == 0);
+    sb.advance(250);
+    assert(sb.bytes() == 150 && sb.next_unsacked(100) == 100 && sb.next_unsacked(250) == 400);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "timer_wheel.h"
+
+#include <cassert>
+#include <vector>
+#include <cstdlib>
+
+// drive a wheel by hand and check every timer fires exactly at its tick.
+int main() {
+    const int kTimers = 2000;
+    TimerWheel wheel(12345);
+
+    std::vector<Timer> timers(kTimers);
+    std::vector<uint64_t> fired_at(kTimers, 0);
+    uint64_t now = 12345;
+
+    for (int i = 0; i < kTimers; i++) {
+        timers[i].callback = [&, i]() { fired_at[i] = now; };
+        // cover all four levels.
+        uint64_t delay = (i % 4 == 0) ? rand() % 64 
+            : (i % 4 == 1) ? rand() % 4096 
+            : (i % 4 == 2) ? rand() % 100000
+            : rand() % 2000000;
+        wheel.schedule(&timers[i], now + delay);
+    }
+
+    // cancel and re-arm some of them.
+    for (int i = 0; i < kTimers; i += 7)
+        assert(wheel.cancel(&timers[i]));
+    for (int i = 0; i < kTimers; i += 14)
+        wheel.schedule(&timers[i], now + 77);
+    assert(!wheel.cancel(&timers[7]));
+
+    std::vector<uint64_t> expected(kTimers);
+    for (int i = 0; i < kTimers; i++)
+        expected[i] = timers[i].pending() ? timers[i].expires : 0;
+
+    TimerListNode expired;
+    expired.prev = expired.next = &expired;
+    size_t fired = 0;
+    while (wheel.pending_count() > 0) {
+        // uneven steps, like a lagging timer thread.
+        now += 1 + rand() % 50;
+        wheel.advance(now, &expired);
+        while (expired.next != &expired) {
+            Timer *t = static_cast<Timer*>(expired.next);
+            wheel.cancel(t);
+            t->callback();
+            fired++;
+        }
+    }
+
+    for (int i = 0; i < kTimers; i++) {
+        if (expected[i] == 0) {
+            assert(fired_at[i] == 0);
+        } else {
+            // fired in the advance() call covering its tick.
+            assert(fired_at[i] >= expected[i] && fired_at[i] < expected[i] + 50);
+        }
+    }
+    assert(fired == (size_t)(kTimers - kTimers / 7 - 1 + (kTimers + 13) / 14));
+    return 0;
+}